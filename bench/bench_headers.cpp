@@ -0,0 +1,166 @@
+/*
+    Microbenchmark of the response header building of http_conn::process_write().
+
+        reference : the previous add_status_line() / add_headers() chain, one vsnprintf() per header
+                    into the write buffer, the error page formatted again every time
+        templates : http_headers, the head literal of the extension plus the Content-Length digits,
+                    the Date/Connection tail copied after it, the prebuilt error heads and pages
+
+    The reference sends no Date or Vary header, the templates do, so they produce a few more bytes. Both
+    versions must produce the same status line, Content-Length, Connection header and error page,
+    the benchmark aborts otherwise.
+
+    Build and run from the repository root:
+        g++ -O2 -I. bench/bench_headers.cpp http_headers.cpp -o bench_headers
+        ./bench_headers [rounds]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <string>
+#include "http_headers.h"
+
+static const int WRITE_BUFFER_SIZE = 1024;
+static char write_buf[WRITE_BUFFER_SIZE];
+static int write_index;
+
+// the previous implementation, as it was in http_conn.cpp
+static const char* error_404_title = "Not Found";
+static const char* error_404_form = "The requested file was not found on this server.\n";
+
+static bool add_response(const char* format, ...) {
+    if(write_index >= WRITE_BUFFER_SIZE) {
+        return false;
+    }
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(write_buf + write_index, WRITE_BUFFER_SIZE - 1 - write_index, format, arg_list);
+    va_end(arg_list);
+    if(len >= (WRITE_BUFFER_SIZE - 1 - write_index)) {
+        return false;
+    }
+    write_index += len;
+    return true;
+}
+
+static bool add_headers(off_t content_len, bool linger) {
+    return add_response("Content-Length: %lld\r\n", (long long)content_len)
+        && add_response("Content-Type:%s\r\n", "text/html")
+        && add_response("Connection: %s\r\n", linger ? "keep-alive" : "close")
+        && add_response("%s", "\r\n");
+}
+
+static size_t reference_file(off_t length, bool linger) {
+    write_index = 0;
+    add_response("%s %d %s\r\n", "HTTP/1.1", 200, "OK");
+    add_headers(length, linger);
+    return write_index;
+}
+
+static size_t reference_404(bool linger) {
+    write_index = 0;
+    add_response("%s %d %s\r\n", "HTTP/1.1", 404, error_404_title);
+    add_headers(strlen(error_404_form), linger);
+    add_response("%s", error_404_form);
+    return write_index;
+}
+
+// what process_write() now does: the head and the tail in the write buffer, an error head and page shared
+static http_headers headers;
+
+static size_t template_file(const char* path, off_t length, bool linger) {
+    size_t head_len = http_headers::build_head(write_buf, WRITE_BUFFER_SIZE, path, length);
+    return head_len + headers.build_tail(write_buf + head_len, WRITE_BUFFER_SIZE - head_len, linger);
+}
+
+static size_t template_404(bool linger) {
+    size_t head_len = 0, page_len = 0;
+    headers.error_head(http_headers::NOT_FOUND, head_len);
+    http_headers::error_page(http_headers::NOT_FOUND, page_len);
+    return head_len + headers.build_tail(write_buf, WRITE_BUFFER_SIZE, linger) + page_len;
+}
+
+// the header lines of 'text' except Date and Content-Type, which the versions write differently,
+// and the Vary of the compressible types, which the reference did not send
+static std::string comparable(const char* text, size_t len) {
+    std::string out;
+    std::string s(text, len);
+    size_t pos = 0;
+    while(pos < s.size()) {
+        size_t end = s.find("\r\n", pos);
+        if(end == std::string::npos || end == pos) {
+            out += s.substr(pos);
+            break;
+        }
+        std::string line = s.substr(pos, end - pos);
+        if(line.compare(0, 5, "Date:") != 0 && line.compare(0, 13, "Content-Type:") != 0 && line.compare(0, 5, "Vary:") != 0) {
+            out += line + "\n";
+        }
+        pos = end + 2;
+    }
+    return out;
+}
+
+static bool check() {
+    size_t len = reference_file(479, true);
+    std::string expected = comparable(write_buf, len);
+    len = template_file("/index.html", 479, true);
+    if(comparable(write_buf, len) != expected) {
+        return false;
+    }
+    len = reference_404(false);
+    expected = comparable(write_buf, len);
+    char response[http_headers::MAX_RESPONSE_SIZE];
+    len = headers.build_error_response(response, sizeof(response), http_headers::NOT_FOUND, false);
+    return comparable(response, len) == expected;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile size_t sink;
+
+int main(int argc, char* argv[]) {
+    long rounds = argc > 1 ? atol(argv[1]) : 1000000;
+    if(!check()) {
+        printf("the templates produce different headers than the reference\n");
+        return 1;
+    }
+    const char* paths[] = {"/index.html", "/images/image1.jpg", "/style.css"};
+    const off_t lengths[] = {479, 67313, 119};
+
+    printf("%-22s %-10s %-12s %-8s\n", "response", "version", "ns/response", "speedup");
+    for(int f = 0; f < 3; f++) {
+        double t0 = now_ns();
+        for(long i = 0; i < rounds; i++) {
+            sink = reference_file(lengths[f], i & 1);
+        }
+        double reference_ns = (now_ns() - t0) / rounds;
+        t0 = now_ns();
+        for(long i = 0; i < rounds; i++) {
+            sink = template_file(paths[f], lengths[f], i & 1);
+        }
+        double ns = (now_ns() - t0) / rounds;
+        printf("%-22s %-10s %-12.1f %-8s\n", paths[f], "reference", reference_ns, "1.00x");
+        printf("%-22s %-10s %-12.1f %.2fx\n", paths[f], "templates", ns, reference_ns / ns);
+    }
+
+    double t0 = now_ns();
+    for(long i = 0; i < rounds; i++) {
+        sink = reference_404(i & 1);
+    }
+    double reference_ns = (now_ns() - t0) / rounds;
+    t0 = now_ns();
+    for(long i = 0; i < rounds; i++) {
+        sink = template_404(i & 1);
+    }
+    double ns = (now_ns() - t0) / rounds;
+    printf("%-22s %-10s %-12.1f %-8s\n", "404", "reference", reference_ns, "1.00x");
+    printf("%-22s %-10s %-12.1f %.2fx\n", "404", "templates", ns, reference_ns / ns);
+    return 0;
+}
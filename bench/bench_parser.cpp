@@ -0,0 +1,318 @@
+/*
+    Microbenchmark of the request line and header scanning of http_conn.
+
+    Each corpus request is parsed the way http_conn::process_read() does it: split into lines,
+    request line split into method / URL / version, header names matched. Parsing works in place
+    (it writes '\0's), so every round first copies the request into a buffer, as read() would.
+        reference : the previous byte-at-a-time parse_line(), strpbrk() and the strncasecmp() chain
+        scalar, sse4.2, avx2 : the http_scanner versions (the ones this CPU does not support are skipped)
+    Every version must extract the same fields as the reference, and find the same bytes as the scalar
+    scanner in random buffers of every length up to 100, the benchmark aborts otherwise.
+
+    Build and run from the repository root:
+        g++ -O2 -I. bench/bench_parser.cpp http_scanner.cpp -o bench_parser
+        ./bench_parser [rounds]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "http_scanner.h"
+
+static const char* corpus_names[] = {"curl", "webbench", "chrome", "firefox"};
+static const char* corpus[] = {
+    // curl with its default headers
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:9006\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    // webbench -2 (HTTP/1.1)
+    "GET /index.html HTTP/1.1\r\n"
+    "User-Agent: WebBench 1.5\r\n"
+    "Host: 192.168.68.128\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+
+    // a header-heavy desktop Chrome navigation
+    "GET /images/image1.jpg HTTP/1.1\r\n"
+    "Host: 192.168.68.128:8888\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"122\", \"Not(A:Brand\";v=\"24\", \"Google Chrome\";v=\"122\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/122.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+    "application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: http://192.168.68.128:8888/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,fr;q=0.8\r\n"
+    "Cookie: _ga=GA1.1.1838221944.1709127311; session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkw"
+    "IiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyfQ.SflKxwRJSMeKKF2QT4fwpMeJf36POk6yJV_adQssw5c; theme=dark\r\n"
+    "If-None-Match: \"65e0a1b2-1f4\"\r\n"
+    "If-Modified-Since: Thu, 29 Feb 2024 15:04:18 GMT\r\n"
+    "\r\n",
+
+    // a desktop Firefox page load
+    "GET /style.css HTTP/1.1\r\n"
+    "Host: 192.168.68.128:8888\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:123.0) Gecko/20100101 Firefox/123.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://192.168.68.128:8888/index.html\r\n"
+    "Cookie: _ga=GA1.1.1838221944.1709127311; theme=dark\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-Modified-Since: Thu, 29 Feb 2024 15:04:18 GMT\r\n"
+    "If-None-Match: \"65e0a1b2-9c\"\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n",
+};
+
+// what the parser extracts from a request, compared between the versions
+struct fields {
+    int lines;
+    int method;         // offsets in the buffer, -1 if not found
+    int url;
+    int version;
+    int host;
+    int connection;
+    int content_length;
+    int unknown;        // headers the server ignores
+};
+
+static bool same(const fields& a, const fields& b) {
+    return memcmp(&a, &b, sizeof(fields)) == 0;
+}
+
+enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+
+// the previous parse_line() of http_conn
+static LINE_STATUS reference_line(char* buf, int& checked, int read_index) {
+    for(; checked < read_index; ++checked) {
+        char temp = buf[checked];
+        if(temp == '\r') {
+            if(checked + 1 == read_index) {
+                return LINE_OPEN;
+            } else if(buf[checked + 1] == '\n') {
+                buf[checked++] = '\0';
+                buf[checked++] = '\0';
+                return LINE_OK;
+            }
+            return LINE_BAD;
+        } else if(temp == '\n') {
+            if(checked > 1 && buf[checked - 1] == '\r') {
+                buf[checked - 1] = '\0';
+                buf[checked++] = '\0';
+                return LINE_OK;
+            }
+            return LINE_BAD;
+        }
+    }
+    return LINE_OPEN;
+}
+
+// the previous parse_request_line() and parse_headers(), field extraction only
+static fields reference_parse(char* buf, int read_index) {
+    fields f;
+    memset(&f, -1, sizeof(f));
+    f.lines = 0;
+    f.unknown = 0;
+    int checked = 0, start = 0;
+    while(reference_line(buf, checked, read_index) == LINE_OK) {
+        char* text = buf + start;
+        start = checked;
+        if(f.lines++ == 0) {
+            char* url = strpbrk(text, " \t");
+            if(!url) {
+                break;
+            }
+            *url++ = '\0';
+            f.method = text - buf;
+            char* version = strpbrk(url, " \t");
+            if(!version) {
+                break;
+            }
+            *version++ = '\0';
+            f.url = url - buf;
+            f.version = version - buf;
+        } else if(text[0] == '\0') {
+            break;
+        } else if(strncasecmp(text, "Connection:", 11) == 0) {
+            text += 11;
+            f.connection = text + strspn(text, " \t") - buf;
+        } else if(strncasecmp(text, "Content-Length:", 15) == 0) {
+            text += 15;
+            f.content_length = text + strspn(text, " \t") - buf;
+        } else if(strncasecmp(text, "Host:", 5) == 0) {
+            text += 5;
+            f.host = text + strspn(text, " \t") - buf;
+        } else {
+            f.unknown++;
+        }
+    }
+    return f;
+}
+
+// parse_line() of http_conn with a scanner
+static LINE_STATUS scanner_line(const http_scanner& scanner, char* buf, int& checked, int read_index) {
+    checked += scanner.line_end(buf + checked, read_index - checked);
+    if(checked == read_index) {
+        return LINE_OPEN;
+    }
+    if(buf[checked] == '\r') {
+        if(checked + 1 == read_index) {
+            return LINE_OPEN;
+        } else if(buf[checked + 1] == '\n') {
+            buf[checked++] = '\0';
+            buf[checked++] = '\0';
+            return LINE_OK;
+        }
+        return LINE_BAD;
+    }
+    if(checked > 1 && buf[checked - 1] == '\r') {
+        buf[checked - 1] = '\0';
+        buf[checked++] = '\0';
+        return LINE_OK;
+    }
+    return LINE_BAD;
+}
+
+// parse_request_line() and parse_headers() of http_conn with a scanner, field extraction only
+static fields scanner_parse(const http_scanner& scanner, char* buf, int read_index) {
+    fields f;
+    memset(&f, -1, sizeof(f));
+    f.lines = 0;
+    f.unknown = 0;
+    int checked = 0, start = 0;
+    while(scanner_line(scanner, buf, checked, read_index) == LINE_OK) {
+        char* text = buf + start;
+        int len = checked - 2 - start;
+        start = checked;
+        if(f.lines++ == 0) {
+            int offset = scanner.token_end(text, len);
+            if(offset == len) {
+                break;
+            }
+            char* url = text + offset;
+            *url++ = '\0';
+            f.method = text - buf;
+            len -= url - text;
+            offset = scanner.token_end(url, len);
+            if(offset == len) {
+                break;
+            }
+            char* version = url + offset;
+            *version++ = '\0';
+            f.url = url - buf;
+            f.version = version - buf;
+            continue;
+        } else if(text[0] == '\0') {
+            break;
+        }
+        int name_len = scanner.name_end(text, len);
+        if(name_len == 10 && strncasecmp(text, "Connection", 10) == 0) {
+            text += 11;
+            f.connection = text + strspn(text, " \t") - buf;
+        } else if(name_len == 14 && strncasecmp(text, "Content-Length", 14) == 0) {
+            text += 15;
+            f.content_length = text + strspn(text, " \t") - buf;
+        } else if(name_len == 4 && strncasecmp(text, "Host", 4) == 0) {
+            text += 5;
+            f.host = text + strspn(text, " \t") - buf;
+        } else {
+            f.unknown++;
+        }
+    }
+    return f;
+}
+
+// random buffers made mostly of the bytes the scanners look for
+static bool check_random(const http_scanner& scanner) {
+    const char alphabet[] = "ab \t:\r\n";
+    char random[128];
+    const http_scanner* scalar = http_scanner::get("scalar");
+    srand(42);
+    for(int round = 0; round < 100000; round++) {
+        size_t len = rand() % 101;
+        for(size_t i = 0; i < len; i++) {
+            random[i] = rand() % 16 == 0 ? '\0' : alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+        if(scanner.line_end(random, len) != scalar->line_end(random, len)
+                || scanner.token_end(random, len) != scalar->token_end(random, len)
+                || scanner.name_end(random, len) != scalar->name_end(random, len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char buffer[2048];   // the read buffer of http_conn
+static volatile int sink;
+
+int main(int argc, char* argv[]) {
+    long rounds = argc > 1 ? atol(argv[1]) : 1000000;
+    const char* scanner_names[] = {"scalar", "sse4.2", "avx2"};
+    const int corpus_count = sizeof(corpus) / sizeof(corpus[0]);
+
+    printf("best scanner on this CPU: %s\n", http_scanner::best().name());
+    for(const char* name : scanner_names) {
+        const http_scanner* scanner = http_scanner::get(name);
+        if(scanner && !check_random(*scanner)) {
+            printf("%s finds different bytes than the scalar scanner\n", name);
+            return 1;
+        }
+    }
+    printf("%-10s %-8s %-10s %-12s %-8s\n", "corpus", "bytes", "parser", "ns/request", "speedup");
+    for(int c = 0; c < corpus_count; c++) {
+        int len = strlen(corpus[c]);
+        memcpy(buffer, corpus[c], len);
+        fields expected = reference_parse(buffer, len);
+
+        double t0 = now_ns();
+        for(long i = 0; i < rounds; i++) {
+            memcpy(buffer, corpus[c], len);
+            sink = reference_parse(buffer, len).lines;
+        }
+        double reference_ns = (now_ns() - t0) / rounds;
+        printf("%-10s %-8d %-10s %-12.1f %-8s\n", corpus_names[c], len, "reference", reference_ns, "1.00x");
+
+        for(const char* name : scanner_names) {
+            const http_scanner* scanner = http_scanner::get(name);
+            if(!scanner) {
+                continue;
+            }
+            memcpy(buffer, corpus[c], len);
+            if(!same(scanner_parse(*scanner, buffer, len), expected)) {
+                printf("%s: %s parses differently from the reference\n", corpus_names[c], name);
+                return 1;
+            }
+
+            t0 = now_ns();
+            for(long i = 0; i < rounds; i++) {
+                memcpy(buffer, corpus[c], len);
+                sink = scanner_parse(*scanner, buffer, len).lines;
+            }
+            double ns = (now_ns() - t0) / rounds;
+            printf("%-10s %-8d %-10s %-12.1f %.2fx\n", corpus_names[c], len, name, ns, reference_ns / ns);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+    Microbenchmark of the threadpool work queue.
+
+    Compares the lock-free ring queue of threadpool<T> with the previous design
+    (std::list + mutex + one sem_post/sem_wait pair per request) for several
+    producer and consumer (worker) counts. Producers append the same task object
+    over and over; workers count the processed requests.
+
+    Build and run from the repository root:
+        g++ -O2 -I. bench/bench_queue.cpp log.cpp -pthread -o bench_queue
+        ./bench_queue [requests_per_producer]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <list>
+#include <atomic>
+#include <vector>
+#include "threadpool.h"
+
+// the request type: one per producer, padded so producers do not share a counter
+struct alignas(CACHE_LINE_SIZE) task {
+    std::atomic<long> processed{0};
+    std::atomic<uint64_t> enqueued{0};
+    void process() {
+        processed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // admission control: the task object is queued many times at once, the timestamp is only approximate
+    void set_enqueue_time(uint64_t us) { enqueued.store(us, std::memory_order_relaxed); }
+    uint64_t enqueue_time() const { return enqueued.load(std::memory_order_relaxed); }
+    bool hung_up() { return false; }
+    void drop() { process(); }
+    void shed() { process(); }
+};
+
+// the threadpool as it was before the ring queue, kept here as the baseline
+template<typename T>
+class list_threadpool {
+public:
+    list_threadpool(int thread_number, int max_request) : m_max_requests(max_request) {
+        for(int i = 0; i < thread_number; i++) {
+            pthread_t tid;
+            if(pthread_create(&tid, NULL, worker, this) != 0 || pthread_detach(tid) != 0) {
+                throw std::exception();
+            }
+        }
+    }
+
+    bool append(T* request) {
+        m_queuelocker.lock();
+        if((int)m_workqueue.size() > m_max_requests) {
+            m_queuelocker.unlock();
+            return false;
+        }
+        m_workqueue.push_back(request);
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+
+private:
+    static void* worker(void* arg) {
+        ((list_threadpool*)arg)->run();
+        return arg;
+    }
+
+    void run() {
+        while(true) {
+            m_queuestat.wait();
+            m_queuelocker.lock();
+            if(m_workqueue.empty()) {
+                m_queuelocker.unlock();
+                continue;
+            }
+            T* request = m_workqueue.front();
+            m_workqueue.pop_front();
+            m_queuelocker.unlock();
+            request->process();
+        }
+    }
+
+    int m_max_requests;
+    std::list<T*> m_workqueue;
+    locker m_queuelocker;
+    sem m_queuestat;
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template<typename Pool>
+struct producer_arg {
+    Pool* pool;
+    task* t;
+    long requests;
+};
+
+template<typename Pool>
+static void* producer(void* arg) {
+    producer_arg<Pool>* p = (producer_arg<Pool>*)arg;
+    for(long i = 0; i < p->requests; i++) {
+        while(!p->pool->append(p->t)) {
+            cpu_relax();
+        }
+    }
+    return NULL;
+}
+
+// returns requests per second. The pool is leaked on purpose: its workers are detached and never exit
+template<typename Pool>
+static double run(int producers, int consumers, long requests) {
+    Pool* pool = new Pool(consumers, threadpool<task>::DEFAULT_MAX_REQUEST);
+    std::vector<task> tasks(producers);
+    std::vector<producer_arg<Pool>> args(producers);
+    std::vector<pthread_t> threads(producers);
+
+    double start = now_seconds();
+    for(int i = 0; i < producers; i++) {
+        args[i] = producer_arg<Pool>{pool, &tasks[i], requests};
+        pthread_create(&threads[i], NULL, producer<Pool>, &args[i]);
+    }
+    for(int i = 0; i < producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // wait for the workers to drain the queue
+    for(int i = 0; i < producers; i++) {
+        while(tasks[i].processed.load(std::memory_order_relaxed) < requests) {
+            sched_yield();
+        }
+    }
+    return producers * requests / (now_seconds() - start);
+}
+
+int main(int argc, char* argv[]) {
+    long requests = argc > 1 ? atol(argv[1]) : 200000;
+    const int producer_counts[] = {1, 2, 4};
+    const int consumer_counts[] = {1, 2, 4, 8};
+
+    printf("%-10s %-10s %-16s %-16s %-8s\n", "producers", "consumers", "list req/s", "ring req/s", "speedup");
+    for(int p : producer_counts) {
+        for(int c : consumer_counts) {
+            double list_rate = run<list_threadpool<task>>(p, c, requests);
+            double ring_rate = run<threadpool<task>>(p, c, requests);
+            printf("%-10d %-10d %-16.0f %-16.0f %-8.2f\n", p, c, list_rate, ring_rate, ring_rate / list_rate);
+        }
+    }
+    return 0;
+}
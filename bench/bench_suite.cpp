@@ -0,0 +1,352 @@
+/*
+    The microbenchmark suite: the hot paths of the server without sockets, one run for all of them.
+
+        parse       : http_conn parsing requests held in memory (receive(), process_requests(), which
+                      runs process_read() and process_write(), then sent() and end_batch() as if the
+                      replies were written), for a curl request from the response cache, the same
+                      from the file cache, a browser request, a 404, and 16 pipelined requests
+        threadpool  : requests through threadpool<T> from one producer to 1, 2, 4 and 8 workers
+        timers      : timer_wheel add, adjust and tick with 10k, 100k and 1M armed timers
+        response    : assembling response headers with http_headers, a 200 head and tail, an error
+
+    Every case runs a fixed number of operations (times -s), once to warm up and then -r times; the
+    median, min and max of the repetitions are printed as one JSON object per line:
+        {"suite":"parse","case":"curl_cached","ops":200000,"ns_per_op":412.3,"min":405.1,"max":430.8}
+    so that runs can be compared with a script, before and after a change. The inputs are fixed and
+    the random generators seeded, two runs do the same work.
+
+    Build and run from the repository root (parse serves resources/):
+        g++ -O2 -I. bench/bench_suite.cpp http_conn.cpp http_headers.cpp http_scanner.cpp file_cache.cpp \
+            response_cache.cpp gzip_cache.cpp buffer_pool.cpp page_cache.cpp metrics.cpp log.cpp -pthread -lz -o bench_suite
+        ./bench_suite [-s scale] [-r repetitions] [suite...]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <vector>
+#include "http_conn.h"
+#include "threadpool.h"
+#include "timer_wheel.h"
+#include "http_headers.h"
+
+extern const char* doc_root;
+
+static double scale = 1;
+static int repetitions = 5;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+    Run 'body' (which does 'ops' operations and returns the nanoseconds they took, setup excluded)
+    once to warm up and 'repetitions' times for the result.
+*/
+static void measure(const char* suite, const char* name, long ops, const std::function<double(long)>& body) {
+    body(ops);
+    std::vector<double> per_op;
+    for(int i = 0; i < repetitions; i++) {
+        per_op.push_back(body(ops) / ops);
+    }
+    std::sort(per_op.begin(), per_op.end());
+    printf("{\"suite\":\"%s\",\"case\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f,\"min\":%.1f,\"max\":%.1f}\n",
+           suite, name, ops, per_op[per_op.size() / 2], per_op.front(), per_op.back());
+    fflush(stdout);
+}
+
+static long operations(long base) {
+    long n = (long)(base * scale);
+    return n > 0 ? n : 1;
+}
+
+// ------------------------------------------------------------------------------------------ parse
+
+static const char* const CURL_REQUEST =
+    "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:9006\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n"
+    "Connection: keep-alive\r\n\r\n";
+static const char* const BROWSER_REQUEST =
+    "GET /index.html HTTP/1.1\r\nHost: 192.168.68.128:8888\r\nConnection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\nUpgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\nAccept-Language: en-US,en;q=0.9\r\n"
+    "Referer: http://192.168.68.128:8888/\r\n\r\n";
+static const char* const MISSING_REQUEST =
+    "GET /no/such/file.html HTTP/1.1\r\nHost: 127.0.0.1:9006\r\nConnection: keep-alive\r\n\r\n";
+
+/*
+    'requests' bytes holding 'count' requests, handed to a connection without a socket 'ops / count'
+    times; every batch of replies is "sent" at once. Returns the nanoseconds per request.
+*/
+static double serve_in_memory(http_conn& conn, const std::string& requests, int count, long ops) {
+    long rounds = ops / count > 0 ? ops / count : 1;
+    double start = now_ns();
+    for(long i = 0; i < rounds; i++) {
+        int offset = 0;
+        while(offset < (int)requests.size()) {
+            int taken = conn.receive(requests.data() + offset, requests.size() - offset);
+            if(taken <= 0 || !conn.process_requests()) {
+                fprintf(stderr, "parse: the request was refused\n");
+                exit(1);
+            }
+            offset += taken;
+            while(conn.has_replies()) {
+                struct iovec* iov;
+                int blocks = conn.send_blocks(&iov);
+                size_t bytes = 0;
+                for(int b = 0; b < blocks; b++) {
+                    bytes += iov[b].iov_len;
+                }
+                conn.sent(bytes);
+                if(!conn.end_batch()) {
+                    fprintf(stderr, "parse: the connection was closed\n");
+                    exit(1);
+                }
+                // a batch cut short leaves complete requests in the read buffer
+                if(!conn.process_requests()) {
+                    exit(1);
+                }
+            }
+        }
+    }
+    // scaled to 'ops' requests, in case it is not a multiple of 'count'
+    return (now_ns() - start) * ops / (rounds * count);
+}
+
+static void bench_parse() {
+    doc_root = "resources";
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    // no socket and no epoll object: only the in-memory half of the connection is used. Both are
+    // leaked, the idle timer of the connection stays armed in the wheel
+    timer_wheel* wheel = new timer_wheel(100, current_ms());
+    http_conn* conn = new http_conn();
+    conn->init(-1, address, -1, wheel);
+
+    std::string pipelined;
+    for(int i = 0; i < 16; i++) {
+        pipelined += CURL_REQUEST;
+    }
+    struct {
+        const char* name;
+        std::string requests;
+        int count;
+        size_t cache_budget;
+    } cases[] = {
+        { "curl_cached", CURL_REQUEST, 1, 64 * 1024 * 1024 },
+        { "curl_file", CURL_REQUEST, 1, 0 },
+        { "browser", BROWSER_REQUEST, 1, 64 * 1024 * 1024 },
+        { "not_found", MISSING_REQUEST, 1, 64 * 1024 * 1024 },
+        { "pipelined_16", pipelined, 16, 64 * 1024 * 1024 },
+    };
+    for(auto& c : cases) {
+        http_conn::m_response_cache.set_budget(c.cache_budget);
+        measure("parse", c.name, operations(200000), [&](long ops) {
+            return serve_in_memory(*conn, c.requests, c.count, ops);
+        });
+    }
+}
+
+// ------------------------------------------------------------------------------------- threadpool
+
+// the request type: counts how often it was processed
+struct alignas(CACHE_LINE_SIZE) task {
+    std::atomic<long> processed{0};
+    std::atomic<uint64_t> enqueued{0};
+    void process() {
+        processed.fetch_add(1, std::memory_order_relaxed);
+    }
+    void set_enqueue_time(uint64_t us) { enqueued.store(us, std::memory_order_relaxed); }
+    uint64_t enqueue_time() const { return enqueued.load(std::memory_order_relaxed); }
+    bool hung_up() { return false; }
+    void drop() { process(); }
+    void shed() { process(); }
+};
+
+static void bench_threadpool() {
+    const int worker_counts[] = { 1, 2, 4, 8 };
+    for(int workers : worker_counts) {
+        // leaked on purpose: the workers are detached and never exit
+        threadpool<task>* pool = new threadpool<task>(workers);
+        task* t = new task();
+        char name[32];
+        snprintf(name, sizeof(name), "workers_%d", workers);
+        measure("threadpool", name, operations(1000000), [&](long ops) {
+            long base = t->processed.load();
+            double start = now_ns();
+            for(long i = 0; i < ops; i++) {
+                while(!pool->append(t)) {
+                    cpu_relax();
+                }
+            }
+            while(t->processed.load(std::memory_order_relaxed) - base < ops) {
+                sched_yield();
+            }
+            return now_ns() - start;
+        });
+    }
+}
+
+// ----------------------------------------------------------------------------------------- timers
+
+static long expired_count = 0;
+static void count_expired(void*) { expired_count++; }
+
+static void bench_timers() {
+    const int WINDOW = 15000;           // spread of the expirations, ms
+    const long armed_counts[] = { 10000, 100000, 1000000 };
+    for(long armed : armed_counts) {
+        long ops = operations(1000000);
+        char name[32];
+        std::vector<wheel_timer> timers(armed + ops);
+        const uint64_t start = 1000000;
+
+        // arm 'armed' timers in a new wheel, the setup of every case
+        auto arm = [&](timer_wheel& wheel, std::mt19937& rng) {
+            for(long i = 0; i < armed; i++) {
+                timers[i] = wheel_timer();
+                timers[i].cb_func = count_expired;
+                timers[i].expire = start + rng() % WINDOW;
+                wheel.add_timer(&timers[i]);
+            }
+        };
+
+        snprintf(name, sizeof(name), "add_%ld", armed);
+        measure("timers", name, ops, [&](long ops) {
+            std::mt19937 rng(1);
+            timer_wheel wheel(100, start);
+            arm(wheel, rng);
+            double t0 = now_ns();
+            for(long i = armed; i < armed + ops; i++) {
+                timers[i] = wheel_timer();
+                timers[i].cb_func = count_expired;
+                timers[i].expire = start + rng() % WINDOW;
+                wheel.add_timer(&timers[i]);
+            }
+            double elapsed = now_ns() - t0;
+            for(long i = 0; i < armed + ops; i++) {
+                wheel.del_timer(&timers[i]);
+            }
+            return elapsed;
+        });
+
+        // push a random armed timer to the far end, what every keep-alive request does
+        snprintf(name, sizeof(name), "adjust_%ld", armed);
+        measure("timers", name, ops, [&](long ops) {
+            std::mt19937 rng(2);
+            timer_wheel wheel(100, start);
+            arm(wheel, rng);
+            std::vector<long> picks(ops);
+            for(long i = 0; i < ops; i++) {
+                picks[i] = rng() % armed;
+            }
+            double t0 = now_ns();
+            for(long i = 0; i < ops; i++) {
+                wheel_timer* timer = &timers[picks[i]];
+                timer->expire = start + WINDOW + i % 100;
+                wheel.adjust_timer(timer);
+            }
+            double elapsed = now_ns() - t0;
+            for(long i = 0; i < armed; i++) {
+                wheel.del_timer(&timers[i]);
+            }
+            return elapsed;
+        });
+
+        // expire every armed timer, the cost per expired timer
+        snprintf(name, sizeof(name), "tick_%ld", armed);
+        measure("timers", name, armed, [&](long) {
+            std::mt19937 rng(3);
+            timer_wheel wheel(100, start);
+            arm(wheel, rng);
+            expired_count = 0;
+            double t0 = now_ns();
+            wheel.tick(start + 2 * WINDOW);
+            double elapsed = now_ns() - t0;
+            if(expired_count != armed) {
+                fprintf(stderr, "timers: %ld of %ld timers expired\n", expired_count, armed);
+                exit(1);
+            }
+            return elapsed;
+        });
+    }
+}
+
+// --------------------------------------------------------------------------------------- response
+
+static void bench_response() {
+    static http_headers headers;
+    headers.refresh(time(NULL));
+    char buf[http_headers::MAX_HEAD_SIZE * 2];
+    static volatile size_t sink;
+    (void)sink;
+
+    // what process_write() does for a FILE_REQUEST: the head of the file type, then the tail after it
+    measure("response", "file_head", operations(10000000), [&](long ops) {
+        double start = now_ns();
+        for(long i = 0; i < ops; i++) {
+            size_t len = http_headers::build_head(buf, sizeof(buf), "/var/www/index.html", 479 + (i & 1023));
+            size_t tail_len = headers.build_tail(buf + len, sizeof(buf) - len, i & 1);
+            sink = len + tail_len + (size_t)buf[len];
+        }
+        return now_ns() - start;
+    });
+    measure("response", "error", operations(10000000), [&](long ops) {
+        double start = now_ns();
+        for(long i = 0; i < ops; i++) {
+            size_t len;
+            const char* head = headers.error_head(http_headers::NOT_FOUND, len);
+            size_t tail_len = headers.build_tail(buf, sizeof(buf), i & 1);
+            sink = len + tail_len + (size_t)head[0] + (size_t)buf[0];
+        }
+        return now_ns() - start;
+    });
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "s:r:")) != -1) {
+        switch(opt) {
+            case 's':
+                scale = atof(optarg);
+                break;
+            case 'r':
+                repetitions = atoi(optarg);
+                break;
+            default:
+                printf("usage: %s [-s scale] [-r repetitions] [parse] [threadpool] [timers] [response]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(scale <= 0 || repetitions <= 0) {
+        return 1;
+    }
+
+    struct {
+        const char* name;
+        void (*run)();
+    } suites[] = {
+        { "parse", bench_parse },
+        { "threadpool", bench_threadpool },
+        { "timers", bench_timers },
+        { "response", bench_response },
+    };
+    for(auto& s : suites) {
+        bool selected = optind == argc;
+        for(int i = optind; i < argc; i++) {
+            selected = selected || strcmp(argv[i], s.name) == 0;
+        }
+        if(selected) {
+            s.run();
+        }
+    }
+    return 0;
+}
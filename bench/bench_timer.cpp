@@ -0,0 +1,152 @@
+/*
+    Microbenchmark of the idle timers: timer_wheel vs. sort_timer_lst (noactive/lst_timer.h).
+
+    For 10k, 100k and 1M armed timers it measures
+        add     : arm one more timer with a random expiration
+        adjust  : push a random armed timer to the far end (what a keep-alive request does)
+        tick    : expire every armed timer, cost per expired timer
+    sort_timer_lst is O(n) per add/adjust, so it runs fewer operations at the larger sizes.
+
+    Build and run from the repository root:
+        g++ -O2 -I. bench/bench_timer.cpp -o bench_timer
+        ./bench_timer
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "timer_wheel.h"
+#include "noactive/lst_timer.h"
+
+static const int WINDOW = 15000;            // spread of the expirations (ms for the wheel, "s" for the list)
+static const long WHEEL_OPERATIONS = 1000000;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long expired_count = 0;
+static void wheel_cb(void*) { expired_count++; }
+static void list_cb(client_data*) { expired_count++; }
+
+struct result {
+    double add_ns;
+    double adjust_ns;
+    double tick_ns;
+};
+
+static result bench_wheel(long n, std::mt19937& rng) {
+    result r;
+    const uint64_t start = 1000000;     // the wheel's notion of "now", in ms
+    timer_wheel wheel(100, start);
+    std::vector<wheel_timer> timers(n + WHEEL_OPERATIONS);
+    for(long i = 0; i < n; i++) {
+        timers[i].cb_func = wheel_cb;
+        timers[i].expire = start + rng() % WINDOW;
+        wheel.add_timer(&timers[i]);
+    }
+
+    double t0 = now_ns();
+    for(long i = n; i < n + WHEEL_OPERATIONS; i++) {
+        timers[i].cb_func = wheel_cb;
+        timers[i].expire = start + rng() % WINDOW;
+        wheel.add_timer(&timers[i]);
+    }
+    r.add_ns = (now_ns() - t0) / WHEEL_OPERATIONS;
+    for(long i = n; i < n + WHEEL_OPERATIONS; i++) {
+        wheel.del_timer(&timers[i]);
+    }
+
+    std::vector<long> picks(WHEEL_OPERATIONS);
+    for(long i = 0; i < WHEEL_OPERATIONS; i++) {
+        picks[i] = rng() % n;
+    }
+    t0 = now_ns();
+    for(long i = 0; i < WHEEL_OPERATIONS; i++) {
+        wheel_timer* timer = &timers[picks[i]];
+        timer->expire = start + WINDOW + i % 100;
+        wheel.adjust_timer(timer);
+    }
+    r.adjust_ns = (now_ns() - t0) / WHEEL_OPERATIONS;
+
+    expired_count = 0;
+    t0 = now_ns();
+    wheel.tick(start + 2 * WINDOW);
+    r.tick_ns = (now_ns() - t0) / (expired_count ? expired_count : 1);
+    return r;
+}
+
+static result bench_list(long n, std::mt19937& rng) {
+    result r;
+    long operations = 100000000 / n;
+    operations = operations < 100 ? 100 : (operations > 10000 ? 10000 : operations);
+
+    // sort_timer_lst compares against time(NULL), so "now" is the real time here
+    const time_t start = time(NULL) + WINDOW;
+    std::vector<client_data> users(n);
+    std::vector<util_timer*> timers(n);
+    sort_timer_lst list;
+
+    // arm in descending order, every add then is an O(1) insertion at the head
+    std::vector<time_t> expires(n);
+    for(long i = 0; i < n; i++) {
+        expires[i] = start + rng() % WINDOW;
+    }
+    std::sort(expires.begin(), expires.end());
+    for(long i = n - 1; i >= 0; i--) {
+        timers[i] = new util_timer;
+        timers[i]->cb_func = list_cb;
+        timers[i]->user_data = &users[i];
+        timers[i]->expire = expires[i];
+        list.add_timer(timers[i]);
+    }
+
+    std::vector<util_timer*> extra(operations);
+    double t0 = now_ns();
+    for(long i = 0; i < operations; i++) {
+        extra[i] = new util_timer;
+        extra[i]->cb_func = list_cb;
+        extra[i]->expire = start + rng() % WINDOW;
+        list.add_timer(extra[i]);
+    }
+    r.add_ns = (now_ns() - t0) / operations;
+    for(long i = 0; i < operations; i++) {
+        list.del_timer(extra[i]);
+    }
+
+    t0 = now_ns();
+    for(long i = 0; i < operations; i++) {
+        util_timer* timer = timers[rng() % n];
+        timer->expire = start + WINDOW + i;
+        list.adjust_timer(timer);
+    }
+    r.adjust_ns = (now_ns() - t0) / operations;
+
+    // move every expiration into the past, the order is unchanged
+    for(long i = 0; i < n; i++) {
+        timers[i]->expire -= 4 * WINDOW;
+    }
+    expired_count = 0;
+    t0 = now_ns();
+    list.tick();
+    r.tick_ns = (now_ns() - t0) / (expired_count ? expired_count : 1);
+    return r;
+}
+
+int main() {
+    const long sizes[] = {10000, 100000, 1000000};
+    std::mt19937 rng(42);
+
+    printf("%-10s %-16s %-14s %-14s %-14s\n", "timers", "structure", "add ns/op", "adjust ns/op", "tick ns/timer");
+    for(long n : sizes) {
+        result w = bench_wheel(n, rng);
+        printf("%-10ld %-16s %-14.1f %-14.1f %-14.1f\n", n, "timer_wheel", w.add_ns, w.adjust_ns, w.tick_ns);
+        result l = bench_list(n, rng);
+        printf("%-10ld %-16s %-14.1f %-14.1f %-14.1f\n", n, "sort_timer_lst", l.add_ns, l.adjust_ns, l.tick_ns);
+    }
+    return 0;
+}
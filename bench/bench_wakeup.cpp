@@ -0,0 +1,137 @@
+/*
+    Wake-up latency of the threadpool workers: the POSIX semaphore (sem) against the futex one that
+    spins before it sleeps (futex_sem, the default of threadpool<T>).
+
+    One producer appends requests to a threadpool at a fixed rate, open loop: low load (workers park
+    between requests), medium load (they are mostly about to park) and high load (as fast as the
+    queue takes them, workers rarely park). A request carries the time it was appended; the worker
+    that processes it records how long it took to get there. For every semaphore and load, prints
+    the median, 99th percentile and maximum of that latency, plus the context switches and the CPU
+    time of the whole process per request (getrusage), which is where spinning shows up. The
+    producer sleeps between requests at low load and spins at medium load, its share of the CPU time
+    is the same for both semaphores.
+
+    Build and run from the repository root:
+        g++ -O2 -I. bench/bench_wakeup.cpp log.cpp -pthread -o bench_wakeup
+        ./bench_wakeup [workers] [seconds_per_run]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include "threadpool.h"
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const uint64_t SLEEP_THRESHOLD_NS = 200000;    // the producer sleeps until requests due later than that
+
+// a request: when it was appended, and how long until a worker had it
+struct task {
+    uint64_t posted;
+    uint64_t latency;
+    std::atomic<bool> done{false};
+    uint64_t enqueued;
+
+    void process() {
+        latency = now_ns() - posted;
+        done.store(true, std::memory_order_release);
+    }
+    void set_enqueue_time(uint64_t us) { enqueued = us; }
+    uint64_t enqueue_time() const { return enqueued; }
+    bool hung_up() { return false; }
+    void drop() { process(); }
+    void shed() { process(); }
+};
+
+struct usage {
+    long switches;      // voluntary and involuntary context switches
+    double cpu_us;      // user and system time
+};
+
+static usage get_usage() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    usage u;
+    u.switches = ru.ru_nvcsw + ru.ru_nivcsw;
+    u.cpu_us = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    return u;
+}
+
+// 'rate' requests per second for 'seconds', 0 for as fast as possible
+template<typename Pool>
+static void run(Pool& pool, const char* name, const char* load, long rate, double seconds) {
+    long count = rate > 0 ? (long)(rate * seconds) : 1000000;
+    std::vector<task> tasks(count);
+
+    usage before = get_usage();
+    uint64_t start = now_ns();
+    for(long i = 0; i < count; i++) {
+        if(rate > 0) {
+            // open loop: the request is due at its time whatever happened to the previous ones
+            uint64_t due = start + (uint64_t)(i * 1e9 / rate);
+            // sleep through long gaps, as a reactor waiting in epoll_wait, and spin through short ones
+            if(due > now_ns() + SLEEP_THRESHOLD_NS) {
+                struct timespec ts = { (time_t)(due / 1000000000), (long)(due % 1000000000) };
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            while(now_ns() < due) {
+                cpu_relax();
+            }
+        }
+        tasks[i].posted = now_ns();
+        while(!pool.append(&tasks[i])) {
+            cpu_relax();
+        }
+    }
+    for(long i = 0; i < count; i++) {
+        while(!tasks[i].done.load(std::memory_order_acquire)) {
+            cpu_relax();
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    usage after = get_usage();
+
+    std::vector<uint64_t> latencies(count);
+    for(long i = 0; i < count; i++) {
+        latencies[i] = tasks[i].latency;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-10s %-8s %10.0f %10.1f %10.1f %10.1f %12.3f %12.2f\n", name, load, count / elapsed,
+           latencies[count / 2] / 1e3, latencies[(size_t)(count * 0.99)] / 1e3, latencies[count - 1] / 1e3,
+           (double)(after.switches - before.switches) / count, (after.cpu_us - before.cpu_us) / count);
+}
+
+template<typename Sem>
+static void bench(const char* name, int workers, double seconds) {
+    // leaked on purpose: the workers are detached and never exit
+    auto* pool = new threadpool<task, fifo_queue<task>, Sem>(workers);
+    // let the workers start and park
+    struct timespec pause = { 0, 100000000 };
+    nanosleep(&pause, NULL);
+    run(*pool, name, "low", 2000, seconds);
+    run(*pool, name, "medium", 50000, seconds);
+    run(*pool, name, "high", 0, seconds);
+}
+
+int main(int argc, char* argv[]) {
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    double seconds = argc > 2 ? atof(argv[2]) : 2;
+    if(workers <= 0 || seconds <= 0) {
+        printf("usage: %s [workers] [seconds_per_run]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d workers, latency from append() to process()\n", workers);
+    printf("%-10s %-8s %10s %10s %10s %10s %12s %12s\n", "semaphore", "load", "req/s", "p50_us", "p99_us",
+           "max_us", "switches/req", "cpu_us/req");
+    bench<sem>("sem", workers, seconds);
+    bench<futex_sem>("futex_sem", workers, seconds);
+    return 0;
+}
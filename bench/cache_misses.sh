@@ -0,0 +1,81 @@
+#!/bin/bash
+# Cache misses per request, for one or more builds of the server.
+#
+# Starts every server binary given in turn, drives it with webbench in keep-alive mode and counts
+# the cache events of the server process with perf stat for the length of the run. The number of
+# requests comes from the server's own counter at /__stats, so the events are divided by what was
+# actually served. Prints one line per binary.
+#
+# Usage (from the repository root, after building webbench-1.5/webbench):
+#   bench/cache_misses.sh [server_binary...]
+# e.g. to compare the connection layout before and after a change:
+#   git stash; g++ -O2 *.cpp -pthread -o before; git stash pop; g++ -O2 *.cpp -pthread -o after
+#   bench/cache_misses.sh ./before ./after
+#
+# SERVER_ARGS are passed to every server (e.g. "-r 4" or "-o"), EVENTS to perf stat. As for
+# reactor_scaling.sh, pin the server and the load generator apart with SERVER_CPUS and CLIENT_CPUS.
+# perf needs kernel.perf_event_paranoid <= 1, or root.
+
+CLIENTS=${CLIENTS:-200}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-10}
+PORT=${PORT:-9006}
+HOST=${HOST:-127.0.0.1}
+URL_PATH=${URL_PATH:-/index.html}
+WEBBENCH=${WEBBENCH:-./webbench-1.5/webbench}
+EVENTS=${EVENTS:-cache-references,cache-misses,L1-dcache-load-misses,LLC-load-misses}
+
+if [ $# -eq 0 ]; then
+    set -- ./a.out
+fi
+
+server_cmd() {
+    if [ -n "$SERVER_CPUS" ]; then
+        exec taskset -c "$SERVER_CPUS" "$@"
+    else
+        exec "$@"
+    fi
+}
+
+client_cmd() {
+    if [ -n "$CLIENT_CPUS" ]; then
+        taskset -c "$CLIENT_CPUS" "$@"
+    else
+        "$@"
+    fi
+}
+
+requests() {
+    curl -s "http://$HOST:$PORT/__stats" | sed -n 's/^http_requests_total \([0-9]*\)$/\1/p'
+}
+
+printf "%-16s %-10s" server req/s
+for event in ${EVENTS//,/ }; do
+    printf " %-22s" "$event/req"
+done
+printf "\n"
+
+for server in "$@"; do
+    # shellcheck disable=SC2086
+    server_cmd "$server" "$PORT" $SERVER_ARGS > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 1
+
+    before=$(requests)
+    perf stat -x, -e "$EVENTS" -p "$server_pid" -o /tmp/cache_misses.$$ -- sleep "$SECONDS_PER_RUN" &
+    perf_pid=$!
+    client_cmd "$WEBBENCH" -k -c "$CLIENTS" -t "$SECONDS_PER_RUN" "http://$HOST:$PORT$URL_PATH" > /dev/null 2>&1
+    wait "$perf_pid"
+    after=$(requests)
+
+    kill "$server_pid"
+    wait "$server_pid" 2>/dev/null
+
+    served=$((after - before - 1))
+    printf "%-16s %-10s" "$(basename "$server")" "$((served / SECONDS_PER_RUN))"
+    for event in ${EVENTS//,/ }; do
+        count=$(grep ",$event" /tmp/cache_misses.$$ | head -n 1 | cut -d, -f1)
+        printf " %-22s" "$(awk -v c="$count" -v n="$served" 'BEGIN { if (n > 0 && c ~ /^[0-9]+$/) printf "%.2f", c / n; else print "-" }')"
+    done
+    printf "\n"
+done
+rm -f /tmp/cache_misses.$$
@@ -0,0 +1,85 @@
+#!/bin/bash
+# Reactor stalls on files that are not in the page cache, with and without the I/O pool (-d).
+#
+# Creates a working set of FILES files (default: 1.5 times the RAM of the machine, in 4 MB files)
+# under the document root and drops them from the page cache. Then for each configuration, while
+# COLD_CLIENTS curl loops download random files of the set (almost every one a page cache miss),
+# webbench measures the latency of a small hot file on keep-alive connections served by the same
+# reactor. A reactor that reads the disk itself stalls every hot connection for the length of the
+# read; with the I/O pool the hot latency should stay where it is without the cold load.
+# Prints one line per configuration: the hot requests per second and latency percentiles, and the
+# cold files served per second. The working set is removed afterwards.
+#
+# Usage (from the repository root, after building ./a.out and webbench-1.5/webbench):
+#   DOC_ROOT=<the server's doc_root> bench/cold_files.sh [working_set_mb] [seconds]
+#
+# SERVER_ARGS are passed to every server (e.g. "-o" or "-s"); CONFIGS lists the -d values to
+# compare. Creating the working set writes it to disk once, which takes a while.
+
+MEM_MB=$(awk '/^MemTotal:/ { print int($2 / 1024) }' /proc/meminfo)
+WORKING_SET_MB=${1:-$((MEM_MB * 3 / 2))}
+SECONDS_PER_RUN=${2:-20}
+FILE_MB=${FILE_MB:-4}
+COLD_CLIENTS=${COLD_CLIENTS:-8}
+HOT_CLIENTS=${HOT_CLIENTS:-20}
+HOT_PATH=${HOT_PATH:-/index.html}
+CONFIGS=${CONFIGS:-"0 4"}
+DOC_ROOT=${DOC_ROOT:-resources}
+PORT=${PORT:-9008}
+HOST=${HOST:-127.0.0.1}
+SERVER=${SERVER:-./a.out}
+WEBBENCH=${WEBBENCH:-./webbench-1.5/webbench}
+
+FILES=$((WORKING_SET_MB / FILE_MB))
+SET_DIR="$DOC_ROOT/bench_cold"
+mkdir -p "$SET_DIR"
+trap 'rm -rf "$SET_DIR"' EXIT
+for i in $(seq "$FILES"); do
+    dd if=/dev/urandom of="$SET_DIR/$i.bin" bs=1M count="$FILE_MB" status=none
+done
+chmod -R o+rX "$SET_DIR"
+
+# drop the whole set from the page cache (GNU dd: count=0 with nocache advises on the whole file)
+evict() {
+    sync
+    for f in "$SET_DIR"/*.bin; do
+        dd if="$f" iflag=nocache count=0 status=none
+    done
+}
+
+cold_loop() {
+    local served=0
+    local end=$(( $(date +%s) + SECONDS_PER_RUN ))
+    while [ "$(date +%s)" -lt "$end" ]; do
+        curl -s -o /dev/null "http://$HOST:$PORT/bench_cold/$(( RANDOM % FILES + 1 )).bin" && served=$((served + 1))
+    done
+    echo "$served"
+}
+
+printf "%-6s %-10s %-10s %-10s %-10s %-10s %s\n" io_pool hot_req/s p50_ms p99_ms p99.9_ms max_ms cold_files/s
+for threads in $CONFIGS; do
+    evict
+    # shellcheck disable=SC2086
+    "$SERVER" "$PORT" -d "$threads" $SERVER_ARGS > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 1
+
+    for c in $(seq "$COLD_CLIENTS"); do
+        cold_loop > "/tmp/cold_files.$$.$c" &
+    done
+    hot=$("$WEBBENCH" -k -c "$HOT_CLIENTS" -t "$SECONDS_PER_RUN" "http://$HOST:$PORT$HOT_PATH" 2>/dev/null)
+    wait $(jobs -p | grep -v "^$server_pid$")
+
+    cold=$(cat /tmp/cold_files.$$.* | awk -v s="$SECONDS_PER_RUN" '{ n += $1 } END { printf "%.1f", n / s }')
+    rm -f /tmp/cold_files.$$.*
+    kill "$server_pid"
+    wait "$server_pid" 2>/dev/null
+
+    rate=$(echo "$hot" | sed -n 's/^Speed=\([0-9]*\) pages\/min.*/\1/p')
+    latency=$(echo "$hot" | grep -m1 '^Latency')
+    printf "%-6s %-10s %-10s %-10s %-10s %-10s %s\n" "$threads" "$((rate / 60))" \
+        "$(echo "$latency" | sed -n 's/.* p50 \([0-9.]*\).*/\1/p')" \
+        "$(echo "$latency" | sed -n 's/.* p99 \([0-9.]*\).*/\1/p')" \
+        "$(echo "$latency" | sed -n 's/.* p99\.9 \([0-9.]*\).*/\1/p')" \
+        "$(echo "$latency" | sed -n 's/.* max \([0-9.]*\).*/\1/p')" "$cold"
+done
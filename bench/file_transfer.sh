@@ -0,0 +1,53 @@
+#!/bin/bash
+# Static file transmission: mmap() + writev() vs. sendfile() (-s).
+#
+# Creates a small, a medium and a large file in the document root, then for each mode
+#   - small and medium: webbench throughput (pages/min and bytes/sec)
+#   - large: wall time and rate of sequential curl downloads
+# The test files are removed afterwards.
+#
+# Usage (from the repository root, after building ./a.out):
+#   DOC_ROOT=<the server's doc_root> bench/file_transfer.sh [large_size_mb] [clients] [seconds]
+
+LARGE_MB=${1:-4096}
+CLIENTS=${2:-200}
+SECONDS_PER_RUN=${3:-10}
+DOC_ROOT=${DOC_ROOT:-resources}
+PORT=${PORT:-9007}
+HOST=${HOST:-127.0.0.1}
+SERVER=${SERVER:-./a.out}
+WEBBENCH=${WEBBENCH:-./webbench-1.5/webbench}
+DOWNLOADS=${DOWNLOADS:-3}
+
+head -c 4096 /dev/urandom > "$DOC_ROOT/bench_small.bin"
+head -c $((1024 * 1024)) /dev/urandom > "$DOC_ROOT/bench_medium.bin"
+dd if=/dev/urandom of="$DOC_ROOT/bench_large.bin" bs=1M count="$LARGE_MB" status=none
+chmod o+r "$DOC_ROOT"/bench_*.bin
+trap 'rm -f "$DOC_ROOT"/bench_*.bin' EXIT
+
+for mode in mmap sendfile; do
+    flag=""
+    [ "$mode" = sendfile ] && flag="-s"
+    "$SERVER" "$PORT" $flag > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 1
+
+    for file in bench_small.bin bench_medium.bin; do
+        result=$("$WEBBENCH" -2 -c "$CLIENTS" -t "$SECONDS_PER_RUN" "http://$HOST:$PORT/$file" 2>/dev/null | grep -m1 '^Speed=')
+        printf "%-9s %-18s %s\n" "$mode" "$file" "$result"
+    done
+
+    # warm the page cache once, then time the downloads
+    curl -s -o /dev/null "http://$HOST:$PORT/bench_large.bin"
+    start=$(date +%s.%N)
+    for i in $(seq "$DOWNLOADS"); do
+        curl -s -o /dev/null "http://$HOST:$PORT/bench_large.bin"
+    done
+    end=$(date +%s.%N)
+    printf "%-9s %-18s %s\n" "$mode" "bench_large.bin" \
+        "$(awk -v s="$start" -v e="$end" -v n="$DOWNLOADS" -v mb="$LARGE_MB" \
+            'BEGIN { printf "%.2f s/download, %.0f MB/s", (e - s) / n, mb * n / (e - s) }')"
+
+    kill "$server_pid"
+    wait "$server_pid" 2>/dev/null
+done
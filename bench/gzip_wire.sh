@@ -0,0 +1,75 @@
+#!/bin/bash
+# Bytes on the wire and server CPU per request, plain and gzip-encoded (Accept-Encoding: gzip).
+#
+# For every asset webbench runs twice on keep-alive connections, without and with the header:
+#   index.html      the page of the site (resources/index.html)
+#   style.css       the stylesheet of the site (resources/style.css), too small to be compressed
+#   gen.css         a generated stylesheet of CSS_KB KB, the size of a real one, compressed on the fly
+#   pre.css         the same with a precompressed pre.css.gz sibling (gzip -9)
+# The bytes are http_sent_bytes_total of /__stats per response (status line, headers and body),
+# the CPU is the user + system time of the server process (/proc/<pid>/stat) per response, both
+# over the run. The server starts once, every asset is requested once before its runs so the gzip
+# cache has its copy ready.
+#
+# Usage (from the repository root, after building ./a.out and webbench-1.5/webbench):
+#   DOC_ROOT=<the server's doc_root> bench/gzip_wire.sh [seconds]
+#
+# SERVER_ARGS are passed to the server (e.g. "-o" or "-z 0").
+
+SECONDS_PER_RUN=${1:-10}
+CLIENTS=${CLIENTS:-20}
+CSS_KB=${CSS_KB:-16}
+DOC_ROOT=${DOC_ROOT:-resources}
+PORT=${PORT:-9009}
+HOST=${HOST:-127.0.0.1}
+SERVER=${SERVER:-./a.out}
+WEBBENCH=${WEBBENCH:-./webbench-1.5/webbench}
+
+SET_DIR="$DOC_ROOT/bench_gzip"
+mkdir -p "$SET_DIR"
+trap 'rm -rf "$SET_DIR"' EXIT
+# rules of varied selectors and values, about as redundant as a hand-written stylesheet
+: > "$SET_DIR/gen.css"
+while [ "$(stat -c %s "$SET_DIR/gen.css")" -lt $((CSS_KB * 1024)) ]; do
+    printf '.block-%d > .item-%d:hover {\n    margin: %dpx %dpx;\n    padding: 0 %dpx;\n    color: #%06x;\n    font-size: %d.%drem;\n}\n' \
+        $RANDOM $((RANDOM % 50)) $((RANDOM % 32)) $((RANDOM % 32)) $((RANDOM % 16)) $((RANDOM * RANDOM % 16777216)) \
+        $((RANDOM % 3)) $((RANDOM % 10)) >> "$SET_DIR/gen.css"
+done
+cp "$SET_DIR/gen.css" "$SET_DIR/pre.css"
+gzip -9 -k "$SET_DIR/pre.css"
+chmod -R o+rX "$SET_DIR"
+
+# shellcheck disable=SC2086
+"$SERVER" "$PORT" $SERVER_ARGS > /dev/null 2>&1 &
+server_pid=$!
+trap 'kill $server_pid 2>/dev/null; rm -rf "$SET_DIR"' EXIT
+sleep 1
+
+stat_of() {
+    curl -s "http://$HOST:$PORT/__stats" | awk -v name="$1" '$1 == name { print $2 }'
+}
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$server_pid/stat"
+}
+tick_us=$((1000000 / $(getconf CLK_TCK)))
+
+printf "%-12s %-8s %-6s %-10s %-14s %s\n" asset size coding req/s bytes/response cpu_us/request
+for asset in index.html style.css bench_gzip/gen.css bench_gzip/pre.css; do
+    url="http://$HOST:$PORT/$asset"
+    curl -s -o /dev/null -H "Accept-Encoding: gzip" "$url"
+    sleep 0.5
+    for coding in identity gzip; do
+        requests=$(stat_of http_requests_total)
+        bytes=$(stat_of http_sent_bytes_total)
+        ticks=$(cpu_ticks)
+        out=$("$WEBBENCH" -k -c "$CLIENTS" -t "$SECONDS_PER_RUN" -H "Accept-Encoding: $coding" "$url" 2>/dev/null)
+        ticks=$(( $(cpu_ticks) - ticks ))
+        # the /__stats request of the first reading is in the difference
+        requests=$(( $(stat_of http_requests_total) - requests - 1 ))
+        bytes=$(( $(stat_of http_sent_bytes_total) - bytes ))
+
+        rate=$(echo "$out" | sed -n 's/^Speed=\([0-9]*\) pages\/min.*/\1/p')
+        printf "%-12s %-8s %-6s %-10s %-14s %s\n" "$(basename "$asset")" "$(stat -c %s "$DOC_ROOT/$asset")" "$coding" \
+            "$((rate / 60))" "$((bytes / requests))" "$(awk -v t="$ticks" -v u="$tick_us" -v n="$requests" 'BEGIN { printf "%.2f", t * u / n }')"
+    done
+done
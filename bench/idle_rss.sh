@@ -0,0 +1,94 @@
+#!/bin/bash
+# Server memory with many idle keep-alive connections.
+#
+# Starts the server, opens the given number of connections, sends keep-alive requests on each
+# and reads the responses, then leaves them idle and reads the resident set size of the server
+# from /proc. Prints the RSS before any connection, with the idle connections, and the difference
+# per connection. Connections come from several loopback addresses (127.0.0.2, 127.0.0.3, ...),
+# so their number is not limited by the ephemeral port range of a single address.
+#
+# Usage (from the repository root, after building ./a.out):
+#   bench/idle_rss.sh [connections]
+#
+# Both the server and this script need 'ulimit -n' above the number of connections, and
+# everything must happen within the 15 s idle timeout of the server: the script refreshes every
+# connection with a second request right before measuring.
+
+CONNECTIONS=${1:-100000}
+PORT=${PORT:-9008}
+SERVER=${SERVER:-./a.out}
+URL_PATH=${URL_PATH:-/index.html}
+
+rss_kb() {
+    awk '/^VmRSS:/ { print $2 }' "/proc/$1/status"
+}
+
+"$SERVER" "$PORT" > /dev/null 2>&1 &
+server_pid=$!
+trap 'kill "$server_pid" 2>/dev/null; wait "$server_pid" 2>/dev/null' EXIT
+sleep 1
+base=$(rss_kb "$server_pid")
+
+# the client prints "ready" once every connection is idle, then holds them until stdin closes
+coproc CLIENT {
+    python3 - "$CONNECTIONS" "$PORT" "$URL_PATH" <<'EOF'
+import socket, sys
+count, port, path = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+request = ("GET %s HTTP/1.1\r\nConnection: keep-alive\r\n\r\n" % path).encode()
+
+def read_response(s):
+    data = b""
+    while b"\r\n\r\n" not in data:
+        chunk = s.recv(65536)
+        if not chunk:
+            raise ConnectionError("closed")
+        data += chunk
+    head, body = data.split(b"\r\n\r\n", 1)
+    length = 0
+    for line in head.split(b"\r\n"):
+        if line.lower().startswith(b"content-length:"):
+            length = int(line.split(b":")[1])
+    while len(body) < length:
+        body += s.recv(65536)
+
+# requests go in groups of BATCH, so the memory measured is what idle connections keep,
+# not what thousands of simultaneous requests borrowed at their peak
+BATCH = 100
+def requests(group):
+    for s in group:
+        s.sendall(request)
+    for s in group:
+        read_response(s)
+
+sockets = []
+try:
+    for i in range(count):
+        s = socket.socket()
+        s.bind(("127.0.0.%d" % (2 + i // 25000), 0))
+        s.connect(("127.0.0.1", port))
+        sockets.append(s)
+        if len(sockets) % BATCH == 0:
+            requests(sockets[-BATCH:])
+except OSError as e:
+    print("stopped at %d connections: %s" % (len(sockets), e), file=sys.stderr)
+requests(sockets[len(sockets) - len(sockets) % BATCH:])
+# the idle timers of the first connections may be close to expiring, refresh them all
+for i in range(0, len(sockets), BATCH):
+    requests(sockets[i:i + BATCH])
+print("ready %d" % len(sockets), flush=True)
+sys.stdin.read()
+EOF
+}
+
+read -r ready opened <&"${CLIENT[0]}"
+if [ "$ready" != ready ]; then
+    echo "the client failed"
+    exit 1
+fi
+idle=$(rss_kb "$server_pid")
+exec {CLIENT[1]}>&-
+wait "$CLIENT_PID" 2>/dev/null
+
+printf "%-12s %-14s %-14s %-14s\n" "connections" "base RSS KB" "idle RSS KB" "bytes/conn"
+printf "%-12s %-14s %-14s %-14s\n" "$opened" "$base" "$idle" \
+    "$(awk -v b="$base" -v i="$idle" -v n="$opened" 'BEGIN { printf "%.0f", n ? (i - b) * 1024 / n : 0 }')"
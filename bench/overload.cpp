@@ -0,0 +1,281 @@
+/*
+    Open-loop load generator, for the latency of the requests that are served under overload.
+
+    webbench is closed-loop: each client waits for a response before sending the next request, so
+    an overloaded server slows the clients down and never sees more load than it can serve. Here
+    requests are due at a constant rate whatever the server does, the i-th one at start + i / rate.
+    A due request goes out on an idle keep-alive connection, or on a new one (up to -c connections);
+    if none is available it waits for one. Its latency is counted from the time it was due, not
+    from the time it was sent, so the time spent waiting behind a slow server is not hidden.
+
+    Prints the throughput of 200 and 503 responses, failures (connection refused or reset, no
+    response within the drain time) and the latency percentiles of the 200 responses.
+
+    Build and run from the repository root:
+        g++ -O2 bench/overload.cpp -o overload
+        ./overload [-c connections] [-t seconds] host port path rate
+    bench/overload.sh finds the capacity of the server and runs it at 1x and 2x of it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+enum state { IDLE, CONNECTING, BUSY };
+
+struct connection {
+    int fd;
+    state st;
+    uint64_t due;       // when the request in flight was due
+    char buf[4096];     // the response header
+    int len;
+    long body_left;     // bytes of the body still to come, -1 until the header is in
+    int status;
+    bool keep;          // the server keeps the connection open
+};
+
+static struct sockaddr_in server;
+static char request[512];
+static int request_len;
+static int epollfd;
+
+static long ok_count, unavailable_count, other_count, failures;
+static std::vector<uint32_t> latencies;     // of the 200 responses, in microseconds
+
+static connection* open_connection(uint64_t due) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0) {
+        return NULL;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if(connect(fd, (struct sockaddr*)&server, sizeof(server)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+    connection* c = new connection;
+    c->fd = fd;
+    c->st = CONNECTING;
+    c->due = due;
+    c->len = 0;
+    c->body_left = -1;
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+    return c;
+}
+
+static void close_connection(connection* c) {
+    close(c->fd);
+    delete c;
+}
+
+static bool send_request(connection* c, uint64_t due) {
+    c->due = due;
+    c->len = 0;
+    c->body_left = -1;
+    c->st = BUSY;
+    return send(c->fd, request, request_len, MSG_NOSIGNAL) == request_len;
+}
+
+/*
+    Account for 'got' bytes received at the end of c->buf: returns true once the whole response
+    is in. The body is not kept, only counted.
+*/
+static bool receive_response(connection* c, int got) {
+    if(c->body_left >= 0) {
+        c->body_left -= got;
+        return c->body_left <= 0;
+    }
+    c->len += got;
+    c->buf[c->len] = '\0';
+    char* end = strstr(c->buf, "\r\n\r\n");
+    if(!end) {
+        return false;
+    }
+    c->status = atoi(c->buf + 9);
+    long content_length = 0;
+    char* cl = strcasestr(c->buf, "Content-Length:");
+    if(cl && cl < end) {
+        content_length = atol(cl + 15);
+    }
+    char* conn = strcasestr(c->buf, "Connection: close");
+    c->keep = !(conn && conn < end);
+    c->body_left = content_length - (c->len - (end + 4 - c->buf));
+    return c->body_left <= 0;
+}
+
+int main(int argc, char* argv[]) {
+    int max_connections = 1000;
+    int seconds = 10;
+    int opt;
+    while((opt = getopt(argc, argv, "c:t:")) != -1) {
+        switch(opt) {
+            case 'c':
+                max_connections = atoi(optarg);
+                break;
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+    if(argc - optind < 4) {
+        printf("usage: %s [-c connections] [-t seconds] host port path rate\n", argv[0]);
+        return 1;
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[optind + 1]));
+    inet_pton(AF_INET, argv[optind], &server.sin_addr);
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n",
+                           argv[optind + 2], argv[optind]);
+    double rate = atof(argv[optind + 3]);
+    if(rate <= 0 || max_connections <= 0) {
+        return 1;
+    }
+
+    epollfd = epoll_create1(0);
+    std::vector<connection*> idle;
+    std::deque<uint64_t> waiting;           // due requests with no connection yet
+    int open_count = 0;
+    long issued = 0;
+    long total = (long)(rate * seconds);
+    uint64_t start = now_us();
+    uint64_t drain_end = start + (uint64_t)seconds * 1000000 + 2000000;
+    struct epoll_event events[1024];
+
+    while(true) {
+        uint64_t now = now_us();
+        // the requests due by now
+        while(issued < total && start + (uint64_t)(issued * 1e6 / rate) <= now) {
+            waiting.push_back(start + (uint64_t)(issued * 1e6 / rate));
+            issued++;
+        }
+        while(!waiting.empty()) {
+            uint64_t due = waiting.front();
+            if(!idle.empty()) {
+                connection* c = idle.back();
+                idle.pop_back();
+                if(!send_request(c, due)) {
+                    // closed by the server since: retry on a new connection
+                    close_connection(c);
+                    open_count--;
+                    continue;
+                }
+            } else if(open_count < max_connections) {
+                if(!open_connection(due)) {
+                    failures++;
+                    waiting.pop_front();
+                    continue;
+                }
+                open_count++;
+            } else {
+                break;
+            }
+            waiting.pop_front();
+        }
+        if(issued == total && (open_count == (int)idle.size() || now >= drain_end)) {
+            break;
+        }
+
+        int timeout = 1;
+        if(issued == total) {
+            timeout = 10;
+        } else {
+            uint64_t next = start + (uint64_t)(issued * 1e6 / rate);
+            timeout = next > now ? (int)((next - now + 999) / 1000) : 0;
+        }
+        int n = epoll_wait(epollfd, events, 1024, timeout);
+        for(int i = 0; i < n; i++) {
+            connection* c = (connection*)events[i].data.ptr;
+            if(c->st == CONNECTING) {
+                int err = 0;
+                socklen_t errlen = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if(err != 0 || !send_request(c, c->due)) {
+                    failures++;
+                    close_connection(c);
+                    open_count--;
+                    continue;
+                }
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+                continue;
+            }
+            // the header goes into the buffer, the body over whatever is after it
+            int room = c->body_left >= 0 ? (int)sizeof(c->buf) - 1 : (int)sizeof(c->buf) - 1 - c->len;
+            int got = room > 0 ? recv(c->fd, c->body_left >= 0 ? c->buf : c->buf + c->len, room, 0) : -1;
+            if(got <= 0) {
+                if(got < 0 && errno == EAGAIN) {
+                    continue;
+                }
+                // closed: a failure if a response was expected
+                if(c->st == BUSY) {
+                    failures++;
+                } else {
+                    idle.erase(std::find(idle.begin(), idle.end(), c));
+                }
+                close_connection(c);
+                open_count--;
+                continue;
+            }
+            if(c->st != BUSY || !receive_response(c, got)) {
+                continue;
+            }
+            if(c->status == 200) {
+                ok_count++;
+                latencies.push_back((uint32_t)(now_us() - c->due));
+            } else if(c->status == 503) {
+                unavailable_count++;
+            } else {
+                other_count++;
+            }
+            if(c->keep) {
+                c->st = IDLE;
+                idle.push_back(c);
+            } else {
+                close_connection(c);
+                open_count--;
+            }
+        }
+    }
+    failures += open_count - (long)idle.size() + (long)waiting.size();
+
+    double elapsed = seconds;
+    printf("rate %.0f/s for %ds: 200 %.0f/s, 503 %.0f/s, other %ld, failed %ld\n", rate, seconds,
+           ok_count / elapsed, unavailable_count / elapsed, other_count, failures);
+    if(!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        const double percentiles[] = { 50, 90, 99, 99.9 };
+        printf("latency of the 200s (ms):");
+        for(double p : percentiles) {
+            size_t i = (size_t)(p / 100 * (latencies.size() - 1));
+            printf(" p%g %.2f", p, latencies[i] / 1000.0);
+        }
+        printf(" max %.2f\n", latencies.back() / 1000.0);
+    }
+    return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Latency of the served requests when the server is offered more than it can serve.
+#
+# Finds the capacity of the server (the 200/s of a short run at a rate far beyond it), then offers
+# each multiple of it given on the command line with the open-loop generator of bench/overload.cpp
+# and prints its report: 200/s, 503/s, failures, latency percentiles of the 200s.
+#
+# Usage (from the repository root, after building ./a.out):
+#   g++ -O2 bench/overload.cpp -o overload
+#   bench/overload.sh [multiples...]
+#
+# Default multiples: 0.5 1 2. CAPACITY skips the measurement. SERVER can point to a build
+# without admission control (e.g. of an older commit) for comparison. CONNECTIONS (default 2000)
+# bounds the client connections. As with the other scripts, pin the server and the generator
+# apart (SERVER_CPUS, CLIENT_CPUS) or the generator competes with the server for the CPU.
+
+if [ $# -eq 0 ]; then
+    set -- 0.5 1 2
+fi
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-10}
+CONNECTIONS=${CONNECTIONS:-2000}
+PORT=${PORT:-9006}
+HOST=${HOST:-127.0.0.1}
+URL_PATH=${URL_PATH:-/index.html}
+SERVER=${SERVER:-./a.out}
+OVERLOAD=${OVERLOAD:-./overload}
+
+server_cmd() {
+    if [ -n "$SERVER_CPUS" ]; then
+        exec taskset -c "$SERVER_CPUS" "$@"
+    else
+        exec "$@"
+    fi
+}
+
+client_cmd() {
+    if [ -n "$CLIENT_CPUS" ]; then
+        taskset -c "$CLIENT_CPUS" "$@"
+    else
+        "$@"
+    fi
+}
+
+server_cmd "$SERVER" "$PORT" > /dev/null 2>&1 &
+server_pid=$!
+sleep 1
+
+if [ -z "$CAPACITY" ]; then
+    CAPACITY=$(client_cmd "$OVERLOAD" -c "$CONNECTIONS" -t 3 "$HOST" "$PORT" "$URL_PATH" 1000000 \
+        | sed -n 's/.*: 200 \([0-9]*\)\/s.*/\1/p')
+    echo "capacity: $CAPACITY requests/s"
+    sleep 2
+fi
+
+for multiple in "$@"; do
+    rate=$(awk -v c="$CAPACITY" -v m="$multiple" 'BEGIN { printf "%d", c * m }')
+    echo "== ${multiple}x"
+    client_cmd "$OVERLOAD" -c "$CONNECTIONS" -t "$SECONDS_PER_RUN" "$HOST" "$PORT" "$URL_PATH" "$rate"
+    sleep 2
+done
+
+kill "$server_pid"
+wait "$server_pid" 2>/dev/null
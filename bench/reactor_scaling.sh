@@ -0,0 +1,59 @@
+#!/bin/bash
+# Throughput vs. number of reactors.
+#
+# Starts the server with 1, 2, 4, ... reactors (-r) and drives each run with webbench.
+# Prints one line per run: reactors, pages/min and the speedup over a single reactor.
+#
+# Usage (from the repository root, after building ./a.out and webbench-1.5/webbench):
+#   bench/reactor_scaling.sh [max_reactors] [clients] [seconds]
+#
+# The load generator competes with the server for the CPUs when both run on the same
+# machine; for meaningful numbers pin them apart, e.g. SERVER_CPUS=0-15 CLIENT_CPUS=16-31,
+# or run webbench from another host with HOST=<server address>.
+
+MAX_REACTORS=${1:-$(nproc)}
+CLIENTS=${2:-1000}
+SECONDS_PER_RUN=${3:-10}
+PORT=${PORT:-9006}
+HOST=${HOST:-127.0.0.1}
+URL_PATH=${URL_PATH:-/index.html}
+SERVER=${SERVER:-./a.out}
+WEBBENCH=${WEBBENCH:-./webbench-1.5/webbench}
+
+# runs in the background, exec so that $! is the server itself
+server_cmd() {
+    if [ -n "$SERVER_CPUS" ]; then
+        exec taskset -c "$SERVER_CPUS" "$@"
+    else
+        exec "$@"
+    fi
+}
+
+client_cmd() {
+    if [ -n "$CLIENT_CPUS" ]; then
+        taskset -c "$CLIENT_CPUS" "$@"
+    else
+        "$@"
+    fi
+}
+
+printf "%-10s %-14s %-8s\n" reactors pages/min speedup
+base=""
+n=1
+while [ "$n" -le "$MAX_REACTORS" ]; do
+    server_cmd "$SERVER" "$PORT" -r "$n" > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 1
+
+    speed=$(client_cmd "$WEBBENCH" -2 -c "$CLIENTS" -t "$SECONDS_PER_RUN" "http://$HOST:$PORT$URL_PATH" 2>/dev/null \
+            | sed -n 's/^Speed=\([0-9]*\) pages\/min.*/\1/p')
+
+    kill "$server_pid"
+    wait "$server_pid" 2>/dev/null
+
+    if [ -z "$base" ]; then
+        base=$speed
+    fi
+    printf "%-10s %-14s %-8s\n" "$n" "$speed" "$(awk -v a="$speed" -v b="$base" 'BEGIN { if (b > 0) printf "%.2f", a / b; else print "-" }')"
+    n=$((n * 2))
+done
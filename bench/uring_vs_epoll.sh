@@ -0,0 +1,64 @@
+#!/bin/bash
+# Throughput of the epoll and the io_uring (-u) event loops at increasing client counts.
+#
+# Starts the server once per backend and client count and drives it with webbench.
+# Prints one line per client count: pages/min with epoll, with io_uring, and their ratio.
+#
+# Usage (from the repository root, after building ./a.out and webbench-1.5/webbench):
+#   bench/uring_vs_epoll.sh [clients...]
+#
+# Default client counts: 100 1000 5000 10000. webbench forks one process per client, so the
+# largest counts need 'ulimit -u' and 'ulimit -n' raised. REACTORS (default 1) is passed as -r
+# to both backends. As with reactor_scaling.sh, pin the server and the load generator apart
+# (SERVER_CPUS, CLIENT_CPUS) or run webbench from another host (HOST) for meaningful numbers.
+
+if [ $# -eq 0 ]; then
+    set -- 100 1000 5000 10000
+fi
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-10}
+REACTORS=${REACTORS:-1}
+PORT=${PORT:-9006}
+HOST=${HOST:-127.0.0.1}
+URL_PATH=${URL_PATH:-/index.html}
+SERVER=${SERVER:-./a.out}
+WEBBENCH=${WEBBENCH:-./webbench-1.5/webbench}
+
+# runs in the background, exec so that $! is the server itself
+server_cmd() {
+    if [ -n "$SERVER_CPUS" ]; then
+        exec taskset -c "$SERVER_CPUS" "$@"
+    else
+        exec "$@"
+    fi
+}
+
+client_cmd() {
+    if [ -n "$CLIENT_CPUS" ]; then
+        taskset -c "$CLIENT_CPUS" "$@"
+    else
+        "$@"
+    fi
+}
+
+# pages/min of one run: run <clients> [server options]
+run() {
+    local clients=$1
+    shift
+    server_cmd "$SERVER" "$PORT" -r "$REACTORS" "$@" > /dev/null 2>&1 &
+    local server_pid=$!
+    sleep 1
+
+    client_cmd "$WEBBENCH" -2 -c "$clients" -t "$SECONDS_PER_RUN" "http://$HOST:$PORT$URL_PATH" 2>/dev/null \
+        | sed -n 's/^Speed=\([0-9]*\) pages\/min.*/\1/p'
+
+    kill "$server_pid"
+    wait "$server_pid" 2>/dev/null
+}
+
+printf "%-10s %-14s %-14s %-8s\n" clients epoll io_uring ratio
+for clients in "$@"; do
+    epoll=$(run "$clients")
+    uring=$(run "$clients" -u)
+    printf "%-10s %-14s %-14s %-8s\n" "$clients" "$epoll" "$uring" \
+        "$(awk -v a="$uring" -v b="$epoll" 'BEGIN { if (b > 0) printf "%.2f", a / b; else print "-" }')"
+done
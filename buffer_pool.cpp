@@ -0,0 +1,101 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+
+buffer_pool::buffer_pool() : m_in_use(0), m_reserved(0) {
+    for(int i = 0; i < CLASSES; i++) {
+        m_classes[i].free_list = NULL;
+        m_classes[i].slabs = NULL;
+        m_classes[i].slab_count = 0;
+        m_classes[i].slab_capacity = 0;
+    }
+}
+
+buffer_pool::~buffer_pool() {
+    for(int i = 0; i < CLASSES; i++) {
+        for(int j = 0; j < m_classes[i].slab_count; j++) {
+            free(m_classes[i].slabs[j]);
+        }
+        free(m_classes[i].slabs);
+    }
+}
+
+// the smallest class holding 'size' bytes, -1 if none
+int buffer_pool::class_index(size_t size) {
+    size_t class_size = MIN_SIZE;
+    for(int i = 0; i < CLASSES; i++, class_size <<= 1) {
+        if(size <= class_size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+size_t buffer_pool::class_size(size_t size) {
+    int index = class_index(size);
+    return index < 0 ? 0 : MIN_SIZE << index;
+}
+
+void* buffer_pool::acquire(size_t size) {
+    int index = class_index(size);
+    if(index < 0) {
+        return NULL;
+    }
+    size_t buffer_size = MIN_SIZE << index;
+    size_class& c = m_classes[index];
+
+    c.lock.lock();
+    if(!c.free_list && !grow(c, buffer_size)) {
+        c.lock.unlock();
+        return NULL;
+    }
+    free_buffer* buffer = c.free_list;
+    c.free_list = buffer->next;
+    c.lock.unlock();
+
+    m_in_use.fetch_add(buffer_size, std::memory_order_relaxed);
+    return buffer;
+}
+
+void buffer_pool::release(void* buffer, size_t size) {
+    if(!buffer) {
+        return;
+    }
+    int index = class_index(size);
+    size_class& c = m_classes[index];
+    free_buffer* b = (free_buffer*)buffer;
+
+    c.lock.lock();
+    b->next = c.free_list;
+    c.free_list = b;
+    c.lock.unlock();
+
+    m_in_use.fetch_sub(MIN_SIZE << index, std::memory_order_relaxed);
+}
+
+// carve a new slab into free buffers of 'buffer_size' bytes
+bool buffer_pool::grow(size_class& c, size_t buffer_size) {
+    if(c.slab_count == c.slab_capacity) {
+        int capacity = c.slab_capacity ? 2 * c.slab_capacity : 16;
+        char** slabs = (char**)realloc(c.slabs, capacity * sizeof(char*));
+        if(!slabs) {
+            return false;
+        }
+        c.slabs = slabs;
+        c.slab_capacity = capacity;
+    }
+    // page aligned, buffers never straddle more cache lines or pages than they need
+    void* slab = NULL;
+    if(posix_memalign(&slab, 4096, SLAB_SIZE) != 0) {
+        return false;
+    }
+    c.slabs[c.slab_count++] = (char*)slab;
+    m_reserved.fetch_add(SLAB_SIZE, std::memory_order_relaxed);
+
+    // link the buffers in address order, the first one acquired is at the start of the slab
+    for(size_t offset = SLAB_SIZE; offset >= buffer_size; offset -= buffer_size) {
+        free_buffer* b = (free_buffer*)((char*)slab + offset - buffer_size);
+        b->next = c.free_list;
+        c.free_list = b;
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <atomic>
+#include "locker.h"
+
+/*
+    Slab pool of fixed-size buffers, in power of two size classes from MIN_SIZE to MAX_SIZE.
+
+    Buffers are carved out of SLAB_SIZE slabs allocated on demand; a released buffer goes on the
+    free list of its class (the list is threaded through the free buffers themselves) and is handed
+    out again by the next acquire() of that class. Slabs are never given back to the system, so the
+    footprint of the pool is the peak number of buffers in use, not the number of connections.
+
+    Each class has its own lock, a spin_mutex held for a few instructions per acquire()/release().
+*/
+class buffer_pool {
+public:
+    static const size_t MIN_SIZE = 2048;
+    static const size_t MAX_SIZE = 32768;
+    static const int CLASSES = 5;                   // 2K, 4K, 8K, 16K, 32K
+    static const size_t SLAB_SIZE = 256 * 1024;
+
+    buffer_pool();
+    ~buffer_pool();
+
+    // the size of the buffers acquire(size) hands out, 0 if 'size' is larger than MAX_SIZE
+    static size_t class_size(size_t size);
+
+    // a buffer of at least 'size' bytes, NULL if 'size' is larger than MAX_SIZE or memory is short
+    void* acquire(size_t size);
+    // give back a buffer obtained from acquire(size), with the same 'size'
+    void release(void* buffer, size_t size);
+
+    size_t in_use_bytes() const { return m_in_use.load(std::memory_order_relaxed); }
+    size_t reserved_bytes() const { return m_reserved.load(std::memory_order_relaxed); }
+
+private:
+    struct free_buffer {
+        free_buffer* next;
+    };
+
+    struct size_class {
+        spin_mutex lock{"buffer_pool"};
+        free_buffer* free_list;
+        char** slabs;           // every slab of the class, freed with the pool
+        int slab_count;
+        int slab_capacity;
+    };
+
+    static int class_index(size_t size);
+    bool grow(size_class& c, size_t buffer_size);   // lock held
+
+    size_class m_classes[CLASSES];
+    std::atomic<size_t> m_in_use;       // bytes of the buffers handed out
+    std::atomic<size_t> m_reserved;     // bytes of the slabs
+};
+
+#endif
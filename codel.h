@@ -0,0 +1,82 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+// current time of the monotonic clock in microseconds, read from the vDSO
+inline uint64_t current_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+    Admission control on the queueing delay of requests (CoDel, in the form used by RPC servers).
+
+    The time a request spent in the queue (its sojourn time) is what a client waits before any work
+    is done for it. A short queue absorbing a burst drains again within an interval; a queue that
+    stays long means the requests arrive faster than they are served, and the waiting only grows.
+    So the queue is judged on the shortest sojourn seen during each interval: if even that one was
+    above the target, the server is overloaded for the next interval.
+
+    While overloaded, requests that waited more than twice the target are shed: they get a quick
+    503 instead of being served late, which keeps the queue (and the latency of the requests that
+    are served) near the target instead of letting it grow to the queue bound. A burst that queues
+    briefly is never shed, since the shortest sojourn of its interval stays low.
+
+    Shedding empties the queue at once, so right after it even an overloaded queue shows short
+    sojourns for a while. The overloaded state therefore only ends after an interval in which no
+    request waited more than twice the target, i.e. in which there was nothing left to shed;
+    otherwise the queue would build up to a full interval of delay every other interval.
+
+    Called by every worker for every request it dequeues; the state is a handful of atomics, and
+    the races between workers ending an interval only make the judgement a request or two late.
+*/
+class codel {
+public:
+    static const uint64_t TARGET_US = 5000;         // the acceptable standing queueing delay
+    static const uint64_t INTERVAL_US = 100000;     // how long the delay must stay above it, about a round trip or two
+
+    codel(uint64_t target_us = TARGET_US, uint64_t interval_us = INTERVAL_US)
+        : m_target(target_us), m_interval(interval_us), m_interval_end(0), m_min_sojourn(0), m_max_sojourn(0), m_overloaded(false) {}
+
+    codel(const codel&) = delete;
+    codel& operator=(const codel&) = delete;
+
+    uint64_t target() const { return m_target; }
+    bool overloaded() const { return m_overloaded.load(std::memory_order_relaxed); }
+
+    // a request dequeued at 'now_us' after waiting 'sojourn_us': whether to shed it
+    bool shed(uint64_t sojourn_us, uint64_t now_us) {
+        uint64_t end = m_interval_end.load(std::memory_order_relaxed);
+        if(now_us >= end && m_interval_end.compare_exchange_strong(end, now_us + m_interval, std::memory_order_relaxed)) {
+            // the interval is over: judge it, this request opens the next one
+            uint64_t shortest = m_min_sojourn.exchange(sojourn_us, std::memory_order_relaxed);
+            uint64_t longest = m_max_sojourn.exchange(sojourn_us, std::memory_order_relaxed);
+            bool overloaded = m_overloaded.load(std::memory_order_relaxed);
+            m_overloaded.store(shortest > m_target || (overloaded && longest > 2 * m_target), std::memory_order_relaxed);
+        } else {
+            uint64_t shortest = m_min_sojourn.load(std::memory_order_relaxed);
+            while(sojourn_us < shortest
+                  && !m_min_sojourn.compare_exchange_weak(shortest, sojourn_us, std::memory_order_relaxed)) {
+            }
+            uint64_t longest = m_max_sojourn.load(std::memory_order_relaxed);
+            while(sojourn_us > longest
+                  && !m_max_sojourn.compare_exchange_weak(longest, sojourn_us, std::memory_order_relaxed)) {
+            }
+        }
+        return sojourn_us > 2 * m_target && m_overloaded.load(std::memory_order_relaxed);
+    }
+
+private:
+    const uint64_t m_target;
+    const uint64_t m_interval;
+    std::atomic<uint64_t> m_interval_end;   // when the current interval ends
+    std::atomic<uint64_t> m_min_sojourn;    // the shortest sojourn of the current interval
+    std::atomic<uint64_t> m_max_sojourn;    // the longest one
+    std::atomic<bool> m_overloaded;         // the verdict on the last interval
+};
+
+#endif
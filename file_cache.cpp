@@ -0,0 +1,304 @@
+#include "file_cache.h"
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+file_cache::file_cache(size_t max_entries, size_t max_bytes, size_t max_file_bytes) :
+m_max_entries(max_entries), m_max_bytes(max_bytes), m_max_file_bytes(max_file_bytes), m_lock("file_cache"),
+m_bytes(0), m_generation(0), m_invalidate_hook(NULL), m_inotifyfd(-1), m_hits(0), m_misses(0), m_evictions(0), m_invalidations(0) {
+    m_lru.lru_prev = m_lru.lru_next = &m_lru;
+}
+
+file_cache::~file_cache() {
+    // the watcher thread is detached and the cache lives as long as the process, close what we own
+    m_invalidate_hook = NULL;
+    invalidate_all();
+}
+
+file_cache::entry* file_cache::acquire(const char* path) {
+    m_lock.lock();
+    auto it = m_table.find(std::string_view(path));
+    if(it != m_table.end()) {
+        entry* e = it->second;
+        e->refcount++;
+        // move to the front of the LRU list
+        e->lru_prev->lru_next = e->lru_next;
+        e->lru_next->lru_prev = e->lru_prev;
+        e->lru_next = m_lru.lru_next;
+        e->lru_prev = &m_lru;
+        m_lru.lru_next->lru_prev = e;
+        m_lru.lru_next = e;
+        m_lock.unlock();
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        return e;
+    }
+    uint64_t generation = m_generation;
+    m_lock.unlock();
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+
+    // stat, open and map without holding the lock, the disk may be slow
+    entry* e = load(path);
+    if(!e) {
+        return NULL;
+    }
+
+    std::vector<entry*> garbage;
+    m_lock.lock();
+    if(m_generation != generation) {
+        // an invalidation came in while we were loading and had nothing to drop yet: what we
+        // loaded may be the old version, serve it this once but don't cache it
+        m_lock.unlock();
+        return e;
+    }
+    auto ret = m_table.emplace(std::string_view(e->path), e);
+    if(!ret.second) {
+        // someone else loaded the same path meanwhile, use theirs
+        entry* other = ret.first->second;
+        other->refcount++;
+        m_lock.unlock();
+        destroy(e);
+        return other;
+    }
+
+    e->cached = true;
+    e->refcount = 2;    // the cache and the caller
+    e->lru_next = m_lru.lru_next;
+    e->lru_prev = &m_lru;
+    m_lru.lru_next->lru_prev = e;
+    m_lru.lru_next = e;
+    if(e->address) {
+        m_bytes += e->st.st_size;
+    }
+
+    // evict the least recently used entries until we are back under the limits
+    while(m_table.size() > m_max_entries || m_bytes > m_max_bytes) {
+        entry* victim = m_lru.lru_prev;
+        if(victim == e) {
+            break;
+        }
+        unlink(victim);
+        m_evictions.fetch_add(1, std::memory_order_relaxed);
+        if(put(victim)) {
+            garbage.push_back(victim);
+        }
+    }
+    m_lock.unlock();
+
+    for(entry* victim : garbage) {
+        destroy(victim);
+    }
+    return e;
+}
+
+void file_cache::release(entry* e) {
+    if(!e) {
+        return;
+    }
+    m_lock.lock();
+    bool last = put(e);
+    m_lock.unlock();
+    if(last) {
+        destroy(e);
+    }
+}
+
+void file_cache::invalidate(const char* path) {
+    m_lock.lock();
+    m_generation++;
+    auto it = m_table.find(std::string_view(path));
+    if(it != m_table.end()) {
+        entry* e = it->second;
+        unlink(e);
+        bool last = put(e);
+        m_lock.unlock();
+
+        m_invalidations.fetch_add(1, std::memory_order_relaxed);
+        if(last) {
+            destroy(e);
+        }
+    } else {
+        m_lock.unlock();
+    }
+
+    // whatever was derived from the file may outlive its entry
+    if(m_invalidate_hook) {
+        m_invalidate_hook(path);
+    }
+}
+
+void file_cache::invalidate_all() {
+    std::vector<entry*> garbage;
+    m_lock.lock();
+    m_generation++;
+    while(m_lru.lru_next != &m_lru) {
+        entry* e = m_lru.lru_next;
+        unlink(e);
+        m_invalidations.fetch_add(1, std::memory_order_relaxed);
+        if(put(e)) {
+            garbage.push_back(e);
+        }
+    }
+    m_lock.unlock();
+
+    for(entry* e : garbage) {
+        destroy(e);
+    }
+
+    if(m_invalidate_hook) {
+        m_invalidate_hook(NULL);
+    }
+}
+
+file_cache::entry* file_cache::load(const char* path) {
+    entry* e = new entry;
+    e->path = path;
+    e->fd = -1;
+    e->address = NULL;
+    e->refcount = 1;
+    e->cached = false;
+    e->resident_until = 0;
+    e->lru_prev = e->lru_next = NULL;
+
+    if(stat(path, &e->st) < 0) {
+        delete e;
+        return NULL;
+    }
+
+    // only regular files readable by everyone are ever served, don't hold anything else open
+    if(!S_ISREG(e->st.st_mode) || !(e->st.st_mode & S_IROTH)) {
+        return e;
+    }
+
+    e->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(e->fd < 0) {
+        return e;
+    }
+    // the file may have changed between stat() and open(), keep the state of what we opened
+    fstat(e->fd, &e->st);
+
+    if(e->st.st_size > 0 && (size_t)e->st.st_size <= m_max_file_bytes) {
+        void* address = mmap(0, e->st.st_size, PROT_READ, MAP_PRIVATE, e->fd, 0);
+        if(address != MAP_FAILED) {
+            e->address = (char*)address;
+        }
+    }
+    return e;
+}
+
+void file_cache::unlink(entry* e) {
+    m_table.erase(std::string_view(e->path));
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+    e->cached = false;
+    if(e->address) {
+        m_bytes -= e->st.st_size;
+    }
+}
+
+bool file_cache::put(entry* e) {
+    return --e->refcount == 0;
+}
+
+void file_cache::destroy(entry* e) {
+    if(e->address) {
+        munmap(e->address, e->st.st_size);
+    }
+    if(e->fd != -1) {
+        close(e->fd);
+    }
+    delete e;
+}
+
+bool file_cache::watch(const char* root) {
+    m_inotifyfd = inotify_init1(IN_CLOEXEC);
+    if(m_inotifyfd < 0) {
+        return false;
+    }
+    add_watch(root);
+
+    if(pthread_create(&m_watcher, NULL, watcher, this) != 0) {
+        close(m_inotifyfd);
+        m_inotifyfd = -1;
+        return false;
+    }
+    pthread_detach(m_watcher);
+    return true;
+}
+
+// watch 'dir' and, recursively, its subdirectories
+void file_cache::add_watch(const std::string& dir) {
+    const uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM
+                        | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR;
+    int wd = inotify_add_watch(m_inotifyfd, dir.c_str(), mask);
+    if(wd < 0) {
+        return;
+    }
+    m_watches[wd] = dir;
+
+    DIR* d = opendir(dir.c_str());
+    if(!d) {
+        return;
+    }
+    while(struct dirent* de = readdir(d)) {
+        if(de->d_type == DT_DIR && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            add_watch(dir + "/" + de->d_name);
+        }
+    }
+    closedir(d);
+}
+
+void* file_cache::watcher(void* arg) {
+    ((file_cache*)arg)->watch_loop();
+    return arg;
+}
+
+void file_cache::watch_loop() {
+    alignas(struct inotify_event) char buf[4096];
+    while(true) {
+        ssize_t len = read(m_inotifyfd, buf, sizeof(buf));
+        if(len <= 0) {
+            if(len < 0 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        for(char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            if(ev->mask & IN_Q_OVERFLOW) {
+                // events were lost, we cannot tell what changed
+                invalidate_all();
+                continue;
+            }
+
+            auto it = m_watches.find(ev->wd);
+            if(it == m_watches.end()) {
+                continue;
+            }
+            if(ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                m_watches.erase(it);
+                continue;
+            }
+            if(ev->len == 0) {
+                continue;
+            }
+
+            std::string path = it->second + "/" + ev->name;
+            if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                // a new directory, watch it too
+                add_watch(path);
+            } else if(ev->mask & IN_ISDIR) {
+                // a directory went away or was renamed, the paths of its files are gone with it
+                invalidate_all();
+            } else {
+                invalidate(path.c_str());
+            }
+        }
+    }
+}
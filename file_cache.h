@@ -0,0 +1,102 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "locker.h"
+
+/*
+    Cache of open files shared by all connections, keyed by the resolved path of the file.
+
+    An entry holds the 'struct stat' of the path and, for readable regular files, an open file
+    descriptor and a read-only mapping of the content. Connections borrow entries with acquire()
+    and give them back with release(); the entry stays valid (fd and mapping included) while it is
+    borrowed, even if it gets evicted or invalidated in the meantime. The last release() of an entry
+    that left the cache closes the file and unmaps it. An entry loaded while an invalidation came
+    in is handed out without being cached: it may hold the old version of the file, and the
+    invalidation found nothing to drop.
+
+    Limits: at most 'max_entries' entries (and so open file descriptors), at most 'max_bytes' bytes
+    mapped. Files larger than 'max_file_bytes' are cached without a mapping. When a limit is exceeded
+    the least recently used entries are evicted.
+
+    watch() starts a thread that invalidates entries through inotify whenever a file under the
+    document root is modified, replaced, moved, deleted or has its attributes changed.
+*/
+class file_cache {
+public:
+    static const size_t DEFAULT_MAX_ENTRIES = 1024;
+    static const size_t DEFAULT_MAX_BYTES = 256 * 1024 * 1024;
+    static const size_t DEFAULT_MAX_FILE_BYTES = 16 * 1024 * 1024;
+
+    struct entry {
+        std::string path;       // the key
+        struct stat st;         // the state of the file when it was cached
+        int fd;                 // open file, -1 unless a regular file readable by others
+        char* address;          // the mapped content, NULL if not mapped
+        int refcount;           // the number of borrowers, +1 while in the cache
+        std::atomic<bool> cached;   // whether the entry is still in the cache
+        std::atomic<uint64_t> resident_until;   // the whole content was found in the page cache, probes skipped until then (current_ms())
+        entry* lru_prev;        // neighbours in the LRU list, most recently used first
+        entry* lru_next;
+    };
+
+    file_cache(size_t max_entries = DEFAULT_MAX_ENTRIES, size_t max_bytes = DEFAULT_MAX_BYTES,
+               size_t max_file_bytes = DEFAULT_MAX_FILE_BYTES);
+    ~file_cache();
+
+    // borrow the entry of 'path', NULL if the path does not exist
+    entry* acquire(const char* path);
+    // give back an entry obtained from acquire()
+    void release(entry* e);
+    // drop the entry of 'path' from the cache, if any
+    void invalidate(const char* path);
+    // drop every entry
+    void invalidate_all();
+    // start invalidating entries on changes under 'root', returns false on failure
+    bool watch(const char* root);
+    // 'hook' is called after every invalidation, with the path or NULL for all of them
+    void set_invalidate_hook(void (*hook)(const char* path)) { m_invalidate_hook = hook; }
+
+    unsigned long hits() const { return m_hits.load(std::memory_order_relaxed); }
+    unsigned long misses() const { return m_misses.load(std::memory_order_relaxed); }
+    unsigned long evictions() const { return m_evictions.load(std::memory_order_relaxed); }
+    unsigned long invalidations() const { return m_invalidations.load(std::memory_order_relaxed); }
+
+private:
+    entry* load(const char* path);      // build a new entry, without holding the lock
+    void unlink(entry* e);              // remove from the table and the LRU list, lock held
+    bool put(entry* e);                 // drop a reference, lock held; true if it was the last one
+    static void destroy(entry* e);      // close and unmap
+    static void* watcher(void* arg);
+    void watch_loop();
+    void add_watch(const std::string& dir);
+
+    size_t m_max_entries;
+    size_t m_max_bytes;
+    size_t m_max_file_bytes;
+
+    spin_mutex m_lock;                                      // protects everything below, held for a lookup or an LRU move
+    std::unordered_map<std::string_view, entry*> m_table;   // keys point into entry::path
+    entry m_lru;                                            // head of the circular LRU list
+    size_t m_bytes;                                         // mapped bytes of the cached entries
+    uint64_t m_generation;                                  // bumped by every invalidation, see acquire()
+
+    void (*m_invalidate_hook)(const char* path);
+
+    int m_inotifyfd;
+    std::unordered_map<int, std::string> m_watches;         // inotify watch descriptor -> directory
+    pthread_t m_watcher;
+
+    std::atomic<unsigned long> m_hits;
+    std::atomic<unsigned long> m_misses;
+    std::atomic<unsigned long> m_evictions;
+    std::atomic<unsigned long> m_invalidations;
+};
+
+#endif
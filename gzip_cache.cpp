@@ -0,0 +1,292 @@
+#include "gzip_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "page_cache.h"
+
+gzip_cache::gzip_cache(file_cache& files, size_t budget) :
+m_files(files), m_budget(budget), m_pool(NULL), m_lock("gzip_cache"), m_bytes(0), m_compressed(0), m_siblings(0) {
+    m_lru.lru_prev = m_lru.lru_next = &m_lru;
+}
+
+gzip_cache::~gzip_cache() {
+    // the pool belongs to main() and the cache lives as long as the process, free what we own
+    m_pool = NULL;
+    invalidate(NULL);
+}
+
+gzip_cache::state gzip_cache::lookup(const char* path, const entry*& copy) {
+    m_lock.lock();
+    auto it = m_table.find(std::string_view(path));
+    if(it == m_table.end()) {
+        m_lock.unlock();
+        return MISSING;
+    }
+    entry* e = it->second;
+    // move to the front of the LRU list
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    e->lru_next = m_lru.lru_next;
+    e->lru_prev = &m_lru;
+    m_lru.lru_next->lru_prev = e;
+    m_lru.lru_next = e;
+
+    state st = e->st;
+    if(st == COMPRESSED) {
+        e->refcount++;
+        copy = e;
+    }
+    m_lock.unlock();
+    return st;
+}
+
+void gzip_cache::release(const entry* copy) {
+    if(!copy) {
+        return;
+    }
+    entry* e = const_cast<entry*>(copy);
+    m_lock.lock();
+    bool last = put(e);
+    m_lock.unlock();
+    if(last) {
+        destroy(e);
+    }
+}
+
+void gzip_cache::request(const char* path, const struct stat& st) {
+    if(!m_pool) {
+        return;
+    }
+    entry* e = new entry;
+    e->path = path;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    e->st = PENDING;
+    e->data = NULL;
+    e->len = 0;
+    e->refcount = 2;    // the cache and the job
+    e->cached = true;
+
+    std::vector<entry*> garbage;
+    m_lock.lock();
+    if(!m_table.emplace(std::string_view(e->path), e).second) {
+        // another request queued it first
+        m_lock.unlock();
+        delete e;
+        return;
+    }
+    e->lru_next = m_lru.lru_next;
+    e->lru_prev = &m_lru;
+    m_lru.lru_next->lru_prev = e;
+    m_lru.lru_next = e;
+    evict(garbage);
+    m_lock.unlock();
+
+    for(entry* victim : garbage) {
+        destroy(victim);
+    }
+
+    job* j = new job;
+    j->cache = this;
+    j->e = e;
+    if(!m_pool->append(j)) {
+        // the pool is swamped, a later request tries again
+        delete j;
+        abandon(e);
+    }
+}
+
+void gzip_cache::invalidate(const char* path) {
+    std::vector<entry*> garbage;
+    m_lock.lock();
+    if(!path) {
+        while(m_lru.lru_next != &m_lru) {
+            entry* e = m_lru.lru_next;
+            unlink(e);
+            if(put(e)) {
+                garbage.push_back(e);
+            }
+        }
+    } else {
+        // the file itself, and the file of a sibling that changed
+        std::string_view keys[2] = { std::string_view(path), std::string_view(path) };
+        size_t len = strlen(path);
+        bool sibling = len > 3 && strcmp(path + len - 3, ".gz") == 0;
+        if(sibling) {
+            keys[1] = std::string_view(path, len - 3);
+        }
+        for(int i = 0; i < (sibling ? 2 : 1); i++) {
+            auto it = m_table.find(keys[i]);
+            if(it != m_table.end()) {
+                entry* e = it->second;
+                unlink(e);
+                if(put(e)) {
+                    garbage.push_back(e);
+                }
+            }
+        }
+    }
+    m_lock.unlock();
+
+    for(entry* e : garbage) {
+        destroy(e);
+    }
+}
+
+void gzip_cache::job::process() {
+    std::string sibling = e->path + ".gz";
+    struct stat st;
+    state result = IDENTITY;
+    char* data = NULL;
+    size_t len = 0;
+
+    // a sibling older than the file was made from an older version of it
+    if(stat(sibling.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)
+            && (st.st_mtim.tv_sec > e->mtime.tv_sec
+                || (st.st_mtim.tv_sec == e->mtime.tv_sec && st.st_mtim.tv_nsec >= e->mtime.tv_nsec))) {
+        result = SIBLING;
+        cache->m_siblings.fetch_add(1, std::memory_order_relaxed);
+    } else if(cache->m_budget > 0 && e->size >= MIN_FILE_BYTES && e->size <= MAX_FILE_BYTES) {
+        /*
+            From the file the file cache has open, if it still has the version we were asked for.
+            Read with pread(), not out of its mapping: a file truncated while we read would raise
+            SIGBUS in here and take the server down, while pread() just comes back short and the
+            job gives up (the inotify invalidation of the change follows).
+        */
+        file_cache::entry* file = cache->m_files.acquire(e->path.c_str());
+        char* content = NULL;
+        if(file && file->fd != -1 && file->st.st_ino == e->ino && file->st.st_dev == e->dev
+                && file->st.st_size == e->size && file->st.st_mtim.tv_sec == e->mtime.tv_sec
+                && file->st.st_mtim.tv_nsec == e->mtime.tv_nsec
+                && (content = (char*)malloc(e->size)) != NULL
+                && page_cache::read(file->fd, 0, content, e->size)
+                && compress(content, e->size, data, len)) {
+            // keep copies that save at least an eighth, well past the Content-Encoding header they
+            // cost, and that leave room for others in the budget
+            if(len < (size_t)(e->size - e->size / 8) && len <= cache->m_budget / 4) {
+                result = COMPRESSED;
+                cache->m_compressed.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                free(data);
+                data = NULL;
+                len = 0;
+            }
+        }
+        free(content);
+        cache->m_files.release(file);
+    }
+
+    cache->finish(e, result, data, len);
+    delete this;
+}
+
+void gzip_cache::job::shed() {
+    cache->abandon(e);
+    delete this;
+}
+
+void gzip_cache::finish(entry* e, state st, char* data, size_t len) {
+    std::vector<entry*> garbage;
+    m_lock.lock();
+    e->st = st;
+    e->data = data;
+    e->len = len;
+    // an entry invalidated meanwhile is not counted, it goes away with its last reference
+    if(e->cached && data) {
+        m_bytes += len;
+        evict(garbage);
+    }
+    bool last = put(e);
+    m_lock.unlock();
+
+    for(entry* victim : garbage) {
+        destroy(victim);
+    }
+    if(last) {
+        destroy(e);
+    }
+}
+
+void gzip_cache::abandon(entry* e) {
+    m_lock.lock();
+    if(e->cached) {
+        unlink(e);
+        put(e);     // never the last reference, the job holds one
+    }
+    bool last = put(e);
+    m_lock.unlock();
+    if(last) {
+        destroy(e);
+    }
+}
+
+void gzip_cache::unlink(entry* e) {
+    m_table.erase(std::string_view(e->path));
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+    e->cached = false;
+    if(e->data) {
+        m_bytes -= e->len;
+    }
+}
+
+bool gzip_cache::put(entry* e) {
+    return --e->refcount == 0;
+}
+
+// evict the least recently used entries until we are back under the limits
+void gzip_cache::evict(std::vector<entry*>& garbage) {
+    while(m_table.size() > MAX_ENTRIES || m_bytes > m_budget) {
+        entry* victim = m_lru.lru_prev;
+        if(victim == &m_lru) {
+            break;
+        }
+        unlink(victim);
+        if(put(victim)) {
+            garbage.push_back(victim);
+        }
+    }
+}
+
+void gzip_cache::destroy(entry* e) {
+    free(e->data);
+    delete e;
+}
+
+// the whole of 'data' as one gzip stream (deflate with the gzip header and trailer), in 'out' from malloc()
+bool gzip_cache::compress(const char* data, size_t size, char*& out, size_t& out_len) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // 15 + 16: the largest window, wrapped in a gzip header rather than a zlib one
+    if(deflateInit2(&z, LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    size_t bound = deflateBound(&z, size);
+    out = (char*)malloc(bound);
+    if(!out) {
+        deflateEnd(&z);
+        return false;
+    }
+    z.next_in = (Bytef*)data;
+    z.avail_in = size;
+    z.next_out = (Bytef*)out;
+    z.avail_out = bound;
+    // the bound leaves room for everything, a single call does it all
+    int ret = deflate(&z, Z_FINISH);
+    out_len = z.total_out;
+    deflateEnd(&z);
+    if(ret != Z_STREAM_END) {
+        free(out);
+        out = NULL;
+        return false;
+    }
+    // give back what the bound reserved beyond the stream
+    char* shrunk = (char*)realloc(out, out_len);
+    if(shrunk) {
+        out = shrunk;
+    }
+    return true;
+}
@@ -0,0 +1,118 @@
+#ifndef GZIP_CACHE_H
+#define GZIP_CACHE_H
+
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "locker.h"
+#include "file_cache.h"
+#include "threadpool.h"
+
+/*
+    Gzip-encoded bodies of the compressible files, for the clients that accept them
+    (Accept-Encoding: gzip), keyed by the resolved path of the file like file_cache.
+
+    A file may come with a precompressed sibling, its path with ".gz" appended, made ahead of time
+    at whatever level the site likes: that one is sent as it is, from the file cache like any file.
+    Other files are compressed here, once per version, and the copy is kept in memory. Neither is
+    ever done on the thread serving the request: a path it knows nothing about is handed to
+    request(), which records it as PENDING and queues a job on the background pool (see start());
+    the requests that come meanwhile are answered uncompressed. The job looks for a sibling that is
+    not older than the file, compresses the file if there is none, and records what it found:
+        SIBLING     send the sibling
+        COMPRESSED  send the copy, borrowed with lookup() and given back with release()
+        IDENTITY    send the file, nothing smaller is worth it (or the file is too large to compress)
+
+    Entries are dropped by invalidate(), the inotify hook of the file cache, when the file or its
+    sibling changes. Memory is bounded by 'budget' bytes of copies and MAX_ENTRIES entries, the
+    least recently used ones are evicted. A budget of 0 disables compression, siblings are still sent.
+*/
+class gzip_cache {
+public:
+    static const size_t DEFAULT_BUDGET = 32 * 1024 * 1024;
+    static const size_t MAX_ENTRIES = 4096;
+    static const off_t MIN_FILE_BYTES = 128;                // smaller bodies are not worth a job
+    static const off_t MAX_FILE_BYTES = 4 * 1024 * 1024;    // larger ones are left to precompressed siblings
+    static const int LEVEL = 9;                             // paid once per version, on a background thread
+
+    enum state { MISSING, PENDING, SIBLING, COMPRESSED, IDENTITY };
+
+    struct entry {
+        std::string path;       // the key, the path of the file (not of its sibling)
+        dev_t dev;              // the version of the file it was requested for
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        state st;               // PENDING until the job is done, read and written with the lock held
+        char* data;             // COMPRESSED: the gzip stream, from malloc()
+        size_t len;
+        int refcount;           // the job and the borrowers, +1 while in the cache
+        bool cached;            // whether the entry is still in the cache
+        entry* lru_prev;        // neighbours in the LRU list, most recently used first
+        entry* lru_next;
+    };
+
+    /*
+        The search and compression of one version of a file, in the shape the threadpool expects of
+        a request. There is no client to hang up; a shed job leaves the path to a later request().
+    */
+    class job {
+    public:
+        gzip_cache* cache;
+        entry* e;               // holds a reference
+        uint64_t enqueued;      // in current_us(), set by the threadpool
+
+        void process();
+        void set_enqueue_time( uint64_t us ) { enqueued = us; }
+        uint64_t enqueue_time() const { return enqueued; }
+        bool hung_up() { return false; }
+        void drop() { process(); }
+        void shed();
+    };
+
+    gzip_cache(file_cache& files, size_t budget = DEFAULT_BUDGET);
+    ~gzip_cache();
+
+    void set_budget(size_t budget) { m_budget = budget; }
+    // hand the jobs to 'pool', until then (or with NULL) the cache is disabled
+    void start(threadpool<job>* pool) { m_pool = pool; }
+    bool enabled() const { return m_pool != NULL; }
+
+    // what is known of 'path': a COMPRESSED 'copy' is borrowed, the other states borrow nothing
+    state lookup(const char* path, const entry*& copy);
+    // give back a copy obtained from lookup()
+    void release(const entry* copy);
+    // queue the search and compression of 'path', in the version 'st' (a regular file)
+    void request(const char* path, const struct stat& st);
+    // drop the entry of 'path', or of the file 'path' is the sibling of; NULL drops every entry
+    void invalidate(const char* path);
+
+    unsigned long compressed() const { return m_compressed.load(std::memory_order_relaxed); }
+    unsigned long siblings() const { return m_siblings.load(std::memory_order_relaxed); }
+
+private:
+    void finish(entry* e, state st, char* data, size_t len);    // record the result of a job
+    void abandon(entry* e);             // a job that could not run, forget the path
+    void unlink(entry* e);              // remove from the table and the LRU list, lock held
+    bool put(entry* e);                 // drop a reference, lock held; true if it was the last one
+    void evict(std::vector<entry*>& garbage);   // back under the limits, lock held
+    static void destroy(entry* e);
+    static bool compress(const char* data, size_t size, char*& out, size_t& out_len);
+
+    file_cache& m_files;                // the bodies are read from its open files, with pread()
+    size_t m_budget;
+    threadpool<job>* m_pool;
+
+    spin_mutex m_lock;                                      // protects everything below
+    std::unordered_map<std::string_view, entry*> m_table;   // keys point into entry::path
+    entry m_lru;                                            // head of the circular LRU list
+    size_t m_bytes;                                         // bytes of the copies in the cache
+
+    std::atomic<unsigned long> m_compressed;
+    std::atomic<unsigned long> m_siblings;
+};
+
+#endif
@@ -1,4 +1,8 @@
 #include "http_conn.h"
+#include "codel.h"
+#ifdef LOCK_STATS
+#include "lock_stats.h"
+#endif
 
 // Alias
 using METHOD = http_conn::METHOD;
@@ -6,22 +10,24 @@ using CHECK_STATE = http_conn::CHECK_STATE;
 using HTTP_CODE = http_conn::HTTP_CODE;
 using LINE_STATUS = http_conn::LINE_STATUS;
 
-// define some stateus message of HHTP response
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
-const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+// the names of the methods, for the access log
+static const char* const method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT" };
+
+// finds line ends and token boundaries for the parser, with the best instruction set of the CPU
+static const http_scanner& scanner = http_scanner::best();
 
 // root directory of the website
 const char* doc_root = "/home/francis/Linux-Web-Server/resources";
 
-int http_conn::m_epollfd = -1;      // events from all sockets are registered to the same epoll object
-int http_conn::m_user_count = 0;    // number of users
+buffer_pool http_conn::m_buffer_pools[ topology::MAX_NODES ];  // read buffers and request states of the requests in flight
+bool http_conn::m_use_sendfile = false;         // send files with sendfile() instead of mmap() + writev()
+bool http_conn::m_owned = false;                // every connection is served by its reactor alone (-o)
+response_cache http_conn::m_response_cache;     // materialized responses of small files, lock-free for readers
+file_cache http_conn::m_file_cache;             // open files shared by all connections
+gzip_cache http_conn::m_gzip_cache( m_file_cache );    // compressed from the mappings of the file cache, started by main()
+http_headers http_conn::m_headers;              // prebuilt response headers, the Date refreshed every second
+metrics http_conn::m_metrics;                   // sharded per thread, added up when /__stats is requested
+threadpool< http_conn::io_job >* http_conn::m_io_pool = NULL;  // created by main() unless -d 0
 
 // set FD as non-blocking
 int setnonblocking(int fd) {
@@ -38,19 +44,48 @@ void addfd(int epollfd, int fd, bool one_shot) {
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLRDHUP;
 
+    /*
+        With EPOLLONESHOT the connection reports a single event until a worker re-arms it with modfd(),
+        so the reactor never reads into the buffer of a request a worker is parsing.
+    */
     if(one_shot) {
-        event.events | EPOLLONESHOT;
+        event.events |= EPOLLONESHOT;
     }
 
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    http_conn::m_metrics.add(metrics::EPOLL_CTL_CALLS);
     // set up the fd as non-blocking
     setnonblocking(fd);
 
 }
 
+/*
+    Ownership mode: the connection is registered for good, edge-triggered in both directions. Only
+    its reactor touches it, so nothing has to be masked while a request is served; an edge that
+    comes while serve() runs is reported at the next epoll_wait, which then finds nothing to do.
+*/
+static void add_owned_fd(int epollfd, int fd) {
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+    http_conn::m_metrics.add(metrics::EPOLL_CTL_CALLS);
+    setnonblocking(fd);
+}
+
+// ownership mode: registering an edge-triggered descriptor again reports the edges it is at, once
+static void rearm_owned_fd(int epollfd, int fd) {
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    http_conn::m_metrics.add(metrics::EPOLL_CTL_CALLS);
+}
+
 // remove file descriptor which require listening from epoll
 void removefd(int epollfd, int fd) {
     epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
+    http_conn::m_metrics.add(metrics::EPOLL_CTL_CALLS);
     close(fd);
 }
 
@@ -62,20 +97,130 @@ void modfd(int epollfd, int fd, int ev) {
     // event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    http_conn::m_metrics.add(metrics::EPOLL_CTL_CALLS);
+}
+
+/*
+    Lexically normalize the absolute URL path 'path' in place:
+    repeated slashes are collapsed, "." segments are dropped and ".." segments remove the previous
+    segment, never going above "/". e.g. "//images/./../index.html" becomes "/index.html"
+*/
+static void normalize_path( char* path ) {
+    char* out = path;
+    const char* in = path;
+    while ( *in ) {
+        while ( *in == '/' ) {
+            in++;
+        }
+        if ( !*in ) {
+            break;
+        }
+        const char* segment = in;
+        while ( *in && *in != '/' ) {
+            in++;
+        }
+        size_t len = in - segment;
+        if ( len == 1 && segment[ 0 ] == '.' ) {
+            continue;
+        }
+        if ( len == 2 && segment[ 0 ] == '.' && segment[ 1 ] == '.' ) {
+            // back to the slash before the last segment written
+            while ( out > path && *--out != '/' ) {
+            }
+            continue;
+        }
+        *out++ = '/';
+        memmove( out, segment, len );
+        out += len;
+    }
+    if ( out == path ) {
+        *out++ = '/';
+    }
+    *out = '\0';
+}
+
+// our metrics, then those the file cache and the logger keep themselves, and those of the locks in an instrumented build
+char* http_conn::render_stats( size_t& len ) {
+    const file_cache& files = m_file_cache;
+    metrics::text extra = { (char*)malloc( 4096 ), 0, 4096, false };
+    if ( !extra.buf ) {
+        return NULL;
+    }
+    extra.append( "# HELP file_cache_hits_total Files found open in the file cache.\n# TYPE file_cache_hits_total counter\n"
+                  "file_cache_hits_total %lu\n"
+                  "# HELP file_cache_misses_total Files opened and mapped.\n# TYPE file_cache_misses_total counter\n"
+                  "file_cache_misses_total %lu\n"
+                  "# HELP file_cache_evictions_total Files evicted from the file cache.\n# TYPE file_cache_evictions_total counter\n"
+                  "file_cache_evictions_total %lu\n"
+                  "# HELP file_cache_invalidations_total Files dropped from the file cache on a change.\n"
+                  "# TYPE file_cache_invalidations_total counter\n"
+                  "file_cache_invalidations_total %lu\n"
+                  "# HELP gzip_cache_compressed_total Files compressed by the gzip cache, once per version.\n"
+                  "# TYPE gzip_cache_compressed_total counter\n"
+                  "gzip_cache_compressed_total %lu\n"
+                  "# HELP gzip_cache_siblings_total Precompressed .gz siblings found by the gzip cache.\n"
+                  "# TYPE gzip_cache_siblings_total counter\n"
+                  "gzip_cache_siblings_total %lu\n"
+                  "# HELP log_records_dropped_total Log and access log records dropped on a full ring.\n"
+                  "# TYPE log_records_dropped_total counter\n"
+                  "log_records_dropped_total %lu\n",
+                  files.hits(), files.misses(), files.evictions(), files.invalidations(),
+                  m_gzip_cache.compressed(), m_gzip_cache.siblings(), logger::get().dropped() );
+#ifdef LOCK_STATS
+    lock_stats::render( extra );
+#endif
+    char* body = extra.failed ? NULL : m_metrics.render( extra.buf, len );
+    free( extra.buf );
+    return body;
+}
+
+// idle timer callback: the client has been silent for IDLE_TIMEOUT ms
+static void idle_timeout(void* user_data) {
+    ((http_conn*)user_data)->expire();
 }
 
 // initialize new connection
-void http_conn::init(int sockfd, const sockaddr_in& addr) {
+void http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd, timer_wheel* wheel) {
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    m_last_worker = -1;
+    m_shedding = false;
+    m_io_pending = false;
+    m_io_job.conn = this;
+    m_accept_time = current_ns();
+    // the buffers are borrowed when the first request arrives
+    m_pool = &m_buffer_pools[ 0 ];
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_state = NULL;
+
+    // arm the idle timer
+    m_timer_wheel = wheel;
+    m_timer.cb_func = idle_timeout;
+    m_timer.user_data = this;
+    m_idle_deadline = current_ms() + IDLE_TIMEOUT;
+    m_timer.expire = m_idle_deadline;
+    m_timer_wheel->add_timer(&m_timer);
 
     // set up port multiplexing
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-    // add to epoll object
-    addfd(m_epollfd, sockfd, true);
-    m_user_count++;
+    /*
+        Responses are already coalesced into one writev per batch. Without TCP_NODELAY, Nagle holds
+        the last small batch of a pipeline until the client's delayed ACK (~40 ms) comes back.
+    */
+    int nodelay = 1;
+    setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // add to epoll object, the io_uring backend has no epoll object (epollfd is -1)
+    if(m_owned) {
+        add_owned_fd(m_epollfd, sockfd);
+    } else if(m_epollfd != -1) {
+        addfd(m_epollfd, sockfd, true);
+    }
+    m_metrics.add( metrics::CONNECTIONS_ACCEPTED );
     init();
 
 }
@@ -88,60 +233,247 @@ void http_conn::init() {
     m_checked_index = 0;
     m_start_line = 0;
     m_read_index = 0;
-    m_write_index = 0;
+
+    next_request();
+    next_batch();
+}
+
+// reset the parser for the next request, which starts right after the one just parsed
+void http_conn::next_request() {
+    m_check_state = CHECK_STATE_REQUESTLINE;
+    m_request_start = m_checked_index;
 
     // initialize the HTTP Request Line data
     m_method = GET;
     m_url = 0;
     m_version = 0;
     m_linger = false;
+    m_accept_gzip = false;
     m_content_length = 0;
     m_host = 0;
+    m_referer = 0;
+    m_user_agent = 0;
+}
 
+// reset the write side once every reply of the batch is sent
+void http_conn::next_batch() {
+    m_write_index = 0;
+    m_reply_count = 0;
+    m_reply_index = 0;
+    m_iv_count = 0;
+    m_iv_index = 0;
+    m_more_requests = false;
+}
 
-    // set 'READ_BUFFER_SIZE' bytes of 'm_read_buf' to 0
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf,WRITE_BUFFER_SIZE);
-    bzero(m_real_file,FILENAME_LEN);
+/*
+    Move the bytes of the request being parsed (possibly incomplete, possibly followed by more
+    pipelined requests) to the start of the read buffer, so that read() has room for what follows.
+    The lines parsed so far are kept, so the pointers into them are moved along.
+*/
+void http_conn::compact_read_buffer() {
+    int shift = m_request_start;
+    if ( shift == 0 ) {
+        return;
+    }
+    memmove( m_read_buf, m_read_buf + shift, m_read_index - shift );
+    rebase( m_read_buf + shift, m_read_buf );
+    m_read_index -= shift;
+    m_checked_index -= shift;
+    m_start_line -= shift;
+    m_request_start = 0;
 }
 
-// close the connection
+// the bytes at 'from' are now at 'to': move the pointers of the request line and headers along
+void http_conn::rebase( char* from, char* to ) {
+    if ( m_url ) {
+        m_url = to + ( m_url - from );
+    }
+    if ( m_version ) {
+        m_version = to + ( m_version - from );
+    }
+    if ( m_host ) {
+        m_host = to + ( m_host - from );
+    }
+    if ( m_referer ) {
+        m_referer = to + ( m_referer - from );
+    }
+    if ( m_user_agent ) {
+        m_user_agent = to + ( m_user_agent - from );
+    }
+}
+
+/*
+    Borrow the buffers of a request from the pool, data has arrived on an idle connection. They come
+    from the pool of the node the reading thread is pinned to (-p), so the reactor that reads the
+    request and the worker of the same node touch local memory.
+*/
+bool http_conn::attach_buffers() {
+    m_pool = &m_buffer_pools[ topology::current_node() ];
+    m_read_buf = ( char* )m_pool->acquire( READ_BUFFER_SIZE );
+    m_state = ( request_state* )m_pool->acquire( sizeof( request_state ) );
+    if ( !m_read_buf || !m_state ) {
+        detach_buffers();
+        return false;
+    }
+    m_read_size = READ_BUFFER_SIZE;
+    for ( int i = 0; i < MAX_PIPELINE; i++ ) {
+        m_state->replies[ i ].clear();
+    }
+    return true;
+}
+
+// give the buffers back to the pool, the connection is idle or closed
+void http_conn::detach_buffers() {
+    m_pool->release( m_read_buf, m_read_size ? m_read_size : READ_BUFFER_SIZE );
+    m_pool->release( m_state, sizeof( request_state ) );
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_state = NULL;
+}
+
+/*
+    The request being parsed fills the whole read buffer: move it to a buffer of the next size class
+    of the pool. The request stays contiguous, so the parser and the pointers into it keep working.
+*/
+bool http_conn::grow_read_buffer() {
+    if ( m_read_size >= MAX_REQUEST_SIZE ) {
+        return false;
+    }
+    char* larger = ( char* )m_pool->acquire( 2 * m_read_size );
+    if ( !larger ) {
+        return false;
+    }
+    memcpy( larger, m_read_buf, m_read_index );
+    rebase( m_read_buf, larger );
+    m_pool->release( m_read_buf, m_read_size );
+    m_read_buf = larger;
+    m_read_size *= 2;
+    return true;
+}
+
+/*
+    close the connection. Not while the I/O pool has it: resume() re-arms it, and the reactor sees
+    the hang-up or the error again and closes it then
+*/
 void http_conn::close_conn() {
+    if(m_io_pending.load(std::memory_order_acquire)) {
+        return;
+    }
     if(m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        m_timer_wheel->del_timer(&m_timer);
+        unmap();
+        detach_buffers();
+        if(m_epollfd != -1 && !m_owned) {
+            removefd(m_epollfd, m_sockfd);
+        } else {
+            // closing the last reference removes the socket from the epoll object too
+            close(m_sockfd);
+        }
         m_sockfd = -1;
-        m_user_count--;
+        m_metrics.add( metrics::CONNECTIONS_CLOSED );
+    }
+}
+
+/*
+    The idle timeout expired. With epoll the reactor closes the connection right away. With io_uring,
+    operations of the ring may still use the connection: shutting the socket down ends them, and the
+    reactor closes the connection once they completed.
+*/
+void http_conn::expire() {
+    // there was activity since the timer was armed, wait for the rest of the timeout
+    if(m_io_pending.load(std::memory_order_acquire)) {
+        // waiting for the disk is not being idle
+        m_idle_deadline = current_ms() + IDLE_TIMEOUT;
+    }
+    if(m_idle_deadline > current_ms()) {
+        m_timer.expire = m_idle_deadline;
+        m_timer_wheel->add_timer(&m_timer);
+        return;
+    }
+    if(m_epollfd != -1) {
+        close_conn();
+    } else if(m_sockfd != -1) {
+        shutdown(m_sockfd, SHUT_RDWR);
     }
 }
 
 
+/*
+    Only the deadline moves, in the first cache line of the connection: re-linking the timer in the
+    wheel would write to the timers of two or three other connections on every event. The timer
+    fires at the old deadline and expire() arms it again for the new one, at most once per timeout.
+*/
+void http_conn::refresh_timer() {
+    m_idle_deadline = current_ms() + IDLE_TIMEOUT;
+}
+
 // write in non-blocking mode
-bool http_conn::write()
-{
+bool http_conn::write() {
+    uint64_t start = current_ns();
+    size_t bytes = 0;
+    bool ok = write_replies( bytes );
+    m_metrics.record( metrics::WRITE, current_ns() - start );
+    account_sent( bytes );
+    return ok;
+}
 
-    // printf("write all data at once\n");
-    // return true;
-    int temp = 0;
-    int bytes_have_send = 0;    
-    int bytes_to_send = m_write_index;
-    
-    if ( bytes_to_send == 0 ) {
-        /*
-            Calls 'modfd' to modify the file descriptor in the epoll event to wait for incoming data.
-            This essentially sets the server up to listen for the next request from the same client
-        */
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
-        init();     // reset the internal state of the 'http_conn' object                             
-        return true;
+// bytes of responses went out
+void http_conn::account_sent( size_t bytes ) {
+    m_metrics.add( metrics::BYTES_SENT, bytes );
+    if ( bytes > 0 && m_accept_time != 0 ) {
+        m_metrics.record( metrics::FIRST_BYTE, current_ns() - m_accept_time );
+        m_accept_time = 0;
     }
+}
 
-    while(true) {
+// write the replies of the batch, adding the bytes written to 'bytes'
+bool http_conn::write_replies( size_t& bytes )
+{
+    ssize_t temp = 0;
+    
+    while ( m_reply_index < m_reply_count ) {
         /*
-            Uses 'writev' to perform scatter-write operation. 'writev' is used to write data from 
-            multiple buffers ('m_iv' in this case) into a single file descriptor ('m_sockfd'). This
-            is often used for efficiency when writing data from different memory locations.
+            A body about to go out is not in the page cache: the write would block the reactor in a
+            disk read. The I/O pool reads it in, the write goes on when it hands the connection back.
         */
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if ( m_io_pool && !files_resident() && offload() ) {
+            return true;
+        }
+
+        reply& r = m_state->replies[ m_reply_index ];
+        if ( m_iv_index < r.iv_end ) {
+            /*
+                Uses 'writev' to perform scatter-write operation. 'writev' is used to write data from 
+                multiple buffers ('m_state->iv' in this case) into a single file descriptor ('m_sockfd'). This
+                is often used for efficiency when writing data from different memory locations.
+                The blocks of all the pipelined replies go in the same call, up to the next reply
+                whose body is sent with sendfile.
+            */
+            int last = m_reply_index;
+            while ( m_state->replies[ last ].file_left == 0 && last + 1 < m_reply_count ) {
+                last++;
+            }
+            if ( m_state->replies[ last ].file_left == 0 ) {
+                temp = writev( m_sockfd, m_state->iv + m_iv_index, m_state->replies[ last ].iv_end - m_iv_index );
+            } else {
+                /*
+                    sendfile mode, a body follows the blocks. MSG_MORE tells the kernel so, the header
+                    and the first bytes of the file leave in the same segment.
+                */
+                struct msghdr msg;
+                memset( &msg, 0, sizeof( msg ) );
+                msg.msg_iov = m_state->iv + m_iv_index;
+                msg.msg_iovlen = m_state->replies[ last ].iv_end - m_iv_index;
+                temp = sendmsg( m_sockfd, &msg, MSG_MORE );
+            }
+        } else {
+            /*
+                sendfile mode, the body is copied from the page cache to the socket inside the kernel.
+                sendfile advances r.file_offset, so the next call resumes where this one stopped.
+            */
+            temp = sendfile( m_sockfd, r.file_fd, &r.file_offset, r.file_left );
+        }
+
         if ( temp <= -1 ) {  
             /*
                 If the error is 'EAGAIN', it means that the TCP write buffer has no space at the moment, 
@@ -151,198 +483,529 @@ bool http_conn::write()
                 If it encounters any other error, call unmap() to release any resources associated memory mapping.
             */
             if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                rearm( EPOLLOUT );
                 return true;
             }
             unmap();
             return false;
         }
 
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send ) {
-            unmap();
-            /*
-                Depending on the value of m_linger, it decides whether to keep the connection open for potential 
-                future request or close it.
-                    - m_linger is true: call init() to reset the internal state, modify the epoll event to wait for incoming data
-                    - m_linger is false: modify the epoll event to wait for incoming data, return false to indicate the connection should be closed
-            */
-            if(m_linger) {
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
-            } else {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            } 
+        bytes += temp;
+        if ( m_iv_index < r.iv_end ) {
+            // skip what was written, the next writev/sendmsg picks up from there
+            consume_iov( temp );
+        } else {
+            r.file_left -= temp;
         }
+        advance_replies();
+    }
+
+    /*
+        If the batch was cut short, the remaining pipelined requests are already in the read buffer:
+        the reactor hands the connection back to the threadpool instead of waiting for EPOLLIN.
+    */
+    if ( !end_batch() ) {
+        rearm( EPOLLIN );
+        return false;
     }
+    if ( !m_more_requests ) {
+        rearm( EPOLLIN );
+    }
+    return true;
 }
 
-// unmap the memory mapping 
-void http_conn::unmap() {
-    if( m_file_address )
-    {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+void http_conn::rearm( int ev ) {
+    if ( !m_owned ) {
+        modfd( m_epollfd, m_sockfd, ev );
     }
 }
 
-// Generate an HTTP response based on the given HTTP_CODE (the result of processing the request)
-bool http_conn::process_write(HTTP_CODE ret) {
-    // set up the status line, headers and content (if appicable) for the response
-    switch (ret)
-    {
-        case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
-            add_headers( strlen( error_500_form ) );
-            if ( ! add_content( error_500_form ) ) {
-                return false;
-            }
-            break;
-        case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
-            add_headers( strlen( error_400_form ) );
-            if ( ! add_content( error_400_form ) ) {
-                return false;
-            }
-            break;
-        case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
+/*
+    The part of the body of 'r' not sent yet: bytes [offset, offset + len) of the file, and the
+    mapping of the whole file if there is one (NULL in sendfile mode without a cached mapping).
+    False if 'r' has no file body.
+*/
+bool http_conn::unsent_body( const reply& r, off_t& offset, size_t& len, const char*& mapping ) {
+    if ( !r.file_entry ) {
+        return false;
+    }
+    mapping = r.file_address ? r.file_address : r.file_entry->address;
+    if ( r.file_fd != -1 ) {
+        // sendfile mode: the body goes after the blocks of the reply
+        offset = r.file_offset;
+        len = r.file_left;
+        return true;
+    }
+    // the body is the last block of the reply, consume_iov() moves its start along
+    const struct iovec& body = m_state->iv[ r.iv_end - 1 ];
+    if ( m_iv_index >= r.iv_end || !mapping ) {
+        len = 0;
+        return true;
+    }
+    offset = ( const char* )body.iov_base - mapping;
+    len = body.iov_len;
+    return true;
+}
+
+/*
+    A body is probed from where its sending stopped. A file found whole in the page cache is not
+    probed again for PROBE_INTERVAL_MS: a hot file costs one mincore() per interval, not one per
+    request. A larger body is probed two windows at a time and the reply remembers how far the
+    probe found it, so the writes that follow skip the probe while their window lies within that
+    and PROBE_INTERVAL_MS has not passed: one probe per window sent, not one per write. A file that
+    is not mapped costs an mmap() and a munmap() per probe, so it matters most there.
+*/
+bool http_conn::files_resident() {
+    uint64_t now = current_ms();
+    for ( int i = m_reply_index; i < m_reply_count; i++ ) {
+        reply& r = m_state->replies[ i ];
+        off_t offset = 0;
+        size_t len = 0;
+        const char* mapping = NULL;
+        if ( !unsent_body( r, offset, len, mapping ) || len == 0
+                || r.file_entry->resident_until.load( std::memory_order_relaxed ) > now ) {
+            continue;
+        }
+        size_t window = len < page_cache::WINDOW ? len : page_cache::WINDOW;
+        if ( offset + ( off_t )window <= r.resident_end && now < r.resident_at + PROBE_INTERVAL_MS ) {
+            continue;
+        }
+        size_t probe = len < page_cache::LOAD_WINDOW ? len : page_cache::LOAD_WINDOW;
+        bool resident = mapping ? page_cache::resident( mapping + offset, probe )
+                                : page_cache::resident( r.file_entry->fd, offset, probe );
+        if ( !resident ) {
+            return false;
+        }
+        r.resident_end = offset + probe;
+        r.resident_at = now;
+        if ( offset == 0 && probe == ( size_t )r.file_entry->st.st_size ) {
+            r.file_entry->resident_until.store( now + PROBE_INTERVAL_MS, std::memory_order_relaxed );
+        }
+    }
+    return true;
+}
+
+/*
+    From here on the connection belongs to the I/O pool: the reactor ignores its events and does
+    not close it (in ownership mode the socket stays registered), and it is not re-armed.
+*/
+bool http_conn::offload() {
+    m_io_job.started = current_ns();
+    m_io_pending.store( true, std::memory_order_release );
+    if ( !m_io_pool->append( &m_io_job ) ) {
+        // the I/O pool is full, the reactor sends the batch itself, as without one
+        m_io_pending.store( false, std::memory_order_release );
+        return false;
+    }
+    m_metrics.add( metrics::COLD_READS );
+    return true;
+}
+
+void http_conn::load_files() {
+    for ( int i = m_reply_index; i < m_reply_count; i++ ) {
+        const reply& r = m_state->replies[ i ];
+        off_t offset = 0;
+        size_t len = 0;
+        const char* mapping = NULL;
+        if ( unsent_body( r, offset, len, mapping ) && len > 0 ) {
+            page_cache::load( r.file_entry->fd, offset, len < page_cache::LOAD_WINDOW ? len : page_cache::LOAD_WINDOW );
+        }
+    }
+}
+
+/*
+    The reactor may close the connection as soon as m_io_pending is cleared, the descriptors are
+    read before. Re-arming for EPOLLOUT brings the connection back to write(); in ownership mode
+    registering it again reports its current edges to serve().
+*/
+void http_conn::resume() {
+    int epollfd = m_epollfd;
+    int sockfd = m_sockfd;
+    m_metrics.record( metrics::COLD_READ, current_ns() - m_io_job.started );
+    m_io_pending.store( false, std::memory_order_release );
+    if ( m_owned ) {
+        rearm_owned_fd( epollfd, sockfd );
+    } else {
+        modfd( epollfd, sockfd, EPOLLOUT );
+    }
+}
+
+// on a thread of the I/O pool
+void http_conn::io_job::process() {
+    conn->load_files();
+    conn->resume();
+}
+
+// the client hung up while the batch waited for the I/O pool: the reactor sees the socket shut down and closes it
+void http_conn::io_job::drop() {
+    m_metrics.add( metrics::REQUESTS_DROPPED );
+    shutdown( conn->m_sockfd, SHUT_RDWR );
+    conn->resume();
+}
+
+/*
+    Edge-triggered, so everything available is handled before returning: the socket is read until
+    EAGAIN, and every batch of replies written until the socket buffer is full. A read that stops on
+    a full read buffer leaves bytes in the socket no edge will announce again, so the loop reads once
+    more after the batch is out. Replies that did not fit wait for the EPOLLOUT edge.
+*/
+bool http_conn::serve() {
+    // the I/O pool has the batch, resume() reports the edges again once it is done
+    if ( m_io_pending.load( std::memory_order_acquire ) ) {
+        return true;
+    }
+    if ( m_reply_count > 0 ) {
+        if ( !write() ) {
+            return false;
+        }
+        if ( m_reply_count > 0 ) {
+            return true;
+        }
+    }
+    bool drained = false;   // the socket was read until EAGAIN
+    while ( true ) {
+        if ( !drained ) {
+            if ( !read() ) {
                 return false;
             }
-            break;
-        case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
-            add_headers(strlen( error_403_form));
-            if ( ! add_content( error_403_form ) ) {
-                return false;
+            drained = m_read_index < m_read_size;
+        }
+        if ( !process_requests() ) {
+            return false;
+        }
+        if ( m_reply_count == 0 ) {
+            if ( drained ) {
+                return true;
             }
-            break;
-        case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            // sets up two 'iovec' structure to send both the headers and the file content
-            m_iv[ 0 ].iov_base = m_write_buf;         // header
-            m_iv[ 0 ].iov_len = m_write_index;          // length of the header
-            m_iv[ 1 ].iov_base = m_file_address;      // file content
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;  // length of the file content
-            m_iv_count = 2;
-            return true;
-        default:
+            continue;
+        }
+        if ( !write() ) {
             return false;
+        }
+        if ( m_reply_count > 0 || ( drained && !m_more_requests ) ) {
+            return true;
+        }
     }
+}
 
-    // set up m_iv to contain only the header
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_index;
-    m_iv_count = 1;
+/*
+    Every reply of the batch is sent. Depending on the Connection header of the last request,
+    keep the connection open for further requests or close it (return false).
+*/
+bool http_conn::end_batch() {
+    bool linger = m_reply_count > 0 && m_state->replies[ m_reply_count - 1 ].linger;
+    unmap();
+    if ( !linger ) {
+        return false;
+    }
+    bool more = m_more_requests;
+    next_batch();
+    m_more_requests = more;
+    // nothing left to parse: the connection goes idle without holding any buffer
+    if ( !more && m_read_index == 0 ) {
+        detach_buffers();
+    }
     return true;
 }
 
-/*
-    The following functions are called by process_write() to generate HTTP response
-        void unmap();
-        bool add_response( const char* format, ... );
-        bool add_content( const char* content );
-        bool add_content_type();
-        bool add_status_line( int status, const char* title );
-        bool add_headers( int content_length );
-        bool add_content_length( int content_length );
-        bool add_linger();
-        bool add_blank_line();   
-*/ 
+// io_uring backend: the memory blocks of the batch not sent yet, there is no sendfile() body in this mode
+int http_conn::send_blocks( struct iovec** iov ) {
+    *iov = m_state->iv + m_iv_index;
+    return m_iv_count - m_iv_index;
+}
 
-bool http_conn::add_status_line( int status, const char* title ) {
-    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+// io_uring backend: 'bytes' of the blocks were sent, true once the whole batch is
+bool http_conn::sent( size_t bytes ) {
+    account_sent( bytes );
+    consume_iov( bytes );
+    advance_replies();
+    return m_reply_index == m_reply_count;
 }
 
-bool http_conn::add_headers(int content_len) {
-    // add_content_length(content_len);
-    // add_content_type();
-    // add_linger();
-    // add_blank_line();
-    return add_content_length(content_len) && add_content_type()
-            && add_linger() && add_blank_line();
+// drop the first 'len' bytes of m_state->iv after a partial write
+void http_conn::consume_iov( size_t len ) {
+    for ( ; m_iv_index < m_iv_count && len > 0; m_iv_index++ ) {
+        size_t n = len < m_state->iv[ m_iv_index ].iov_len ? len : m_state->iv[ m_iv_index ].iov_len;
+        m_state->iv[ m_iv_index ].iov_base = ( char* )m_state->iv[ m_iv_index ].iov_base + n;
+        m_state->iv[ m_iv_index ].iov_len -= n;
+        len -= n;
+        if ( m_state->iv[ m_iv_index ].iov_len > 0 ) {
+            break;
+        }
+    }
+    // empty blocks (e.g. the body of an empty file) count as sent
+    while ( m_iv_index < m_iv_count && m_state->iv[ m_iv_index ].iov_len == 0 ) {
+        m_iv_index++;
+    }
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
+// move past the replies sent completely, giving back what they hold
+void http_conn::advance_replies() {
+    while ( m_reply_index < m_reply_count ) {
+        reply& r = m_state->replies[ m_reply_index ];
+        if ( m_iv_index < r.iv_end || r.file_left > 0 ) {
+            break;
+        }
+        release_reply( r );
+        m_reply_index++;
+    }
 }
 
-bool http_conn::add_content_type() {
-    // FUTURE IMPROVEMENTS: extend the content type here
-    return add_response("Content-Type:%s\r\n", "text/html");
+// append a memory block to m_state->iv
+void http_conn::add_iov( const char* base, size_t len ) {
+    m_state->iv[ m_iv_count ].iov_base = ( char* )base;
+    m_state->iv[ m_iv_count ].iov_len = len;
+    m_iv_count++;
 }
 
-bool http_conn::add_linger() {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+/*
+    Write the tail of the response (Date, Connection) to the write buffer, after what the batch has
+    there so far; NULL if there is no room. It is a copy: the reply may wait in the batch or be
+    half-sent for longer than the second the Date is for.
+*/
+char* http_conn::add_tail( size_t& len ) {
+    char* tail = m_state->write_buf + m_write_index;
+    len = m_headers.build_tail( tail, WRITE_BUFFER_SIZE - m_write_index, m_linger );
+    if ( len == 0 ) {
+        return NULL;
+    }
+    m_write_index += len;
+    return tail;
 }
 
-bool http_conn::add_blank_line() {
-    return add_response( "%s", "\r\n" );
+// append an error response: its prebuilt head, the tail and its page; returns the length of the page, -1 if no room
+off_t http_conn::add_error( http_headers::error e ) {
+    size_t tail_len = 0;
+    const char* tail = add_tail( tail_len );
+    if ( !tail ) {
+        return -1;
+    }
+    size_t len = 0;
+    const char* head = m_headers.error_head( e, len );
+    add_iov( head, len );
+    add_iov( tail, tail_len );
+    const char* page = http_headers::error_page( e, len );
+    add_iov( page, len );
+    return len;
 }
 
-bool http_conn::add_content( const char* content ) {
-    return add_response( "%s", content );
+// give back what the replies not sent yet hold
+void http_conn::unmap() {
+    for ( int i = m_reply_index; i < m_reply_count; i++ ) {
+        release_reply( m_state->replies[ i ] );
+    }
 }
 
-// add a response to the server's write buffer
-bool http_conn::add_response( const char* format, ... ) {
-    // ensure the current position within the write buffer does not exceed the maximum write buffer size
-    if( m_write_index >= WRITE_BUFFER_SIZE ) {
-        return false;
+// give the target file back to the file cache, drop the pin on the cached response
+void http_conn::release_reply( reply& r ) {
+    // the mapping of a cache entry belongs to the cache, only unmap the ones made for this reply
+    if( r.file_address )
+    {
+        munmap( r.file_address, r.file_size );
     }
-    
-    /*
-        va_list: This is a data type that represents a list of variable arguments
+    if( r.file_entry )
+    {
+        m_file_cache.release( r.file_entry );
+    }
+    // the cached response may be freed as soon as we drop the pin
+    if( r.cache_pin != -1 )
+    {
+        m_response_cache.leave( r.cache_pin );
+    }
+    if( r.gzip_copy )
+    {
+        m_gzip_cache.release( r.gzip_copy );
+    }
+    free( r.generated );
+    r.clear();
+}
 
-        va_start(): initialize arg_list to point to the first optional argument ('format' in this case) 
-        after which additional arguments can be accessed.
+// Generate an HTTP response based on the given HTTP_CODE (the result of processing the request)
+// and queue it after the replies already in the batch
+bool http_conn::process_write(HTTP_CODE ret) {
+    reply& r = m_state->replies[ m_reply_count ];
+    r.iv_begin = m_iv_count;
+    r.linger = m_linger;
+    int status = 200;           // for the access log
+    off_t body_len = 0;
 
-        vsnprinf(): variable-argument 'snprintf'. It is used for formatting and writing data to a string buffer
-        while allowing for variable-length argument list.
-            - m_write_buf + m_write_index: destination buffer m_write_buf with starting position m_write_index
-            - WRITE_BUFFER_SIZE - 1 - m_write_index: the max number of characters that can be written to the buffer
-            - format: This is a format string that specifies how the data should be formatted. 
-            - arg_list: This is a 'va_list' object
+    switch (ret)
+    {
+        // the error responses are prebuilt, head and page, only the tail is written
+        case INTERNAL_ERROR:
+            body_len = add_error( http_headers::INTERNAL_ERROR );
+            status = 500;
+            m_metrics.add( metrics::STATUS_500 );
+            break;
+        case BAD_REQUEST:
+            body_len = add_error( http_headers::BAD_REQUEST );
+            status = 400;
+            m_metrics.add( metrics::STATUS_400 );
+            break;
+        case NO_RESOURCE:
+            body_len = add_error( http_headers::NOT_FOUND );
+            status = 404;
+            m_metrics.add( metrics::STATUS_404 );
+            break;
+        case FORBIDDEN_REQUEST:
+            body_len = add_error( http_headers::FORBIDDEN );
+            status = 403;
+            m_metrics.add( metrics::STATUS_403 );
+            break;
+        case SERVICE_UNAVAILABLE:
+            body_len = add_error( http_headers::SERVICE_UNAVAILABLE );
+            status = 503;
+            m_metrics.add( metrics::STATUS_503 );
+            break;
+        case FILE_REQUEST: {
+            /*
+                The head (status line, Content-Type, Content-Length) follows the heads of the previous
+                replies in the write buffer, it is the same for every request of this file. The tail
+                (Date, Connection) is written right after it, they go out as one block. A gzip sibling
+                is sent with the Content-Type of the file.
+            */
+            char* head = m_state->write_buf + m_write_index;
+            size_t head_len = http_headers::build_head( head, WRITE_BUFFER_SIZE - m_write_index, m_state->real_file,
+                                                        m_state->file_stat.st_size, r.gzip );
+            if ( head_len == 0 ) {
+                return false;
+            }
+            m_write_index += head_len;
+
+            // materialize the response of a small file, the next requests are served from memory.
+            // Not from the disk: a file that is not in the page cache is published by a later request.
+            // Not a sibling either: the response cache is keyed by path and holds the plain body
+            if ( !r.gzip && m_response_cache.cacheable( m_state->file_stat.st_size )
+                    && ( r.file_entry->address || m_state->file_stat.st_size == 0 )
+                    && ( !m_io_pool || page_cache::resident( r.file_entry->address, m_state->file_stat.st_size ) ) ) {
+                m_response_cache.publish( m_state->real_file, head, head_len, r.file_entry->fd,
+                                          m_state->file_stat.st_size, &r.file_entry->cached );
+            }
 
-    */
-    va_list arg_list;                 
-    va_start( arg_list, format );     
-    int len = vsnprintf( m_write_buf + m_write_index, WRITE_BUFFER_SIZE - 1 - m_write_index, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_index ) ) {
+            size_t tail_len = 0;
+            if ( !add_tail( tail_len ) ) {
+                return false;
+            }
+            add_iov( head, head_len + tail_len );
+            if ( r.file_fd != -1 ) {
+                // sendfile mode: only the header is in memory, the body is sent from r.file_fd
+                r.file_left = m_state->file_stat.st_size;
+            } else {
+                // the file content, from the mapping of the cache or our own
+                add_iov( r.file_address ? r.file_address : r.file_entry->address, m_state->file_stat.st_size );
+            }
+            body_len = m_state->file_stat.st_size;
+            if ( r.gzip ) {
+                m_metrics.add( metrics::GZIP_RESPONSES );
+            }
+            m_metrics.add( metrics::STATUS_200 );
+            break;
+        }
+        case GZIP_REQUEST: {
+            // a head of the gzip encoding and the tail, the copy borrowed from the gzip cache
+            char* head = m_state->write_buf + m_write_index;
+            size_t head_len = http_headers::build_head( head, WRITE_BUFFER_SIZE - m_write_index, m_state->real_file,
+                                                        r.gzip_copy->len, true );
+            if ( head_len == 0 ) {
+                return false;
+            }
+            m_write_index += head_len;
+            size_t tail_len = 0;
+            if ( !add_tail( tail_len ) ) {
+                return false;
+            }
+            add_iov( head, head_len + tail_len );
+            add_iov( r.gzip_copy->data, r.gzip_copy->len );
+            body_len = r.gzip_copy->len;
+            m_metrics.add( metrics::GZIP_RESPONSES );
+            m_metrics.add( metrics::STATUS_200 );
+            break;
+        }
+        case CACHED_REQUEST: {
+            // the cached head, the tail, the cached body
+            size_t tail_len = 0;
+            const char* tail = add_tail( tail_len );
+            if ( !tail ) {
+                return false;
+            }
+            add_iov( r.cached->buffer, r.cached->head_len );
+            add_iov( tail, tail_len );
+            add_iov( r.cached->buffer + r.cached->head_len, r.cached->body_len );
+            body_len = r.cached->body_len;
+            m_metrics.add( metrics::STATUS_200 );
+            break;
+        }
+        case STATS_REQUEST: {
+            // rendered for this request, the reply owns the body until it is sent
+            size_t stats_len = 0;
+            r.generated = render_stats( stats_len );
+            if ( !r.generated ) {
+                return false;
+            }
+            char* head = m_state->write_buf + m_write_index;
+            size_t head_len = http_headers::build_head_of_type( head, WRITE_BUFFER_SIZE - m_write_index,
+                                                                "text/plain; version=0.0.4", stats_len );
+            if ( head_len == 0 ) {
+                return false;
+            }
+            m_write_index += head_len;
+            size_t tail_len = 0;
+            if ( !add_tail( tail_len ) ) {
+                return false;
+            }
+            add_iov( head, head_len + tail_len );
+            add_iov( r.generated, stats_len );
+            body_len = stats_len;
+            m_metrics.add( metrics::STATUS_200 );
+            break;
+        }
+        default:
+            return false;
+    }
+    if ( body_len < 0 ) {
+        // no room for the tail of an error
         return false;
     }
-    m_write_index += len;
-    va_end( arg_list );   // clean up the 'arg_list"
+
+    r.iv_end = m_iv_count;
+    m_reply_count++;
+    m_metrics.add( metrics::REQUESTS );
+    if ( logger::get().access_log_enabled() ) {
+        // the request line is only known to be whole if it parsed
+        bool parsed = ret != BAD_REQUEST;
+        logger::get().access( m_address, parsed ? method_names[ m_method ] : NULL, parsed ? m_url : NULL,
+                              parsed ? m_version : NULL, status, body_len, m_referer, m_user_agent );
+    }
     return true;
 }
 
-
-
-
 // read in non-blocking mode, keep looping until there is no more data or the connection is closd
 bool http_conn::read() {
     // printf("read all data at once\n");
 
-    // the read buffer is full
-    if(m_read_index >= READ_BUFFER_SIZE) {
+    // an idle connection borrows its buffers now
+    if(!m_read_buf && !attach_buffers()) {
+        return false;
+    }
+
+    // the request being parsed fills the read buffer, it needs a larger one
+    if(m_read_index >= m_read_size && !grow_read_buffer()) {
         return false;
     }
 
     int bytes_read = 0;    // number of bytes that have been read
-    while(true) {
+    /*
+        Stop when the buffer is full: the pipelined requests in it are processed first and the buffer
+        compacted. Re-arming the connection with modfd() reports the bytes left in the socket again.
+    */
+    while(m_read_index < m_read_size) {
 
 
         /*
             read from socket 'm_sockfd' to buffer pointed to by 'm_read_buf + m_read_index'
-            READ_BUFFER_SIZE - m_read_index: the maximum number of bytes that can be received
+            m_read_size - m_read_index: the maximum number of bytes that can be received
         */
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_index, READ_BUFFER_SIZE - m_read_index, 0);
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_index, m_read_size - m_read_index, 0);
 
         // return -1 : an error occurs
         if (bytes_read == -1) {
@@ -355,12 +1018,36 @@ bool http_conn::read() {
         }
 
         m_read_index += bytes_read;  
+        m_metrics.add(metrics::BYTES_RECEIVED, bytes_read);
     }
 
     // printf("data retrived: %s\n", m_read_buf);
     return true;
 }
 
+/*
+    io_uring backend: append 'len' received bytes to the read buffer, growing it like read() does.
+    Returns how many bytes fit (the rest has to wait until the requests in the buffer are processed),
+    -1 if the buffers could not be borrowed.
+*/
+int http_conn::receive( const char* data, int len ) {
+    if ( !m_read_buf && !attach_buffers() ) {
+        return -1;
+    }
+    int taken = 0;
+    while ( taken < len ) {
+        if ( m_read_index >= m_read_size && !grow_read_buffer() ) {
+            break;
+        }
+        int n = len - taken < m_read_size - m_read_index ? len - taken : m_read_size - m_read_index;
+        memcpy( m_read_buf + m_read_index, data + taken, n );
+        m_read_index += n;
+        taken += n;
+    }
+    m_metrics.add( metrics::BYTES_RECEIVED, taken );
+    return taken;
+}
+
 
 // the main state machine
 http_conn::HTTP_CODE http_conn::process_read() {
@@ -371,30 +1058,32 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 || ((line_status = parse_line()) == LINE_OK)) {
         // 获取一行数据
         text = get_line();
+        // parse_line() replaced the "\r\n" ending the line with two '\0'
+        int len = m_checked_index - 2 - m_start_line;
         m_start_line = m_checked_index;
-        printf( "got 1 http line: %s\n", text );
+        DEBUG_LOG( "got 1 http line: %s", text );
 
         switch ( m_check_state ) {
             case CHECK_STATE_REQUESTLINE: {
-                ret = parse_request_line( text );
+                ret = parse_request_line( text, len );
                 if ( ret == BAD_REQUEST ) {
                     return BAD_REQUEST;
                 }
                 break;
             }
             case CHECK_STATE_HEADER: {
-                ret = parse_headers( text );
+                ret = parse_headers( text, len );
                 if ( ret == BAD_REQUEST ) {
                     return BAD_REQUEST;
                 } else if ( ret == GET_REQUEST ) {
-                    return do_request();
+                    return m_shedding ? SERVICE_UNAVAILABLE : do_request();
                 }
                 break;
             }
             case CHECK_STATE_CONTENT: {
                 ret = parse_content( text );
                 if ( ret == GET_REQUEST ) {
-                    return do_request();
+                    return m_shedding ? SERVICE_UNAVAILABLE : do_request();
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -409,8 +1098,8 @@ http_conn::HTTP_CODE http_conn::process_read() {
 
 /*
     The following function will be called by process_read() to parse HTTP request  
-    HTTP_CODE parse_request_line( char* text );
-    HTTP_CODE parse_headers( char* text );
+    HTTP_CODE parse_request_line( char* text, int len );
+    HTTP_CODE parse_headers( char* text, int len );
     HTTP_CODE parse_content( char* text );
     HTTP_CODE do_request();
     LINE_STATUS parse_line();
@@ -423,19 +1112,21 @@ http_conn::HTTP_CODE http_conn::process_read() {
         2. target URL
         3. HTTP version
 */
-HTTP_CODE http_conn::parse_request_line( char* text ) {
+HTTP_CODE http_conn::parse_request_line( char* text, int len ) {
     /*
         GET /index.html HTTP/1.1
         Find the first occurrence of either a space or a tab character in the string pointed by text, 
         which points to the start of the HTTP request line. The result is stored in the 
         'm_url' pointer, which points to the first character after the HTTP method, 
         in this case, is the space ' ' after 'GET'
+        The scanner finds what strpbrk( text, " \t" ) would, 16 or 32 bytes at a time.
     */ 
     
-    m_url = strpbrk(text, " \t"); 
-    if (! m_url) { 
+    int offset = scanner.token_end( text, len );
+    if ( offset == len ) { 
         return BAD_REQUEST;
     }
+    m_url = text + offset;
 
     /*
         GET\0/index.html HTTP/1.1
@@ -457,10 +1148,12 @@ HTTP_CODE http_conn::parse_request_line( char* text ) {
         Find the first occurrence of either a space of a tab in the string 
     */
 
-    m_version = strpbrk( m_url, " \t" );
-    if (!m_version) {
+    len -= m_url - text;
+    offset = scanner.token_end( m_url, len );
+    if ( offset == len ) {
         return BAD_REQUEST;
     }
+    m_version = m_url + offset;
     *m_version++ = '\0';
     if (strcasecmp( m_version, "HTTP/1.1") != 0 ) {
         return BAD_REQUEST;
@@ -479,8 +1172,39 @@ HTTP_CODE http_conn::parse_request_line( char* text ) {
     return NO_REQUEST;
 }
 
+/*
+    Whether an Accept-Encoding value allows gzip: "gzip" (or the old "x-gzip") or "*" is listed
+    without q=0. A gzip refused by name is refused whatever "*" says. The other codings are not
+    offered, so their weights do not matter.
+*/
+static bool accepts_gzip( const char* value ) {
+    int gzip = -1;      // -1 not listed, 0 refused, 1 accepted
+    int any = -1;
+    while ( *value ) {
+        value += strspn( value, " \t," );
+        const char* end = value + strcspn( value, "," );
+        size_t name_len = strcspn( value, " \t;," );
+        int accepted = 1;
+        const char* param = ( const char* )memchr( value, ';', end - value );
+        if ( param ) {
+            param += 1 + strspn( param + 1, " \t" );
+            if ( ( *param == 'q' || *param == 'Q' ) && param[ 1 ] == '=' && strtod( param + 2, NULL ) <= 0 ) {
+                accepted = 0;
+            }
+        }
+        if ( ( name_len == 4 && strncasecmp( value, "gzip", 4 ) == 0 )
+                || ( name_len == 6 && strncasecmp( value, "x-gzip", 6 ) == 0 ) ) {
+            gzip = accepted;
+        } else if ( name_len == 1 && *value == '*' ) {
+            any = accepted;
+        }
+        value = end;
+    }
+    return gzip == 1 || ( gzip == -1 && any == 1 );
+}
+
 // parse HTTP request header
-HTTP_CODE http_conn::parse_headers(char* text) {   
+HTTP_CODE http_conn::parse_headers(char* text, int len) {   
     // Encounter null character (a blank line), indicating the parsing of header is finished
     if( text[0] == '\0' ) {    
         // If there exists HTTP message body, then read the message of length 'm_content_length'
@@ -491,25 +1215,54 @@ HTTP_CODE http_conn::parse_headers(char* text) {
         }
         // else, all conponents of HTTP request have been parsed
         return GET_REQUEST;
-    } else if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {  // parsing HTTP header
+    }
+
+    /*
+        Find the colon ending the header name once, then compare the name only with the headers
+        of the same length instead of trying every header in turn.
+    */
+    int name_len = scanner.name_end( text, len );
+    if ( name_len == 10 && strncasecmp( text, "Connection", 10 ) == 0 ) {  // parsing HTTP header
         // handle connection, for example: 'Connection: keep-alive'
         text += 11;
         text += strspn( text, " \t" );
         if ( strcasecmp( text, "keep-alive" ) == 0 ) {
             m_linger = true;
         }
-    } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
+    } else if ( name_len == 14 && strncasecmp( text, "Content-Length", 14 ) == 0 ) {
         // handle Content-Length, for example: "Content-Length: 1000"
         text += 15;
         text += strspn( text, " \t" );
-        m_content_length = atol(text);
-    } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
+        // the body is skipped by moving the parse cursor past it, so the value must be a length that
+        // fits in the read buffer: anything else is answered 400, which ends the pipeline
+        char* end = NULL;
+        errno = 0;
+        long length = strtol( text, &end, 10 );
+        end += strspn( end, " \t" );
+        if ( end == text || *end != '\0' || errno == ERANGE || length < 0 || length > MAX_REQUEST_SIZE ) {
+            return BAD_REQUEST;
+        }
+        m_content_length = ( int )length;
+    } else if ( name_len == 4 && strncasecmp( text, "Host", 4 ) == 0 ) {
         // handle Host, for example: 'Host: 192.168.193.128:10000'
         text += 5;
         text += strspn( text, " \t" );
         m_host = text;
+    } else if ( name_len == 7 && strncasecmp( text, "Referer", 7 ) == 0 ) {
+        // kept for the access log
+        text += 8;
+        text += strspn( text, " \t" );
+        m_referer = text;
+    } else if ( name_len == 10 && strncasecmp( text, "User-Agent", 10 ) == 0 ) {
+        text += 11;
+        text += strspn( text, " \t" );
+        m_user_agent = text;
+    } else if ( name_len == 15 && strncasecmp( text, "Accept-Encoding", 15 ) == 0 ) {
+        // handle Accept-Encoding, for example: 'Accept-Encoding: gzip, deflate, br'
+        text += 16;
+        m_accept_gzip = accepts_gzip( text );
     } else {
-        printf( "Unknow Header %s\n", text );
+        DEBUG_LOG( "Unknow Header %s", text );
     }
     return NO_REQUEST;
 }
@@ -518,7 +1271,9 @@ HTTP_CODE http_conn::parse_headers(char* text) {
 HTTP_CODE http_conn::parse_content( char* text ) {
     if ( m_read_index >= ( m_content_length + m_checked_index ) )
     {
-        text[ m_content_length ] = '\0';
+        // the body is not used, skip it. It is not terminated in place: a pipelined request may follow
+        m_checked_index += m_content_length;
+        m_start_line = m_checked_index;     // the next request line starts after the body
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -527,80 +1282,276 @@ HTTP_CODE http_conn::parse_content( char* text ) {
 /*
     When receiving a complete and valid HTTP request, we will analyze the attributes of the target file.
     If the target file exists, and readable by all users, and is not a directory, we use mmap to map it to
-    the memory address at m_file_address, and inform the caller that the file retrieval was successful.
+    the memory address at r.file_address (unless the cache has it mapped already), and inform the caller
+    that the file retrieval was successful.
 */
 HTTP_CODE http_conn::do_request()
 {
+    // resolve "//", "." and ".." in the URL, so a file has a single cache key and no path escapes doc_root
+    normalize_path( m_url );
+
+    // the reserved path of the metrics, there is no such file
+    if ( strcmp( m_url, STATS_PATH ) == 0 ) {
+        return STATS_REQUEST;
+    }
+
     // "/home/nowcoder/webserver/resources"
-    strcpy( m_real_file, doc_root );  // copy the root directory path to the m_real_file buffer
+    strcpy( m_state->real_file, doc_root );  // copy the root directory path to the real_file buffer
     int len = strlen( doc_root );     // calculate the length of the root directory path
     // append the requested URL. It ensures that the resulting path does not exceed the buffer size.
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // fetch m_real_file related info，-1: failure，0: success
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
+    strncpy( m_state->real_file + len, m_url, FILENAME_LEN - len - 1 );
+    m_state->real_file[ FILENAME_LEN - 1 ] = '\0';     // strncpy does not terminate a truncated URL
+
+    // what the reply needs is kept in its slot of the batch
+    reply& r = m_state->replies[ m_reply_count ];
+
+    /*
+        A client accepting gzip gets a gzip body for a text file when the gzip cache has one: a copy
+        it made, sent from memory, or a precompressed sibling, sent like any file further down. It
+        is never compressed here: a file the gzip cache has not heard of is handed to it once found,
+        and goes out plain this time. So does one it is still working on.
+    */
+    bool gzip = m_accept_gzip && m_gzip_cache.enabled() && http_headers::compressible( m_state->real_file );
+    gzip_cache::state encoding = gzip_cache::MISSING;
+    if ( gzip ) {
+        encoding = m_gzip_cache.lookup( m_state->real_file, r.gzip_copy );
+        if ( encoding == gzip_cache::COMPRESSED ) {
+            r.gzip = true;
+            return GZIP_REQUEST;
+        }
+    }
+    // the response cache holds plain bodies, for the requests that get one anyway (a file the gzip
+    // cache does not know yet is to be handed to it further down)
+    bool plain = !gzip || encoding == gzip_cache::PENDING || encoding == gzip_cache::IDENTITY;
+
+    // a small hot file may have its whole response ready. The pin keeps it alive until write() is done
+    if ( m_response_cache.enabled() && plain ) {
+        r.cache_pin = m_response_cache.enter();
+        r.cached = m_response_cache.lookup( m_state->real_file );
+        if ( r.cached ) {
+            m_metrics.add( metrics::RESPONSE_CACHE_HITS );
+            return CACHED_REQUEST;
+        }
+        m_response_cache.leave( r.cache_pin );
+        r.cache_pin = -1;
+        m_metrics.add( metrics::RESPONSE_CACHE_MISSES );
+    }
+
+    // fetch real_file related info from the file cache, NULL: no such file
+    r.file_entry = m_file_cache.acquire( m_state->real_file );
+    if ( !r.file_entry ) {
         return NO_RESOURCE;
     }
+    m_state->file_stat = r.file_entry->st;
 
     // check access permissions
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
+    if ( ! ( m_state->file_stat.st_mode & S_IROTH ) ) {
         return FORBIDDEN_REQUEST;
     }
 
     // check if it is a directory
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
+    if ( S_ISDIR( m_state->file_stat.st_mode ) ) {
         return BAD_REQUEST;
     }
 
-    // open the file in read-only mode
-    int fd = open( m_real_file, O_RDONLY );
-    // establish memory mapping
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+    // the cache only opens regular files it can read
+    int fd = r.file_entry->fd;
+    if ( fd < 0 ) {
+        return FORBIDDEN_REQUEST;
+    }
+
+    // send the sibling instead, the file stays plain if the sibling went away meanwhile
+    if ( encoding == gzip_cache::SIBLING ) {
+        char sibling[ FILENAME_LEN + 3 ];
+        snprintf( sibling, sizeof( sibling ), "%s.gz", m_state->real_file );
+        file_cache::entry* e = m_file_cache.acquire( sibling );
+        if ( e && e->fd >= 0 && S_ISREG( e->st.st_mode ) ) {
+            m_file_cache.release( r.file_entry );
+            r.file_entry = e;
+            m_state->file_stat = e->st;
+            fd = e->fd;
+            r.gzip = true;
+        } else {
+            m_file_cache.release( e );
+        }
+    } else if ( gzip && encoding == gzip_cache::MISSING ) {
+        m_gzip_cache.request( m_state->real_file, m_state->file_stat );
+    }
+
+    // sendfile mode: write() sends the file straight from the page cache, using the cached descriptor
+    if ( m_use_sendfile ) {
+        r.file_fd = fd;
+        r.file_offset = 0;
+        return FILE_REQUEST;
+    }
+
+    // use the mapping shared through the cache
+    if ( r.file_entry->address || m_state->file_stat.st_size == 0 ) {
+        return FILE_REQUEST;
+    }
+
+    // too large to stay mapped in the cache, establish memory mapping for this request only
+    void* address = mmap( 0, m_state->file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( address == MAP_FAILED ) {
+        return INTERNAL_ERROR;
+    }
+    r.file_address = ( char* )address;
+    r.file_size = m_state->file_stat.st_size;
     return FILE_REQUEST;
 }
 
 // parse one line
 LINE_STATUS http_conn::parse_line() {
-    char temp;
-    for ( ; m_checked_index < m_read_index; ++m_checked_index ) {
-        temp = m_read_buf[ m_checked_index ];
-        if ( temp == '\r' ) {
-            if ( ( m_checked_index + 1 ) == m_read_index ) {
-                return LINE_OPEN;
-            } else if ( m_read_buf[ m_checked_index + 1 ] == '\n' ) {
-                m_read_buf[ m_checked_index++ ] = '\0';
-                m_read_buf[ m_checked_index++ ] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
-        } else if( temp == '\n' )  {
-            if( ( m_checked_index > 1) && ( m_read_buf[ m_checked_index - 1 ] == '\r' ) ) {
-                m_read_buf[ m_checked_index-1 ] = '\0';
-                m_read_buf[ m_checked_index++ ] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+    // jump to the next '\r' or '\n', the bytes in between are part of the line
+    m_checked_index += scanner.line_end( m_read_buf + m_checked_index, m_read_index - m_checked_index );
+    if ( m_checked_index == m_read_index ) {
+        return LINE_OPEN;
+    }
+
+    char temp = m_read_buf[ m_checked_index ];
+    if ( temp == '\r' ) {
+        if ( ( m_checked_index + 1 ) == m_read_index ) {
+            return LINE_OPEN;
+        } else if ( m_read_buf[ m_checked_index + 1 ] == '\n' ) {
+            m_read_buf[ m_checked_index++ ] = '\0';
+            m_read_buf[ m_checked_index++ ] = '\0';
+            return LINE_OK;
         }
+        return LINE_BAD;
     }
-    return LINE_OPEN;
+    // '\n'
+    if( ( m_checked_index > 1) && ( m_read_buf[ m_checked_index - 1 ] == '\r' ) ) {
+        m_read_buf[ m_checked_index-1 ] = '\0';
+        m_read_buf[ m_checked_index++ ] = '\0';
+        return LINE_OK;
+    }
+    return LINE_BAD;
 }
 
-// used by worker thread in the threadpool, to handle http request
+/*
+    used by worker thread in the threadpool, to handle http request
+    The replies queued by process_requests() are written by the reactor in as few writev calls as possible.
+*/
 void http_conn::process() {
-    // parse http request
-    // printf("parse request, create response\n");
+    m_metrics.record( metrics::QUEUE_WAIT, ( current_us() - m_enqueue_time ) * 1000 );
+    if ( !process_requests() ) {
+        shutdown_conn();
+        return;
+    }
+    // with no reply, the request is incomplete: wait for the rest
+    modfd( m_epollfd, m_sockfd, m_reply_count > 0 ? EPOLLOUT : EPOLLIN );
+}
 
-    // parse http request
-    HTTP_CODE read_ret = process_read();
-    if ( read_ret == NO_REQUEST ) {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+/*
+    Only the reactor closes connections, since it owns their idle timers.
+    Shutting the socket down makes epoll report EPOLLHUP, and the reactor closes it.
+*/
+void http_conn::shutdown_conn() {
+    shutdown( m_sockfd, SHUT_RDWR );
+    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+}
+
+// the client hung up while the request was queued
+void http_conn::drop() {
+    m_metrics.add( metrics::REQUESTS_DROPPED );
+    shutdown_conn();
+}
+
+/*
+    Asked while the request waited in the queue long enough for the client to give up: a peek
+    returning the end of the stream (or a reset) means nobody will read the response.
+    Bytes still unread mean the client is there, or at least that we cannot tell yet.
+    A half-close (shutdown(SHUT_WR) after the request) counts as a hang-up too, as it does for the
+    reactors, which close the connection on EPOLLRDHUP or a recv of 0 bytes: the server does not
+    serve half-closed connections.
+*/
+bool http_conn::hung_up() {
+    char c;
+    ssize_t ret = recv( m_sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+    return ret == 0 || ( ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR );
+}
+
+/*
+    The threadpool is overloaded: the requests in the read buffer are still parsed, which is cheap and
+    keeps the connection usable, but each one is answered 503 instead of being served.
+    Called by a worker, or by the reactor when the queue is full.
+*/
+void http_conn::shed() {
+    m_shedding = true;
+    bool ok = process_requests();
+    // cleared before the connection is re-armed, another thread may take it over from then on
+    m_shedding = false;
+    if ( !ok ) {
+        shutdown_conn();
         return;
     }
-    
-    // generate http response
-    bool write_ret = process_write( read_ret );
-    if ( !write_ret ) {
-        close_conn();
+    modfd( m_epollfd, m_sockfd, m_reply_count > 0 ? EPOLLOUT : EPOLLIN );
+}
+
+/*
+    The reactor has no slot for a new connection: tell the client the server is busy instead of
+    closing on it. The response fits in an empty socket buffer; if it does not go out at once it is
+    not worth waiting for.
+*/
+void http_conn::reject( int sockfd ) {
+    char response[ http_headers::MAX_RESPONSE_SIZE ];
+    size_t len = m_headers.build_error_response( response, sizeof( response ), http_headers::SERVICE_UNAVAILABLE, false );
+    send( sockfd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL );
+    close( sockfd );
+    m_metrics.add( metrics::CONNECTIONS_REJECTED );
+}
+
+/*
+    Every complete request in the read buffer is parsed and answered in order (pipelining), until the
+    batch is full, the write buffer is short of room for another header, or a reply closes the connection.
+    Returns false if a reply could not be generated, the connection has to be closed.
+*/
+bool http_conn::process_requests() {
+    if ( !m_read_buf ) {
+        // idle, nothing to parse
+        return true;
+    }
+
+    bool cut_short = true;      // whether the loop stopped on a limit of the batch
+    while ( m_reply_count < MAX_PIPELINE && WRITE_BUFFER_SIZE - m_write_index >= MAX_HEAD_SIZE ) {
+        // parse http request
+        uint64_t start = current_ns();
+        HTTP_CODE read_ret = process_read();
+        if ( read_ret == NO_REQUEST ) {
+            cut_short = false;
+            break;
+        }
+        m_metrics.record( metrics::PARSE, current_ns() - start );
+        if ( read_ret == BAD_REQUEST ) {
+            // there is no telling where the next request would start
+            m_linger = false;
+        }
+
+        // generate http response
+        if ( !process_write( read_ret ) ) {
+            release_reply( m_state->replies[ m_reply_count ] );
+            return false;
+        }
+        bool linger = m_linger;
+        next_request();
+        if ( !linger ) {
+            // the connection is closed after this reply, ignore what follows
+            cut_short = false;
+            break;
+        }
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT);
-}
\ No newline at end of file
+
+    if ( m_reply_count == 0 ) {
+        // the request is incomplete, keep what we have and wait for the rest
+        compact_read_buffer();
+        if ( m_read_index == 0 ) {
+            // woken up for nothing, stay idle without buffers
+            detach_buffers();
+        }
+        return true;
+    }
+    // the batch is full: the requests left in the read buffer are processed once it is sent
+    m_more_requests = cut_short && m_request_start < m_read_index;
+    compact_read_buffer();
+    return true;
+}
@@ -12,21 +12,69 @@
 //#include <sys/socket.h>
 //#include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "timer_wheel.h"
+#include "file_cache.h"
+#include "response_cache.h"
+#include "gzip_cache.h"
+#include "http_scanner.h"
+#include "buffer_pool.h"
+#include "ring_queue.h"
+#include "http_headers.h"
+#include "metrics.h"
+#include "log.h"
+#include "topology.h"
+#include "page_cache.h"
+#include "threadpool.h"
 #include <sys/uio.h>
+#include <atomic>
 
-class http_conn {
+class alignas( CACHE_LINE_SIZE ) http_conn {
 public:
-   
-    static int m_epollfd;      // all events on the sockets are registered under the same epoll object
-    static int m_user_count;   // number of users
+    /*
+        A batch held back while the I/O pool reads its files into the page cache (see write_replies()),
+        in the shape the threadpool expects of a request. Never shed: the batch is answered already,
+        it only waits for the disk. A client that hung up meanwhile has its connection shut down unread.
+    */
+    class io_job {
+    public:
+        http_conn* conn;
+        uint64_t enqueued;      // in current_us(), set by the threadpool
+        uint64_t started;       // in current_ns(), when the batch was handed over
+
+        void process();
+        void set_enqueue_time( uint64_t us ) { enqueued = us; }
+        uint64_t enqueue_time() const { return enqueued; }
+        bool hung_up() { return conn->hung_up(); }
+        void drop();
+        void shed() { process(); }
+    };
+
+    static bool m_use_sendfile;             // send files with sendfile() instead of mmap() + writev()
+    static bool m_owned;                    // every connection is served by its reactor alone, see serve()
+    static file_cache m_file_cache;         // open files, their state and their mappings, shared by all connections
+    static response_cache m_response_cache; // complete responses of small files, shared by all connections
+    static gzip_cache m_gzip_cache;         // gzip bodies of the text files, for the clients that accept them
+    static buffer_pool m_buffer_pools[ topology::MAX_NODES ];   // the buffers of the requests in flight, one pool per NUMA node
+    static http_headers m_headers;          // prebuilt response headers, shared by all connections
+    static metrics m_metrics;               // counters and latency histograms, served at STATS_PATH
+    static threadpool< io_job >* m_io_pool; // reads the files that are not in the page cache (-d), NULL if none
+    static constexpr const char* STATS_PATH = "/__stats";   // reserved URL of the metrics, Prometheus text format
     static const int FILENAME_LEN = 200;         // the maximum length of filename
-    static const int READ_BUFFER_SIZE = 2048;    // read buffer size
-    static const int WRITE_BUFFER_SIZE = 1024;   // write buffer size
+    static const int READ_BUFFER_SIZE = 2048;    // initial read buffer size, it grows for larger requests
+    static const int MAX_REQUEST_SIZE = buffer_pool::MAX_SIZE;  // the largest request the read buffer grows to
+    static const int WRITE_BUFFER_SIZE = 2048;   // write buffer size, the heads and tails of a batch
+    static const int IDLE_TIMEOUT = 15000;       // connections idle for that long (ms) are closed
+    static const int MAX_PIPELINE = 16;          // the maximum number of pipelined responses written in one batch
+    // room kept in the write buffer for the head and the tail of the next response
+    static const int MAX_HEAD_SIZE = http_headers::MAX_HEAD_SIZE + http_headers::MAX_TAIL_SIZE;
+    static const int PROBE_INTERVAL_MS = 100;    // a file found in the page cache is not probed again for that long
 
     // HTTP Request Method
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
@@ -43,11 +91,15 @@ public:
         NO_RESOURCE         :   Indicates the server has no resources.
         FORBIDDEN_REQUEST   :   Indicates the client does not have sufficient access rights to the resource.
         FILE_REQUEST        :   File request; file retrieval successful.
+        CACHED_REQUEST      :   File request; the whole response is in the response cache.
+        GZIP_REQUEST        :   File request; the body is a gzip copy of the file from the gzip cache.
         INTERNAL_ERROR      :   Indicates an internal server error.
         CLOSED_CONNECTION   :   Indicates the client has already closed the connection.
+        SERVICE_UNAVAILABLE :   The server is overloaded, the request is parsed but not served.
+        STATS_REQUEST       :   The request is for the metrics of the server (STATS_PATH).
     */
 
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, CACHED_REQUEST, GZIP_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, SERVICE_UNAVAILABLE, STATS_REQUEST };
     
     // the state of the side state machine (the state when parsing each line)
     // 1.get a complete line 2.error 3.the line data is incomplete
@@ -57,58 +109,182 @@ public:
     http_conn() {};
     ~http_conn() {};
 
-    void init(int sockfd, const sockaddr_in& addr);  // initialize new connection
-    void close_conn();   // close connection
+    void init(int sockfd, const sockaddr_in& addr, int epollfd, timer_wheel* wheel);  // initialize new connection
+    void close_conn();   // close connection, only called by the reactor owning the connection
+    void refresh_timer();   // push back the idle timeout, called by the reactor on socket activity
     bool read();   // read in non-blocking mode
     bool write();  // write in non-blocking mode
     void process();  // process request from client end
+    void expire();   // the idle timeout expired
+
+    /*
+        Ownership mode (-o): the reactor that accepted the connection reads, parses and writes it
+        itself, for its whole lifetime. The socket is registered once, edge-triggered for both
+        EPOLLIN and EPOLLOUT, and never re-armed: every event just calls serve(), which goes on until
+        the socket would block. False if the connection must be closed.
+    */
+    bool serve();
+
+    // admission control, used by the threadpool (see codel.h) and by the reactors when it is full
+    void set_enqueue_time( uint64_t us ) { m_enqueue_time = us; }
+    uint64_t enqueue_time() const { return m_enqueue_time; }
+    bool hung_up();  // the client closed its end (or half of it), nothing is left to read
+    void drop();     // close the connection without answering
+    void shed();     // answer the requests received so far with 503
+    static void reject( int sockfd );   // answer 503 on a connection there is no room for, and close it
+
+    // the body of a STATS_REQUEST, also dumped on SIGUSR1: a buffer from malloc() holding 'len' bytes, NULL if memory is short
+    static char* render_stats( size_t& len );
+
+    /*
+        Used by the io_uring backend (uring_reactor.h) instead of read(), process() and write(): the
+        reactor hands over the bytes its recv received, processes the requests itself and sends the
+        replies with its own submissions. Parsing and replies are the same as with epoll.
+    */
+    int receive( const char* data, int len );   // append received bytes to the read buffer, returns how many fit
+    bool process_requests();                    // parse and queue replies, false if the connection must be closed
+    bool has_replies() const { return m_reply_count > 0; }
+    int send_blocks( struct iovec** iov );      // the memory blocks to send next
+    bool sent( size_t bytes );                  // account for sent bytes, true once the whole batch is sent
+    bool end_batch();                           // the batch is sent, false if the connection must be closed
+
+    // after write(): the batch is sent but was cut short, complete requests may still wait in the read buffer
+    bool more_requests() const { return m_more_requests && m_reply_count == 0; }
+
+    // the worker that processed the last request of this connection, used by stealing_queue
+    int last_worker() const { return m_last_worker; }
+    void set_last_worker(int worker) { m_last_worker = worker; }
 
 private:
-    int m_sockfd;            // the socket connected with this HTTP
-    sockaddr_in m_address;   // the address of the socket
-    CHECK_STATE m_check_state;  // the current state of the main state machine
+    /*
+        A response queued for sending. Pipelined requests are answered in batches: the headers of
+        the responses go one after the other into m_write_buf, their memory blocks into m_iv, and
+        write() sends as many of them as it can with a single writev.
+    */
+    struct reply {
+        int iv_begin;                   // its memory blocks are m_iv[iv_begin, iv_end)
+        int iv_end;
+        bool linger;                    // keep the connection open after this reply
+        file_cache::entry* file_entry;  // the target file borrowed from m_file_cache, NULL if none
+        char* file_address;             // a mapping of the target file made for this reply only, NULL if none
+        off_t file_size;                // the length of that mapping
+        int file_fd;                    // sendfile mode: the body is sent from this file after the blocks, -1 if none
+        off_t file_offset;              // sendfile mode: the next byte of the file to send
+        off_t file_left;                // sendfile mode: the bytes of the body still to send
+        const response_cache::response* cached;  // the response, if it came from m_response_cache
+        int cache_pin;                  // our pin in m_response_cache while 'cached' is in use, -1 if none
+        char* generated;                // a body rendered for this reply (the metrics), freed with it
+        const gzip_cache::entry* gzip_copy;     // the body, if it is a copy borrowed from m_gzip_cache
+        bool gzip;                      // the body is gzip-encoded: that copy, or the sibling in file_entry
+        off_t resident_end;             // the body was found in the page cache up to there (see files_resident())
+        uint64_t resident_at;           // by the probe at that time, in current_ms()
 
-    // ---------------------------- read related variables ------------------------------
-    char m_read_buf[READ_BUFFER_SIZE];   // read buffer
-    int m_read_index;      // the position right AFTER the last byte of the content in read buffer
+        // holds nothing
+        void clear() {
+            file_entry = NULL;
+            file_address = NULL;
+            file_size = 0;
+            file_fd = -1;
+            file_offset = 0;
+            file_left = 0;
+            cached = NULL;
+            cache_pin = -1;
+            generated = NULL;
+            gzip_copy = NULL;
+            gzip = false;
+            resident_end = 0;
+            resident_at = 0;
+        }
+    };
 
-    int m_checked_index;   // the position of the byte being parsed currently
-    int m_start_line;      // the starting position of the line being parsed currently
-    
-    // HTTP status line
-    char* m_url;            // requested resource path
-    char* m_version;        // HTTP version
-    METHOD m_method;        // HTTP method
-    char* m_host;           // the target host and the port where the request is being sent
-    bool m_linger;          // it suggests whether the client would like to keep the connection open for potential further request
-
-    // HTTP header
-    int m_content_length;   // the length of HTTP request content
-    
-    // do_request
-    char m_real_file[FILENAME_LEN];     // the complete path of the file requested by the client
+    /*
+        What a connection needs only while requests are in flight. Borrowed from m_buffer_pools together
+        with the read buffer when data arrives, given back once every response is sent and nothing is
+        left to parse, so an idle keep-alive connection holds no buffer at all.
+    */
+    struct request_state {
+        char write_buf[ WRITE_BUFFER_SIZE ];    // write buffer
+        char real_file[ FILENAME_LEN ];         // the complete path of the file requested by the client
+        /*
+            the state of the target file. we can determine:
+                - the existance of teh file
+                - whether it is a directory or not
+                - whether it is readable or not
+                - the size of the file
+        */ 
+        struct stat file_stat;
+        reply replies[ MAX_PIPELINE ];          // the responses of the current batch, in the order of the requests
+        struct iovec iv[ 3 * MAX_PIPELINE ];    // up to 3 memory blocks per response
+    };
 
-    // ---------------------------- write related variables ------------------------------
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // write buffer
-    int m_write_index;                        // the number of bytes need to write in the buffer
-    char* m_file_address;                   // the starting point for the target file requested by the client 'mmapped' in memory
     /*
-        the state of the target file. we can determine:
-            - the existance of teh file
-            - whether it is a directory or not
-            - whether it is readable or not
-            - the size of the file
-    */ 
-    struct stat m_file_stat;                
-    struct iovec m_iv[2];                   
-    int m_iv_count;                        // the number of memory block being written
+        The layout follows who touches what (the table of connections is indexed by file descriptor,
+        so a reactor walks all over it). The class is aligned on a cache line, a connection never
+        shares one with its neighbours in the table, and its members come in three groups:
+            - the first line holds what the reactor reads or writes on every event: the socket, the
+              buffers, the progress of the batch, the idle deadline, the admission timestamp
+            - the second line the parser and the write side, used by whoever processes the request
+            - the rest what is set up once per connection or only read for the access log
+        The buffers themselves are out of line, borrowed from m_pool while a request is in flight.
+    */
+
+    // ---------------------------- hot: every event ------------------------------
+    int m_sockfd;            // the socket connected with this HTTP
+    int m_epollfd;           // the epoll object of the reactor owning this connection
+    char* m_read_buf;        // read buffer, borrowed from m_pool, NULL while idle
+    request_state* m_state;  // borrowed from m_pool together with m_read_buf, NULL while idle
+    int m_read_index;        // the position right AFTER the last byte of the content in read buffer
+    int m_read_size;         // the size of the read buffer
+    int m_reply_count;       // the number of responses in the batch
+    int m_reply_index;       // the first response not completely sent
+    uint64_t m_idle_deadline;    // when the connection is idle for too long, in current_ms(); see refresh_timer()
+    uint64_t m_enqueue_time; // when the connection was last queued in the threadpool, in current_us()
+    int m_last_worker;       // the threadpool worker that served this connection last, -1 if none
+    bool m_more_requests;    // the batch was cut short while requests were left in the read buffer
+    bool m_shedding;         // answer the requests being parsed with 503 instead of serving them
+    std::atomic<bool> m_io_pending;  // the I/O pool has the batch, the reactor leaves the connection alone
+
+    // ---------------------------- parser and write side ------------------------------
+    alignas( CACHE_LINE_SIZE )
+    CHECK_STATE m_check_state;  // the current state of the main state machine
+    int m_checked_index;     // the position of the byte being parsed currently
+    int m_start_line;        // the starting position of the line being parsed currently
+    int m_request_start;     // the starting position of the request being parsed currently
+    char* m_url;             // requested resource path
+    char* m_version;         // HTTP version
+    char* m_host;            // the target host and the port where the request is being sent
+    METHOD m_method;         // HTTP method
+    int m_content_length;    // the length of HTTP request content, validated: 0 to MAX_REQUEST_SIZE
+    int m_write_index;       // the number of bytes need to write in the buffer
+    int m_iv_count;          // the number of memory block being written
+    int m_iv_index;          // the first memory block not completely sent
+    bool m_linger;           // it suggests whether the client would like to keep the connection open for potential further request
+    bool m_accept_gzip;      // the client accepts gzip-encoded bodies (Accept-Encoding)
+
+    // ---------------------------- cold: once per connection ------------------------------
+    alignas( CACHE_LINE_SIZE )
+    timer_wheel* m_timer_wheel;  // the timer wheel of the reactor owning this connection
+    wheel_timer m_timer;         // idle timer, fires at m_idle_deadline or earlier
+    buffer_pool* m_pool;     // the pool of the node of the thread that read the request, the buffers go back there
+    sockaddr_in m_address;   // the address of the socket
+    uint64_t m_accept_time;  // when the connection was accepted, in current_ns(); 0 once a response byte was sent
+    char* m_referer;         // the Referer and User-Agent headers, for the access log
+    char* m_user_agent;
+    io_job m_io_job;         // what the connection hands to m_io_pool
 
     void init();      // 初始化连接
+    void next_request();    // reset the parser for the next pipelined request
+    void next_batch();      // reset the write side once a batch is sent
+    void compact_read_buffer();   // move the request being parsed to the start of the read buffer
+    bool attach_buffers();  // borrow the read buffer and the request state, false if memory is short
+    void detach_buffers();  // give them back
+    bool grow_read_buffer();    // move to a read buffer twice as large, false if at MAX_REQUEST_SIZE
+    void rebase( char* from, char* to );   // move the pointers into the read buffer after it moved
     
     HTTP_CODE process_read();    // parse http request - the main state machine
     // The following functions are called by process_read() to parse HTTP request      
-    HTTP_CODE parse_request_line( char* text );
-    HTTP_CODE parse_headers( char* text );
+    HTTP_CODE parse_request_line( char* text, int len );
+    HTTP_CODE parse_headers( char* text, int len );
     HTTP_CODE parse_content( char* text );
     HTTP_CODE do_request();
     LINE_STATUS parse_line();
@@ -116,18 +292,21 @@ private:
 
     bool process_write( HTTP_CODE ret );    // generate http response 
     void unmap();
-    // The following functions are called by process_write() to generate HTTP response
-    
-    bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-        // add_content_length, add_content_type, add_linger, add_blank_line are called by add_header
-    bool add_content_length( int content_length );
-    bool add_content_type();
-    bool add_linger();
-    bool add_blank_line();   
-    bool add_content( const char* content );
-    bool add_response( const char* format, ... );
-    
+    void release_reply( reply& r );
+    void add_iov( const char* base, size_t len );
+    char* add_tail( size_t& len );
+    off_t add_error( http_headers::error e );
+    void consume_iov( size_t len );
+    bool write_replies( size_t& bytes );
+    void account_sent( size_t bytes );
+    void shutdown_conn();
+    void rearm( int ev );   // re-arm the one-shot registration, nothing to do in ownership mode
+    void advance_replies();
+    bool unsent_body( const reply& r, off_t& offset, size_t& len, const char*& mapping );
+    bool files_resident();  // whether the next window of every body left in the batch is in the page cache
+    bool offload();         // hand the batch to m_io_pool, false if it is full
+    void load_files();      // on the I/O pool: read the next window of every body left in the batch
+    void resume();          // on the I/O pool: hand the connection back to its reactor
 };
 
 
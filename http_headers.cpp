@@ -0,0 +1,206 @@
+#include "http_headers.h"
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <charconv>
+
+/*
+    The Content-Type of each extension and the head of the 200 responses with it, both built by the
+    compiler: the head is one literal made of the status line, the Content-Type header and the name
+    of the Content-Length header, its digits follow.
+
+    The text types (ZMIME) may be sent gzip-encoded (see gzip_cache.h), so both of their heads say
+    Vary: Accept-Encoding, the plain one too: a cache in between must not hand the plain body
+    to a client that asked for gzip, or the gzip body to one that did not.
+*/
+struct mime_entry {
+    const char* extension;
+    size_t extension_len;
+    const char* type;
+    const char* head;
+    size_t head_len;
+    const char* gzip_head;      // the head of a gzip-encoded body, NULL if the type is not compressible
+    size_t gzip_head_len;
+};
+
+#define OK_200_HEAD(type) "HTTP/1.1 200 OK\r\nContent-Type: " type "\r\nContent-Length: "
+#define VARY_200_HEAD(type) "HTTP/1.1 200 OK\r\nContent-Type: " type "\r\nVary: Accept-Encoding\r\nContent-Length: "
+#define GZIP_200_HEAD(type) "HTTP/1.1 200 OK\r\nContent-Type: " type "\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding\r\nContent-Length: "
+#define MIME(extension, type) { extension, sizeof(extension) - 1, type, OK_200_HEAD(type), sizeof(OK_200_HEAD(type)) - 1, NULL, 0 }
+#define ZMIME(extension, type) { extension, sizeof(extension) - 1, type, VARY_200_HEAD(type), sizeof(VARY_200_HEAD(type)) - 1, \
+                                 GZIP_200_HEAD(type), sizeof(GZIP_200_HEAD(type)) - 1 }
+
+static constexpr mime_entry mime_types[] = {
+    ZMIME("html", "text/html"),
+    ZMIME("htm", "text/html"),
+    ZMIME("css", "text/css"),
+    ZMIME("js", "text/javascript"),
+    ZMIME("json", "application/json"),
+    ZMIME("txt", "text/plain"),
+    ZMIME("xml", "application/xml"),
+    MIME("png", "image/png"),
+    MIME("jpg", "image/jpeg"),
+    MIME("jpeg", "image/jpeg"),
+    MIME("gif", "image/gif"),
+    ZMIME("svg", "image/svg+xml"),
+    MIME("ico", "image/x-icon"),
+    MIME("webp", "image/webp"),
+    MIME("pdf", "application/pdf"),
+    MIME("woff", "font/woff"),
+    MIME("woff2", "font/woff2"),
+    MIME("mp4", "video/mp4"),
+    ZMIME("wasm", "application/wasm"),
+    // files with any other or no extension
+    MIME("", "application/octet-stream")
+};
+static const int MIME_TYPES = sizeof(mime_types) / sizeof(mime_types[0]);
+
+// the longest head build_head() writes must fit in MAX_HEAD_SIZE: the literal, 20 digits, "\r\n"
+static constexpr size_t longest_head() {
+    size_t longest = 0;
+    for(const mime_entry& m : mime_types) {
+        longest = m.head_len > longest ? m.head_len : longest;
+        longest = m.gzip_head_len > longest ? m.gzip_head_len : longest;
+    }
+    return longest + 20 + 2;
+}
+static_assert(longest_head() <= http_headers::MAX_HEAD_SIZE, "a 200 head does not fit in MAX_HEAD_SIZE");
+
+// the entry of the extension of 'path', the last one if it has none or it is not in the table
+static const mime_entry& find_mime(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if(dot && !strchr(dot, '/')) {
+        size_t len = strlen(dot + 1);
+        // most entries are skipped on the length alone
+        for(int i = 0; i < MIME_TYPES - 1; i++) {
+            if(len == mime_types[i].extension_len && strcasecmp(dot + 1, mime_types[i].extension) == 0) {
+                return mime_types[i];
+            }
+        }
+    }
+    return mime_types[MIME_TYPES - 1];
+}
+
+// the error pages, sent as text/html like before, and the headers only some of them have:
+// a shed client may retry after a second, by then the queue has either drained or the load is shed again
+static const struct {
+    const char* status_line;
+    const char* extra_headers;
+    const char* page;
+} error_pages[http_headers::ERRORS] = {
+    { "HTTP/1.1 400 Bad Request\r\n", "", "Your request has bad syntax or is inherently impossible to satisfy.\n" },
+    { "HTTP/1.1 403 Forbidden\r\n", "", "You do not have permission to get file from this server.\n" },
+    { "HTTP/1.1 404 Not Found\r\n", "", "The requested file was not found on this server.\n" },
+    { "HTTP/1.1 500 Internal Error\r\n", "", "There was an unusual problem serving the requested file.\n" },
+    { "HTTP/1.1 503 Service Unavailable\r\n", "Retry-After: 1\r\n",
+      "The server is too busy to serve your request, please try again later.\n" }
+};
+
+#define CLOSE_HEADER "Connection: close\r\n\r\n"
+#define KEEP_ALIVE_HEADER "Connection: keep-alive\r\n\r\n"
+static const char* const connection_headers[2] = { CLOSE_HEADER, KEEP_ALIVE_HEADER };
+static const size_t connection_header_len[2] = { sizeof(CLOSE_HEADER) - 1, sizeof(KEEP_ALIVE_HEADER) - 1 };
+
+http_headers::http_headers() : m_second(time(NULL)) {
+    for(int e = 0; e < ERRORS; e++) {
+        int len = snprintf(m_error_heads[e], MAX_ERROR_HEAD_SIZE, "%sContent-Type: text/html\r\nContent-Length: %zu\r\n%s",
+                           error_pages[e].status_line, strlen(error_pages[e].page), error_pages[e].extra_headers);
+        m_error_head_len[e] = len > 0 && (size_t)len < MAX_ERROR_HEAD_SIZE ? len : 0;
+    }
+}
+
+void http_headers::refresh(time_t now) {
+    m_second.store(now, std::memory_order_relaxed);
+}
+
+// the Date of 'now', DATE_LEN characters
+static void render_date(char* date, time_t now) {
+    char text[64];
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    // the C locale names of days and months, as HTTP wants them, whatever the locale of the process
+    static const char* const days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char* const months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    snprintf(text, sizeof(text), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon],
+             tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    memcpy(date, text, http_headers::DATE_LEN);
+}
+
+// the longest tail fits in MAX_TAIL_SIZE: "Date: ", the date, "\r\n", the longest Connection header
+static_assert(6 + http_headers::DATE_LEN + 2 + sizeof(KEEP_ALIVE_HEADER) - 1 <= http_headers::MAX_TAIL_SIZE,
+              "a tail does not fit in MAX_TAIL_SIZE");
+
+size_t http_headers::build_tail(char* buf, size_t size, bool linger) const {
+    // rendered by each thread for itself, nobody else reads or writes it
+    static thread_local time_t t_second = -1;
+    static thread_local char t_date[DATE_LEN];
+    time_t second = m_second.load(std::memory_order_relaxed);
+    if(second != t_second) {
+        render_date(t_date, second);
+        t_second = second;
+    }
+
+    size_t connection_len = connection_header_len[linger];
+    size_t len = 6 + DATE_LEN + 2 + connection_len;
+    if(size < len) {
+        return 0;
+    }
+    memcpy(buf, "Date: ", 6);
+    memcpy(buf + 6, t_date, DATE_LEN);
+    memcpy(buf + 6 + DATE_LEN, "\r\n", 2);
+    memcpy(buf + 6 + DATE_LEN + 2, connection_headers[linger], connection_len);
+    return len;
+}
+
+const char* http_headers::mime_type(const char* path) {
+    return find_mime(path).type;
+}
+
+bool http_headers::compressible(const char* path) {
+    return find_mime(path).gzip_head != NULL;
+}
+
+size_t http_headers::build_head(char* buf, size_t size, const char* path, off_t length, bool gzip) {
+    if(size < MAX_HEAD_SIZE) {
+        return 0;
+    }
+    const mime_entry& m = find_mime(path);
+    const char* head = gzip && m.gzip_head ? m.gzip_head : m.head;
+    size_t head_len = gzip && m.gzip_head ? m.gzip_head_len : m.head_len;
+    memcpy(buf, head, head_len);
+    char* p = std::to_chars(buf + head_len, buf + size, (long long)length).ptr;
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - buf;
+}
+
+// formatted: only for the rare responses that are not files
+size_t http_headers::build_head_of_type(char* buf, size_t size, const char* type, off_t length) {
+    int len = snprintf(buf, size, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\n", type, (long long)length);
+    return len > 0 && (size_t)len < size ? len : 0;
+}
+
+const char* http_headers::error_page(error e, size_t& len) {
+    len = strlen(error_pages[e].page);
+    return error_pages[e].page;
+}
+
+size_t http_headers::page_length(error e) {
+    return strlen(error_pages[e].page);
+}
+
+size_t http_headers::build_error_response(char* buf, size_t size, error e, bool linger) const {
+    size_t head_len = 0, page_len = 0;
+    const char* head = error_head(e, head_len);
+    const char* page = error_page(e, page_len);
+    if(size < head_len + page_len) {
+        return 0;
+    }
+    memcpy(buf, head, head_len);
+    size_t tail_len = build_tail(buf + head_len, size - head_len - page_len, linger);
+    if(tail_len == 0) {
+        return 0;
+    }
+    memcpy(buf + head_len + tail_len, page, page_len);
+    return head_len + tail_len + page_len;
+}
@@ -0,0 +1,72 @@
+#ifndef HTTP_HEADERS_H
+#define HTTP_HEADERS_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+
+/*
+    Response headers assembled from prebuilt pieces instead of being formatted per request.
+
+    A 200 response is
+        head:   status line, Content-Type (Content-Encoding, Vary) and Content-Length, the same for
+                every request of a file
+        tail:   Date and Connection headers and the blank line, the same for every response of a second
+    The head starts with a string literal chosen by the extension of the file (see mime_type()), only
+    the Content-Length digits are written per request. An error response (400/403/404/500/503) is
+    a head rendered once at construction, never written again, the tail, and its page, a literal.
+
+    The tail is copied into the buffer of the reply (build_tail(), about 60 bytes), never shared:
+    a reply may stay queued in a pipelined batch or half-written for longer than a second, and
+    bytes shared with it could not be rendered again under it. The Date itself is rendered once
+    per second and thread, into a thread-local copy, when refresh() has moved to a new second.
+*/
+class http_headers {
+public:
+    static const size_t DATE_LEN = 29;      // "Sun, 06 Nov 1994 08:49:37 GMT"
+    static const size_t MAX_HEAD_SIZE = 160;  // the longest head build_head() writes
+    static const size_t MAX_TAIL_SIZE = 64;   // the longest tail build_tail() writes
+    static const size_t MAX_ERROR_HEAD_SIZE = 128;
+    static const size_t MAX_RESPONSE_SIZE = 512;
+
+    enum error { BAD_REQUEST = 0, FORBIDDEN, NOT_FOUND, INTERNAL_ERROR, SERVICE_UNAVAILABLE, ERRORS };
+
+    http_headers();
+
+    // move the Date of the tails to 'now', any thread may call it
+    void refresh(time_t now);
+
+    // the Content-Type of a file, from the extension of its path
+    static const char* mime_type(const char* path);
+
+    // whether the Content-Type of 'path' is worth sending gzip-encoded
+    static bool compressible(const char* path);
+
+    // write the head of a 200 response for the file 'path' of 'length' bytes, with Content-Encoding:
+    // gzip if 'gzip' (and the type is compressible), returns its length, 0 if it does not fit in 'size'
+    static size_t build_head(char* buf, size_t size, const char* path, off_t length, bool gzip = false);
+    // the same for a body that is not a file, of Content-Type 'type'
+    static size_t build_head_of_type(char* buf, size_t size, const char* type, off_t length);
+
+    // write the end of the header of every response (Date, Connection, blank line) to 'buf',
+    // returns its length, 0 if it does not fit in 'size'
+    size_t build_tail(char* buf, size_t size, bool linger) const;
+
+    // the head of an error response: status line, Content-Type, Content-Length and the headers only
+    // some errors have; it never changes, a reply may point to it for as long as it likes
+    const char* error_head(error e, size_t& len) const { len = m_error_head_len[e]; return m_error_heads[e]; }
+    // the page of an error response, its body, a literal
+    static const char* error_page(error e, size_t& len);
+    // the length of the page of an error response
+    static size_t page_length(error e);
+    // a complete error response, head, tail and page, written to 'buf'; 0 if it does not fit in 'size'
+    size_t build_error_response(char* buf, size_t size, error e, bool linger) const;
+
+private:
+    char m_error_heads[ERRORS][MAX_ERROR_HEAD_SIZE];
+    size_t m_error_head_len[ERRORS];
+    std::atomic<time_t> m_second;       // the second of the Date of the tails
+};
+
+#endif
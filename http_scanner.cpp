@@ -0,0 +1,134 @@
+#include "http_scanner.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+static size_t find_scalar(const char* buf, size_t len, char a, char b, char c) {
+    for(size_t i = 0; i < len; i++) {
+        char ch = buf[i];
+        if(ch == a || ch == b || ch == c) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+    PCMPESTRI compares 16 bytes against a set of up to 16 bytes in one instruction and returns the
+    index of the first match (16 if none). The set has an explicit length, so '\0' can be in it.
+*/
+__attribute__((target("sse4.2")))
+static inline int match_sse42(__m128i set, const char* p) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    return _mm_cmpestri(set, 3, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+}
+
+__attribute__((target("sse4.2")))
+static size_t find_sse42(const char* buf, size_t len, char a, char b, char c) {
+    if(len < 16) {
+        return find_scalar(buf, len, a, b, c);
+    }
+    const __m128i set = _mm_setr_epi8(a, b, c, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        int index = match_sse42(set, buf + i);
+        if(index < 16) {
+            return i + index;
+        }
+    }
+    if(i == len) {
+        return len;
+    }
+    /*
+        The tail is shorter than a vector, loading past it could leave the buffer: load the last
+        16 bytes instead. They overlap bytes already known not to match, so the first match is new.
+    */
+    int index = match_sse42(set, buf + len - 16);
+    return index < 16 ? len - 16 + index : len;
+}
+
+// the bitmask of the bytes of the 32 at 'p' equal to a, b or c
+__attribute__((target("avx2")))
+static inline unsigned match_avx2(__m256i va, __m256i vb, __m256i vc, const char* p) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+    __m256i match = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb)),
+                                    _mm256_cmpeq_epi8(chunk, vc));
+    return (unsigned)_mm256_movemask_epi8(match);
+}
+
+// the same with 16 bytes, for the lines too short for a 32 byte vector
+__attribute__((target("avx2")))
+static inline unsigned match_avx2_16(char a, char b, char c, const char* p) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(a)), _mm_cmpeq_epi8(chunk, _mm_set1_epi8(b))),
+                                 _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+    return (unsigned)_mm_movemask_epi8(match);
+}
+
+// compare 32 bytes with each byte of the set, the lowest bit of the combined mask is the first match
+__attribute__((target("avx2")))
+static size_t find_avx2(const char* buf, size_t len, char a, char b, char c) {
+    if(len < 16) {
+        return find_scalar(buf, len, a, b, c);
+    }
+    if(len < 32) {
+        // two overlapping 16 byte vectors cover the line
+        unsigned mask = match_avx2_16(a, b, c, buf);
+        if(mask) {
+            return __builtin_ctz(mask);
+        }
+        mask = match_avx2_16(a, b, c, buf + len - 16);
+        return mask ? len - 16 + __builtin_ctz(mask) : len;
+    }
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        unsigned mask = match_avx2(va, vb, vc, buf + i);
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if(i == len) {
+        return len;
+    }
+    // the last 32 bytes, overlapping bytes already known not to match (see find_sse42)
+    unsigned mask = match_avx2(va, vb, vc, buf + len - 32);
+    return mask ? len - 32 + __builtin_ctz(mask) : len;
+}
+
+#endif
+
+static const http_scanner scalar_scanner("scalar", find_scalar);
+#ifdef HAVE_X86_SIMD
+static const http_scanner sse42_scanner("sse4.2", find_sse42);
+static const http_scanner avx2_scanner("avx2", find_avx2);
+#endif
+
+const http_scanner* http_scanner::get(const char* name) {
+    if(strcmp(name, "scalar") == 0) {
+        return &scalar_scanner;
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+        return &sse42_scanner;
+    }
+    if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return &avx2_scanner;
+    }
+#endif
+    return NULL;
+}
+
+const http_scanner& http_scanner::best() {
+    // chosen on first use, the CPU does not change afterwards
+    static const http_scanner* chosen = get("avx2") ? get("avx2") : (get("sse4.2") ? get("sse4.2") : &scalar_scanner);
+    return *chosen;
+}
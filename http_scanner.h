@@ -0,0 +1,54 @@
+#ifndef HTTP_SCANNER_H
+#define HTTP_SCANNER_H
+
+#include <cstddef>
+
+/*
+    Byte scanners for the HTTP parser: find the first byte of a buffer that belongs to a small set
+    (line ends, token separators, the colon of a header), 16 (SSE4.2) or 32 (AVX2) bytes at a time.
+
+    The SIMD versions are compiled with per-function target attributes, so the server still builds
+    and runs on any x86-64 (or non-x86) CPU; best() picks the fastest one the CPU supports, once.
+    All versions only read inside [buf, buf + len) and give the same results as the scalar one.
+*/
+class http_scanner {
+public:
+    // offset of the first byte of buf[0, len) equal to a, b or c, len if none
+    typedef size_t (*find_func)(const char* buf, size_t len, char a, char b, char c);
+
+    constexpr http_scanner(const char* name, find_func find) : m_name(name), m_find(find) {}
+
+    const char* name() const { return m_name; }
+
+    size_t find(const char* buf, size_t len, char a, char b, char c) const {
+        return m_find(buf, len, a, b, c);
+    }
+
+    // the first '\r' or '\n', len if none
+    size_t line_end(const char* buf, size_t len) const {
+        return m_find(buf, len, '\r', '\n', '\n');
+    }
+
+    // the first ' ' or '\t' of a NUL terminated token, len if none (what strpbrk(buf, " \t") finds)
+    size_t token_end(const char* buf, size_t len) const {
+        size_t i = m_find(buf, len, ' ', '\t', '\0');
+        return (i < len && buf[i] == '\0') ? len : i;
+    }
+
+    // the ':' ending the name of a header, len if none
+    size_t name_end(const char* buf, size_t len) const {
+        size_t i = m_find(buf, len, ':', '\0', '\0');
+        return (i < len && buf[i] == '\0') ? len : i;
+    }
+
+    // the scanner called 'name' ("scalar", "sse4.2", "avx2"), NULL if unknown or not supported by the CPU
+    static const http_scanner* get(const char* name);
+    // the fastest scanner supported by the CPU
+    static const http_scanner& best();
+
+private:
+    const char* m_name;
+    find_func m_find;
+};
+
+#endif
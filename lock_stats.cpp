@@ -0,0 +1,217 @@
+#include "lock_stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "timer_wheel.h"
+
+// registration only, at construction time; not a locker, which reports here itself
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<lock_stats::site*> sites[lock_stats::MAX_SITES];
+static std::atomic<lock_stats::pool*> pools[lock_stats::MAX_POOLS];
+static std::atomic<int> pools_merged(0);     // pools registered after the table was full
+
+lock_stats::site* lock_stats::get_site(const char* name) {
+    pthread_mutex_lock(&registry_lock);
+    site* found = NULL;
+    for(int i = 0; i < MAX_SITES && !found; i++) {
+        site* s = sites[i].load(std::memory_order_relaxed);
+        if(!s) {
+            // value-initialized: every counter and bucket at 0
+            s = new site();
+            s->name = name;
+            sites[i].store(s, std::memory_order_release);
+            found = s;
+        } else if(strcmp(s->name, name) == 0) {
+            found = s;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if(!found) {
+        // out of sites: the last one takes the rest, under its own name
+        found = sites[MAX_SITES - 1].load(std::memory_order_acquire);
+    }
+    return found;
+}
+
+// pools of the same name add up, worker by worker, like the locks of a site
+lock_stats::pool* lock_stats::get_pool(const char* name, int workers) {
+    workers = workers < MAX_WORKERS ? workers : MAX_WORKERS;
+    pthread_mutex_lock(&registry_lock);
+    pool* found = NULL;
+    for(int i = 0; i < MAX_POOLS && !found; i++) {
+        pool* p = pools[i].load(std::memory_order_relaxed);
+        if(!p) {
+            found = new pool();
+            found->name = name;
+            found->workers = workers;
+            pools[i].store(found, std::memory_order_release);
+        } else if(strcmp(p->name, name) == 0) {
+            found = p;
+        }
+    }
+    if(!found) {
+        // out of pools: the last one takes the rest under its own name, the mix is counted
+        found = pools[MAX_POOLS - 1].load(std::memory_order_relaxed);
+        pools_merged.fetch_add(1, std::memory_order_relaxed);
+    }
+    if(found->workers < workers) {
+        found->workers = workers;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return found;
+}
+
+// the depth after an append, and a sample of it once per DEPTH_INTERVAL_MS
+void lock_stats::pool::pushed() {
+    int d = depth.fetch_add(1, std::memory_order_relaxed) + 1;
+    int max = max_depth.load(std::memory_order_relaxed);
+    while(d > max && !max_depth.compare_exchange_weak(max, d, std::memory_order_relaxed)) {
+    }
+    depths.record(d);
+
+    uint64_t now = current_ms();
+    uint64_t last = last_sample_ms.load(std::memory_order_relaxed);
+    if(now - last >= (uint64_t)DEPTH_INTERVAL_MS
+       && last_sample_ms.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+        uint64_t index = sample_count.fetch_add(1, std::memory_order_relaxed);
+        samples[index % DEPTH_SAMPLES].store(d, std::memory_order_relaxed);
+    }
+}
+
+static void render_histogram(metrics::text& out, const char* name, const char* help, const char* labels,
+                             const lock_stats::histogram& h, bool seconds, int first_bits) {
+    uint64_t buckets[metrics::BUCKETS];
+    for(int b = 0; b < metrics::BUCKETS; b++) {
+        buckets[b] = h.buckets[b].load(std::memory_order_relaxed);
+    }
+    metrics::render_histogram(out, name, help, labels, buckets, h.sum.load(std::memory_order_relaxed), seconds, first_bits);
+}
+
+void lock_stats::render(metrics::text& out) {
+    static const struct {
+        const char* name;
+        const char* help;
+    } names[] = {
+        { "lock_wait_seconds", "From asking for a lock to getting it, or time spent in a semaphore wait()." },
+        { "lock_hold_seconds", "From getting a lock to releasing it." },
+        { "lock_wakeup_seconds", "From the last post() to the return of a semaphore waiter that slept." },
+    };
+
+    out.append("# HELP lock_acquisitions_total Locks taken and semaphore tokens consumed.\n"
+               "# TYPE lock_acquisitions_total counter\n");
+    for(int i = 0; i < MAX_SITES; i++) {
+        const site* s = sites[i].load(std::memory_order_acquire);
+        if(s) {
+            out.append("lock_acquisitions_total{site=\"%s\"} %llu\n", s->name,
+                       (unsigned long long)s->acquisitions.load(std::memory_order_relaxed));
+        }
+    }
+    out.append("# HELP lock_contended_total Acquisitions that found the lock taken or no token.\n"
+               "# TYPE lock_contended_total counter\n");
+    for(int i = 0; i < MAX_SITES; i++) {
+        const site* s = sites[i].load(std::memory_order_acquire);
+        if(s) {
+            out.append("lock_contended_total{site=\"%s\"} %llu\n", s->name,
+                       (unsigned long long)s->contended.load(std::memory_order_relaxed));
+        }
+    }
+    for(int h = 0; h < 3; h++) {
+        const char* help = names[h].help;
+        for(int i = 0; i < MAX_SITES; i++) {
+            const site* s = sites[i].load(std::memory_order_acquire);
+            if(!s) {
+                continue;
+            }
+            const histogram& hist = h == 0 ? s->wait : h == 1 ? s->hold : s->wakeup;
+            if(hist.sum.load(std::memory_order_relaxed) == 0 && h > 0) {
+                // a semaphore holds nothing, a lock wakes nobody up
+                continue;
+            }
+            char labels[96];
+            snprintf(labels, sizeof(labels), "site=\"%s\"", s->name);
+            render_histogram(out, names[h].name, help, labels, hist, true, 6);
+            help = NULL;
+        }
+    }
+
+    /*
+        Every family once, its HELP and TYPE first, then its samples for every pool: the text format
+        wants the samples of a family together.
+    */
+    const pool* registered[MAX_POOLS];
+    char labels[MAX_POOLS][96];
+    int count = 0;
+    for(int i = 0; i < MAX_POOLS; i++) {
+        const pool* p = pools[i].load(std::memory_order_acquire);
+        if(p) {
+            snprintf(labels[count], sizeof(labels[count]), "pool=\"%s\"", p->name);
+            registered[count++] = p;
+        }
+    }
+    if(count == 0) {
+        return;
+    }
+
+    out.append("# HELP threadpool_queue_depth Requests queued and not yet taken by a worker.\n"
+               "# TYPE threadpool_queue_depth gauge\n");
+    for(int i = 0; i < count; i++) {
+        out.append("threadpool_queue_depth{%s} %d\n", labels[i], registered[i]->depth.load(std::memory_order_relaxed));
+    }
+    out.append("# HELP threadpool_queue_depth_max The deepest the queue has been.\n"
+               "# TYPE threadpool_queue_depth_max gauge\n");
+    for(int i = 0; i < count; i++) {
+        out.append("threadpool_queue_depth_max{%s} %d\n", labels[i], registered[i]->max_depth.load(std::memory_order_relaxed));
+    }
+    const char* help = "Queue depth right after every append.";
+    for(int i = 0; i < count; i++) {
+        render_histogram(out, "threadpool_queue_depth_seen", help, labels[i], registered[i]->depths, false, 0);
+        help = NULL;
+    }
+
+    // the samples, oldest first, as comments: the text format has no place for a series
+    for(int i = 0; i < count; i++) {
+        const pool* p = registered[i];
+        uint64_t total = p->sample_count.load(std::memory_order_relaxed);
+        uint64_t first = total > (uint64_t)DEPTH_SAMPLES ? total - DEPTH_SAMPLES : 0;
+        out.append("# threadpool_queue_depth{%s} every %d ms, last %llu samples:", labels[i], DEPTH_INTERVAL_MS,
+                   (unsigned long long)(total - first));
+        for(uint64_t s = first; s < total; s++) {
+            out.append(" %d", p->samples[s % DEPTH_SAMPLES].load(std::memory_order_relaxed));
+        }
+        out.append("\n");
+    }
+
+    out.append("# HELP threadpool_worker_seconds_total Time of every worker processing requests (busy) or looking for one (idle).\n"
+               "# TYPE threadpool_worker_seconds_total counter\n");
+    for(int i = 0; i < count; i++) {
+        for(int w = 0; w < registered[i]->workers; w++) {
+            const worker& k = registered[i]->per_worker[w];
+            uint64_t busy = k.busy_ns.load(std::memory_order_relaxed);
+            uint64_t idle = k.idle_ns.load(std::memory_order_relaxed);
+            out.append("threadpool_worker_seconds_total{%s,worker=\"%d\",state=\"busy\"} %.9f\n"
+                       "threadpool_worker_seconds_total{%s,worker=\"%d\",state=\"idle\"} %.9f\n",
+                       labels[i], w, busy / 1e9, labels[i], w, idle / 1e9);
+        }
+    }
+    out.append("# HELP threadpool_worker_busy_ratio Share of the time every worker spent processing requests.\n"
+               "# TYPE threadpool_worker_busy_ratio gauge\n");
+    for(int i = 0; i < count; i++) {
+        for(int w = 0; w < registered[i]->workers; w++) {
+            const worker& k = registered[i]->per_worker[w];
+            uint64_t busy = k.busy_ns.load(std::memory_order_relaxed);
+            uint64_t idle = k.idle_ns.load(std::memory_order_relaxed);
+            out.append("threadpool_worker_busy_ratio{%s,worker=\"%d\"} %.4f\n", labels[i], w,
+                       busy + idle > 0 ? (double)busy / (busy + idle) : 0.0);
+        }
+    }
+    out.append("# HELP threadpool_worker_requests_total Requests taken by every worker.\n"
+               "# TYPE threadpool_worker_requests_total counter\n");
+    for(int i = 0; i < count; i++) {
+        for(int w = 0; w < registered[i]->workers; w++) {
+            out.append("threadpool_worker_requests_total{%s,worker=\"%d\"} %llu\n", labels[i], w,
+                       (unsigned long long)registered[i]->per_worker[w].requests.load(std::memory_order_relaxed));
+        }
+    }
+    out.append("# HELP threadpool_pools_merged Pools counted in the last pool for lack of room, MAX_POOLS is too small if not 0.\n"
+               "# TYPE threadpool_pools_merged gauge\nthreadpool_pools_merged %d\n", pools_merged.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,117 @@
+#ifndef LOCK_STATS_H
+#define LOCK_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "metrics.h"
+
+/*
+    Instrumentation of the locks, the semaphores and the threadpool, for when latency regresses and
+    it is not clear whether the workers are starved, a lock is contended or the wake-ups are slow.
+
+    Opt-in: only a build with -DLOCK_STATS records anything, the other builds do not even read the
+    clock. Then every locker, spin_mutex, sem and futex_sem reports to the site named when it was
+    constructed (all the size classes of the buffer pools are one site, "buffer_pool"):
+        - acquisitions, and how many were contended (the lock was taken, the semaphore had no token)
+        - wait: from asking for the lock to getting it, or the time spent in a semaphore's wait()
+        - hold: from getting the lock to releasing it
+        - wakeup: for a semaphore waiter that slept, from the last post() to its return from wait()
+    and every threadpool reports the depth of its queue (a histogram, the maximum, and a sample
+    every DEPTH_INTERVAL_MS for the last minute) and, per worker, the time spent processing
+    requests (busy) and polling or parked (idle).
+
+    Everything is rendered with the metrics of /__stats, and dumped to standard output on SIGUSR1.
+    The counters are shared atomics: this build is for finding a problem, not for production.
+*/
+class lock_stats {
+public:
+    static const int MAX_SITES = 32;
+    static const int MAX_POOLS = 4;
+    static const int MAX_WORKERS = 256;         // workers beyond are not counted
+    static const int DEPTH_SAMPLES = 600;
+    static const int DEPTH_INTERVAL_MS = 100;
+
+    struct histogram {
+        std::atomic<uint64_t> buckets[metrics::BUCKETS];
+        std::atomic<uint64_t> sum;
+
+        void record(uint64_t value) {
+            buckets[metrics::bucket(value)].fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+        }
+    };
+
+    struct site {
+        const char* name;
+        std::atomic<uint64_t> acquisitions;
+        std::atomic<uint64_t> contended;
+        histogram wait;
+        histogram hold;
+        histogram wakeup;
+
+        void acquired(bool was_contended, uint64_t wait_ns) {
+            acquisitions.fetch_add(1, std::memory_order_relaxed);
+            if(was_contended) {
+                contended.fetch_add(1, std::memory_order_relaxed);
+            }
+            wait.record(wait_ns);
+        }
+    };
+
+    struct alignas(CACHE_LINE_SIZE) worker {
+        std::atomic<uint64_t> busy_ns;
+        std::atomic<uint64_t> idle_ns;
+        std::atomic<uint64_t> requests;
+    };
+
+    struct pool {
+        const char* name;
+        int workers;
+        worker per_worker[MAX_WORKERS];
+        std::atomic<int> depth;             // requests appended and not yet taken by a worker
+        std::atomic<int> max_depth;
+        histogram depths;                   // the depth seen by every append
+        std::atomic<uint64_t> last_sample_ms;
+        std::atomic<uint64_t> sample_count;
+        std::atomic<int> samples[DEPTH_SAMPLES];    // a ring, the last DEPTH_SAMPLES samples
+
+        void pushed();
+        void popped() { depth.fetch_sub(1, std::memory_order_relaxed); }
+        // worker 'index' spent 'idle_ns' looking for a request, then 'busy_ns' on it
+        void served(int index, uint64_t idle_ns, uint64_t busy_ns) {
+            if(index < MAX_WORKERS) {
+                per_worker[index].idle_ns.fetch_add(idle_ns, std::memory_order_relaxed);
+                per_worker[index].busy_ns.fetch_add(busy_ns, std::memory_order_relaxed);
+                per_worker[index].requests.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // a worker of pool 'p' is busy for the lifetime of this object, and was idle from 'idle_since'
+    // to its construction; 'idle_since' moves to its destruction
+    class busy_scope {
+    public:
+        busy_scope(pool* p, int index, uint64_t& idle_since)
+            : m_pool(p), m_index(index), m_idle_since(idle_since), m_start(current_ns()) {}
+        ~busy_scope() {
+            uint64_t end = current_ns();
+            m_pool->served(m_index, m_start - m_idle_since, end - m_start);
+            m_idle_since = end;
+        }
+    private:
+        pool* m_pool;
+        int m_index;
+        uint64_t& m_idle_since;
+        uint64_t m_start;
+    };
+
+    // the site or pool called 'name', registered on first use; 'name' must outlive the process
+    static site* get_site(const char* name);
+    static pool* get_pool(const char* name, int workers);
+
+    // the exposition of every site and pool, appended to 'out'
+    static void render(metrics::text& out);
+};
+
+#endif
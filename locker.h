@@ -4,11 +4,72 @@
 #include <pthread.h>
 #include <exception>
 #include <semaphore.h>
+#include <atomic>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "ring_queue.h"
+#ifdef LOCK_STATS
+#include "lock_stats.h"
+#endif
+
+/*
+    What the locks and semaphores below report to lock_stats, as their (empty) base class: in a
+    -DLOCK_STATS build the clock readings and the site the lock was constructed with, in any other
+    build nothing at all, every call compiles away and the lock keeps its size.
+*/
+#ifdef LOCK_STATS
+class lock_probe {
+public:
+    static const bool ENABLED = true;
+
+    explicit lock_probe(const char* site) : m_site(lock_stats::get_site(site)), m_acquired(0), m_last_post(0) {}
+
+    uint64_t probe_start() { return current_ns(); }
+    // a semaphore token is ours, asked for at 'start'. Any number of waiters get here at once,
+    // so nothing is kept in the probe
+    void probe_acquired(bool contended, uint64_t start) {
+        m_site->acquired(contended, current_ns() - start);
+    }
+    // the mutex is ours, asked for at 'start'; the time is kept for probe_released()
+    void probe_locked(bool contended, uint64_t start) {
+        uint64_t now = current_ns();
+        m_acquired = now;
+        m_site->acquired(contended, now - start);
+    }
+    // about to release the mutex
+    void probe_released() { m_site->hold.record(current_ns() - m_acquired); }
+    void probe_posted() { m_last_post.store(current_ns(), std::memory_order_relaxed); }
+    // a waiter that slept is back
+    void probe_woke() { m_site->wakeup.record(current_ns() - m_last_post.load(std::memory_order_relaxed)); }
+
+private:
+    lock_stats::site* m_site;
+    uint64_t m_acquired;                    // mutexes only, written by the holder only
+    std::atomic<uint64_t> m_last_post;
+};
+#else
+class lock_probe {
+public:
+    static const bool ENABLED = false;
+
+    explicit lock_probe(const char*) {}
+
+    uint64_t probe_start() { return 0; }
+    void probe_acquired(bool, uint64_t) {}
+    void probe_locked(bool, uint64_t) {}
+    void probe_released() {}
+    void probe_posted() {}
+    void probe_woke() {}
+};
+#endif
 
 // thread synchronization mechanism 
-class locker {
+class locker : private lock_probe {
 public:
-    locker() 
+    // 'site' names the lock in the lock_stats of an instrumented build
+    explicit locker(const char* site = "locker") : lock_probe(site)
     {
         /* if successful, pthread_mutex_init() function shall return 0, 
         otherwise, an error number shall be returned to indicate the error.*/
@@ -24,11 +85,21 @@ public:
 
     bool lock() 
     {
-        return pthread_mutex_lock(&m_mutex) == 0;
+        uint64_t start = probe_start();
+        // the instrumented build tries first, to tell a contended lock from a free one
+        bool contended = false;
+        if(!ENABLED || (contended = pthread_mutex_trylock(&m_mutex) != 0)) {
+            if(pthread_mutex_lock(&m_mutex) != 0) {
+                return false;
+            }
+        }
+        probe_locked(contended, start);
+        return true;
     }
 
     bool unlock()
     {
+        probe_released();
         return pthread_mutex_unlock(&m_mutex) == 0;
     }
 
@@ -91,16 +162,11 @@ private:
 };
 
 // semaphore class 
-class sem {
+class sem : private lock_probe {
 public:
-    // Constructor for initializing the semaphore with an initial value of 0
-    sem() {
-        if( sem_init( &m_sem, 0, 0 ) != 0 ) {
-            throw std::exception();
-        }
-    }
-    // Constructor for initializing the semaphore with a specified initial value
-    sem(int num) {
+    // Constructor for initializing the semaphore with a specified initial value, 0 by default;
+    // 'site' names it in the lock_stats of an instrumented build
+    explicit sem(int num = 0, const char* site = "sem") : lock_probe(site) {
         if( sem_init( &m_sem, 0, num ) != 0 ) {
             throw std::exception();
         }
@@ -111,15 +177,167 @@ public:
     }
     // Wait function to block until the semaphore value is greater than zero
     bool wait() {
-        return sem_wait( &m_sem ) == 0;
+        uint64_t start = probe_start();
+        bool contended = false;
+        if(!ENABLED || (contended = sem_trywait( &m_sem ) != 0)) {
+            if(sem_wait( &m_sem ) != 0) {
+                return false;
+            }
+        }
+        probe_acquired(contended, start);
+        if(contended) {
+            probe_woke();
+        }
+        return true;
     }
     // Post function to increment the semaphore value, potentially unblocking waiting threads
     bool post() {
+        probe_posted();
         return sem_post( &m_sem ) == 0;
     }
 private:
     sem_t m_sem;  // the underlying POSIX semaphore data structure
 };
-    
 
-#endif
\ No newline at end of file
+
+// sleep while '*addr' holds 'expected', until futex_wake() on 'addr' (or a spurious wake-up)
+inline void futex_wait(std::atomic<int>* addr, int expected) {
+    syscall(SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+// wake up at most 'count' threads sleeping on 'addr'
+inline void futex_wake(std::atomic<int>* addr, int count) {
+    syscall(SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*
+    Counting semaphore on a bare futex, with the interface of sem, that spins before it sleeps.
+
+    A token posted while the waiter is still spinning is taken without any system call on either
+    side: post() only enters the kernel when somebody is actually asleep (m_sleepers > 0). The spin
+    is adaptive, as in glibc's adaptive mutexes: it grows when spinning paid off and shrinks when
+    the waiter had to sleep anyway, between MIN_SPIN and MAX_SPIN polls, so an idle pool stops
+    burning cycles and a busy one stops paying for wake-ups.
+
+    No wake-up is lost: a waiter registers in m_sleepers before its last look at m_count, a poster
+    adds to m_count before it looks at m_sleepers (both sequentially consistent), and FUTEX_WAIT
+    only sleeps if m_count is still 0.
+*/
+class futex_sem : private lock_probe {
+public:
+    static const int MIN_SPIN = 16;
+    static const int MAX_SPIN = 4096;
+
+    explicit futex_sem(int num = 0, const char* site = "futex_sem")
+        : lock_probe(site), m_count(num), m_sleepers(0), m_spin(MIN_SPIN) {}
+
+    futex_sem(const futex_sem&) = delete;
+    futex_sem& operator=(const futex_sem&) = delete;
+
+    bool wait() {
+        uint64_t start = probe_start();
+        int spin = m_spin.load(std::memory_order_relaxed);
+        for(int i = 0; i < spin; i++) {
+            if(try_wait()) {
+                // a token came while we spun: spin a bit longer next time
+                m_spin.store(spin < MAX_SPIN ? spin * 2 : MAX_SPIN, std::memory_order_relaxed);
+                probe_acquired(i > 0, start);
+                return true;
+            }
+            cpu_relax();
+        }
+        m_spin.store(spin > MIN_SPIN ? spin / 2 : MIN_SPIN, std::memory_order_relaxed);
+
+        m_sleepers.fetch_add(1);
+        while(!try_wait()) {
+            futex_wait(&m_count, 0);
+        }
+        m_sleepers.fetch_sub(1);
+        probe_acquired(true, start);
+        probe_woke();
+        return true;
+    }
+
+    // take a token if there is one, never blocks
+    bool try_wait() {
+        int count = m_count.load(std::memory_order_relaxed);
+        while(count > 0) {
+            if(m_count.compare_exchange_weak(count, count - 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool post() {
+        probe_posted();
+        m_count.fetch_add(1);
+        if(m_sleepers.load() > 0) {
+            futex_wake(&m_count, 1);
+        }
+        return true;
+    }
+
+private:
+    std::atomic<int> m_count;       // the tokens
+    std::atomic<int> m_sleepers;    // the waiters asleep in the kernel, or about to be
+    std::atomic<int> m_spin;        // the current spin budget of a waiter
+};
+
+/*
+    Mutex for critical sections of a few instructions (a free list, a hash lookup), with the
+    interface of locker. An uncontended lock()/unlock() is one atomic instruction each and never a
+    system call. A contended lock() spins with exponential backoff, then sleeps on a futex so that a
+    holder preempted in the critical section is not spun on for a whole time slice (Drepper's
+    three-state mutex, "Futexes Are Tricky"): 0 unlocked, 1 locked, 2 locked with sleepers.
+*/
+class spin_mutex : private lock_probe {
+public:
+    static const int SPIN_ROUNDS = 10;      // the backoff doubles from 1 to 2^SPIN_ROUNDS pauses
+
+    explicit spin_mutex(const char* site = "spin_mutex") : lock_probe(site), m_state(0) {}
+
+    spin_mutex(const spin_mutex&) = delete;
+    spin_mutex& operator=(const spin_mutex&) = delete;
+
+    bool lock() {
+        uint64_t start = probe_start();
+        int expected = 0;
+        if(m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+            probe_locked(false, start);
+            return true;
+        }
+        for(int round = 0; round < SPIN_ROUNDS; round++) {
+            for(int i = 0; i < (1 << round); i++) {
+                cpu_relax();
+            }
+            // test before the test-and-set, so waiters spin on a shared line and do not bounce it
+            expected = 0;
+            if(m_state.load(std::memory_order_relaxed) == 0
+               && m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+                probe_locked(true, start);
+                return true;
+            }
+        }
+        // from here on the lock is taken as 'contended', so that unlock() wakes the next sleeper
+        while(m_state.exchange(2, std::memory_order_acquire) != 0) {
+            futex_wait(&m_state, 2);
+        }
+        probe_locked(true, start);
+        return true;
+    }
+
+    bool unlock() {
+        probe_released();
+        if(m_state.exchange(0, std::memory_order_release) == 2) {
+            futex_wake(&m_state, 1);
+        }
+        return true;
+    }
+
+private:
+    std::atomic<int> m_state;
+};
+
+
+#endif
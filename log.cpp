@@ -0,0 +1,320 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+thread_local logger::ring* logger::t_ring = NULL;
+
+static const char* level_prefixes[] = { "", "", "warning: ", "error: " };
+
+// the formatted lines of one pass for one file, written out in as few write() calls as possible
+struct logger::output {
+    static const size_t SIZE = 65536;
+
+    int fd;
+    size_t len;
+    char buf[SIZE];
+
+    void flush() {
+        size_t done = 0;
+        while(fd != -1 && done < len) {
+            ssize_t n = ::write(fd, buf + done, len - done);
+            if(n < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                break;      // nowhere to report it; the lines are lost
+            }
+            done += n;
+        }
+        len = 0;
+    }
+
+    // room for 'n' more bytes, n <= SIZE
+    char* reserve(size_t n) {
+        if(len + n > SIZE) {
+            flush();
+        }
+        return buf + len;
+    }
+
+    void append(const char* data, size_t n) {
+        memcpy(reserve(n), data, n);
+        len += n;
+    }
+};
+
+logger& logger::get() {
+    // never destroyed: threads may still log while the process exits
+    static logger* instance = new logger();
+    return *instance;
+}
+
+logger::logger() : m_ring_count(0), m_dropped(0), m_access_fd(-1), m_drain_lock("log_drain"), m_started(false) {
+    for(int i = 0; i < MAX_THREADS; i++) {
+        m_rings[i].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+bool logger::start() {
+    if(m_started) {
+        return true;
+    }
+    if(pthread_create(&m_thread, NULL, drain_thread, this) != 0) {
+        return false;
+    }
+    pthread_detach(m_thread);
+    // what was logged last before exit() is written too
+    atexit([] { logger::get().flush(); });
+    m_started = true;
+    return true;
+}
+
+bool logger::open_access_log(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return false;
+    }
+    m_access_fd = fd;
+    return true;
+}
+
+logger::ring* logger::local() {
+    ring* r = t_ring;
+    if(__builtin_expect(r != NULL, 1)) {
+        return r;
+    }
+    int index = m_ring_count.fetch_add(1);
+    if(index >= MAX_THREADS) {
+        return NULL;
+    }
+    r = new ring;
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail.store(0, std::memory_order_relaxed);
+    r->free_head = 0;
+    m_rings[index].store(r, std::memory_order_release);
+    t_ring = r;
+    return r;
+}
+
+/*
+    Room for a record of 'size' bytes at the tail of the ring, NULL if the ring is full. A record
+    never wraps: if it does not fit before the end, the rest of the ring is filled with a padding
+    record and it goes at the start. 'reserved' is what commit() then has to publish.
+*/
+char* logger::reserve(ring* r, size_t size, size_t& reserved) {
+    size = (size + 7) & ~(size_t)7;
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    size_t pos = tail & (RING_SIZE - 1);
+    size_t contiguous = RING_SIZE - pos;
+    size_t need = size <= contiguous ? size : contiguous + size;
+    if(need > RING_SIZE - (tail - r->free_head)) {
+        // the consumer may have moved on since the last look
+        r->free_head = r->head.load(std::memory_order_acquire);
+        if(need > RING_SIZE - (tail - r->free_head)) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+    }
+    if(size > contiguous) {
+        record* padding = (record*)(r->data + pos);
+        padding->size = (uint32_t)contiguous;
+        padding->type = PADDING;
+        pos = 0;
+    }
+    ((record*)(r->data + pos))->size = (uint32_t)size;
+    reserved = need;
+    return r->data + pos;
+}
+
+void logger::commit(ring* r, size_t reserved) {
+    r->tail.store(r->tail.load(std::memory_order_relaxed) + reserved, std::memory_order_release);
+}
+
+void logger::write(int level, const char* format, ...) {
+    ring* r = local();
+    if(!r) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    char message[MAX_MESSAGE];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(message, MAX_MESSAGE - 1, format, args);
+    va_end(args);
+    if(n < 0) {
+        return;
+    }
+    if(n > (int)MAX_MESSAGE - 2) {
+        n = MAX_MESSAGE - 2;
+    }
+    message[n++] = '\n';
+
+    size_t reserved;
+    char* p = reserve(r, sizeof(record) + n, reserved);
+    if(!p) {
+        return;
+    }
+    record* rec = (record*)p;
+    rec->type = (uint16_t)level;
+    rec->length = (uint16_t)n;
+    memcpy(rec + 1, message, n);
+    commit(r, reserved);
+}
+
+void logger::access(const sockaddr_in& address, const char* method, const char* url, const char* version,
+                    int status, off_t bytes, const char* referer, const char* user_agent) {
+    ring* r = local();
+    if(!r) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    const char* fields[5] = { method, url, version, referer, user_agent };
+    size_t lengths[5];
+    size_t total = sizeof(access_record);
+    for(int i = 0; i < 5; i++) {
+        lengths[i] = fields[i] ? strnlen(fields[i], MAX_FIELD) : 0;
+        total += lengths[i];
+    }
+
+    size_t reserved;
+    char* p = reserve(r, total, reserved);
+    if(!p) {
+        return;
+    }
+    access_record* a = (access_record*)p;
+    a->head.type = ACCESS;
+    a->time = time(NULL);
+    a->address = address.sin_addr;
+    a->status = status;
+    a->bytes = bytes;
+    char* strings = (char*)(a + 1);
+    for(int i = 0; i < 5; i++) {
+        a->lengths[i] = (uint16_t)lengths[i];
+        if(lengths[i]) {
+            memcpy(strings, fields[i], lengths[i]);
+            strings += lengths[i];
+        }
+    }
+    commit(r, reserved);
+}
+
+// 'n' bytes of 's' for a quoted field of the access log, quotes and control characters escaped
+static char* escape(char* out, const char* s, size_t n) {
+    if(n == 0) {
+        *out++ = '-';
+        return out;
+    }
+    for(size_t i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        if(c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
+        } else if(c < 0x20 || c >= 0x7f) {
+            out += sprintf(out, "\\x%02x", c);
+        } else {
+            *out++ = c;
+        }
+    }
+    return out;
+}
+
+// a line in the combined log format: host - - [time] "request" status bytes "referer" "user agent"
+void logger::format_access(const access_record* a, output& out) {
+    // the time is formatted once per second; only the drain thread gets here
+    static time_t stamp_time = -1;
+    static char stamp[40];
+    if(a->time != stamp_time) {
+        struct tm tm;
+        localtime_r(&a->time, &tm);
+        strftime(stamp, sizeof(stamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        stamp_time = a->time;
+    }
+
+    const char* fields[5];
+    const char* s = (const char*)(a + 1);
+    for(int i = 0; i < 5; i++) {
+        fields[i] = s;
+        s += a->lengths[i];
+    }
+
+    // every byte of a field escapes to 4 at most
+    char* line = out.reserve(128 + 4 * (size_t)(a->lengths[0] + a->lengths[1] + a->lengths[2] + a->lengths[3] + a->lengths[4]));
+    char* p = line;
+    inet_ntop(AF_INET, &a->address, p, INET_ADDRSTRLEN);
+    p += strlen(p);
+    p += sprintf(p, " - - [%s] \"", stamp);
+    if(a->lengths[1] == 0) {
+        *p++ = '-';
+    } else {
+        p = escape(p, fields[0], a->lengths[0]);
+        *p++ = ' ';
+        p = escape(p, fields[1], a->lengths[1]);
+        *p++ = ' ';
+        p = escape(p, fields[2], a->lengths[2]);
+    }
+    p += sprintf(p, "\" %d %lld \"", a->status, (long long)a->bytes);
+    p = escape(p, fields[3], a->lengths[3]);
+    *p++ = '"';
+    *p++ = ' ';
+    *p++ = '"';
+    p = escape(p, fields[4], a->lengths[4]);
+    *p++ = '"';
+    *p++ = '\n';
+    out.len += p - line;
+}
+
+void logger::drain() {
+    static output text;
+    static output accesses;
+
+    m_drain_lock.lock();
+    text.fd = STDOUT_FILENO;
+    accesses.fd = m_access_fd;
+    int count = m_ring_count.load(std::memory_order_relaxed);
+    if(count > MAX_THREADS) {
+        count = MAX_THREADS;
+    }
+    for(int i = 0; i < count; i++) {
+        ring* r = m_rings[i].load(std::memory_order_acquire);
+        if(!r) {
+            continue;
+        }
+        uint64_t head = r->head.load(std::memory_order_relaxed);
+        uint64_t tail = r->tail.load(std::memory_order_acquire);
+        while(head != tail) {
+            const record* rec = (const record*)(r->data + (head & (RING_SIZE - 1)));
+            if(rec->type == ACCESS) {
+                format_access((const access_record*)rec, accesses);
+            } else if(rec->type != PADDING) {
+                const char* prefix = level_prefixes[rec->type];
+                text.append(prefix, strlen(prefix));
+                text.append((const char*)(rec + 1), rec->length);
+            }
+            head += rec->size;
+        }
+        r->head.store(head, std::memory_order_release);
+    }
+    text.flush();
+    accesses.flush();
+    m_drain_lock.unlock();
+}
+
+void logger::flush() {
+    drain();
+}
+
+void* logger::drain_thread(void* arg) {
+    logger* log = (logger*)arg;
+    while(true) {
+        log->drain();
+        usleep(DRAIN_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
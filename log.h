@@ -0,0 +1,132 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <pthread.h>
+#include "locker.h"
+#include "ring_queue.h"
+
+/*
+    Log levels. Messages below LOG_LEVEL are compiled out, arguments included: build with
+    -DLOG_LEVEL=LOG_LEVEL_DEBUG to see every request line and header.
+*/
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define DEBUG_LOG(...) logger::get().write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define DEBUG_LOG(...) do {} while(0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define INFO_LOG(...) logger::get().write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define INFO_LOG(...) do {} while(0)
+#endif
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define WARN_LOG(...) logger::get().write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define WARN_LOG(...) do {} while(0)
+#endif
+#define ERROR_LOG(...) logger::get().write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/*
+    Asynchronous logging: the threads that log never lock, block or make a system call.
+
+    Every thread appends its records to a ring buffer of its own (one producer, one consumer, no
+    lock). A background thread drains the rings every few milliseconds, formats the records and
+    writes them with one write() per destination and pass. A record that does not fit in a full
+    ring is dropped and counted, logging never slows the server down.
+
+    Messages (write()) are formatted by the calling thread and go to standard output, one line
+    each. Access log records (access()) are stored as they are, the time, address, status and
+    strings copied with memcpy; the drain thread formats them in the combined log format, so the
+    cost for the worker is a few tens of nanoseconds.
+
+    Records of one thread come out in order; the order between threads is only roughly kept.
+*/
+class logger {
+public:
+    static const size_t RING_SIZE = 256 * 1024;     // bytes of records per thread, a power of two
+    static const int MAX_THREADS = 256;             // threads beyond it cannot log, their records are dropped
+    static const size_t MAX_MESSAGE = 1024;         // longer messages are truncated
+    static const size_t MAX_FIELD = 512;            // longer URLs, referers and user agents are truncated
+    static const int DRAIN_INTERVAL_MS = 5;         // the pause of the drain thread between passes
+
+    // the logger of the process
+    static logger& get();
+
+    // start the drain thread, records logged before are kept until then
+    bool start();
+    // write the access log to 'path' (appended), false if it cannot be opened
+    bool open_access_log(const char* path);
+    bool access_log_enabled() const { return m_access_fd != -1; }
+    // write out everything logged so far, on the calling thread
+    void flush();
+    unsigned long dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    void write(int level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+    // a line of the access log; the strings may be NULL
+    void access(const sockaddr_in& address, const char* method, const char* url, const char* version,
+                int status, off_t bytes, const char* referer, const char* user_agent);
+
+private:
+    struct record {
+        uint32_t size;          // of the whole record with the padding, a multiple of 8
+        uint16_t type;          // a level, ACCESS, or PADDING
+        uint16_t length;        // of the message that follows, with its newline
+    };
+    enum { ACCESS = 16, PADDING };
+
+    struct access_record {
+        record head;
+        time_t time;
+        in_addr address;
+        int status;
+        int64_t bytes;
+        uint16_t lengths[5];    // method, url, version, referer, user agent; the strings follow
+    };
+
+    struct ring {
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head;    // consumed up to here
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> tail;    // produced up to here
+        uint64_t free_head;                                     // the head the producer saw last
+        alignas(CACHE_LINE_SIZE) char data[RING_SIZE];
+    };
+
+    struct output;                                  // a batch of formatted lines for one file
+
+    logger();
+    logger(const logger&) = delete;
+    logger& operator=(const logger&) = delete;
+
+    ring* local();
+    char* reserve(ring* r, size_t size, size_t& reserved);
+    void commit(ring* r, size_t reserved);
+    static void* drain_thread(void* arg);
+    void drain();                                   // one pass over the rings
+    static void format_access(const access_record* a, output& out);
+
+    static thread_local ring* t_ring;
+
+    std::atomic<ring*> m_rings[MAX_THREADS];
+    std::atomic<int> m_ring_count;
+    std::atomic<unsigned long> m_dropped;
+    int m_access_fd;
+    locker m_drain_lock;                            // one consumer at a time: the drain thread or flush()
+    pthread_t m_thread;
+    bool m_started;
+};
+
+#endif
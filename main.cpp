@@ -8,15 +8,33 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <libgen.h>
 #include <memory>
+#include <vector>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "uring_reactor.h"
+#include "log.h"
+#include "topology.h"
 
 
-#define MAX_FD 65535            // the max number of file descriptor
+#define MAX_FD 131072           // the max number of file descriptor
 #define MAX_EVENT_NUMBER 10000  // the max number of events 
+#define TICK_MS 100             // the resolution of the idle timers, in milliseconds
+#define DEFAULT_IO_THREADS 4    // the threads of the I/O pool, see -d
+#define DEFAULT_GZIP_THREADS 1  // the threads compressing files for the gzip cache, see -g
+
+// build with -DWORK_STEALING to dispatch requests to per-worker queues with work stealing
+#ifdef WORK_STEALING
+typedef threadpool<http_conn, stealing_queue<http_conn>> pool_type;
+#else
+typedef threadpool<http_conn> pool_type;
+#endif
 
 void addsig(int sig, void(handler)(int))
 {
@@ -27,81 +45,169 @@ void addsig(int sig, void(handler)(int))
     sigaction(sig, &sa, NULL);
 }
 
+/*
+    Dumps the metrics to standard output on every SIGUSR1, with the lock and threadpool statistics
+    of a -DLOCK_STATS build: "kill -USR1 <pid>" while the server runs, without going through a
+    socket (when it is too busy to answer /__stats, for instance). SIGUSR1 is blocked in every
+    thread and taken here with sigwait(), so rendering runs in a normal thread and not in a handler.
+*/
+void* stats_dumper(void* arg)
+{
+    sigset_t* set = (sigset_t*)arg;
+    while(true) {
+        int sig;
+        if(sigwait(set, &sig) != 0) {
+            continue;
+        }
+        size_t len = 0;
+        char* text = http_conn::render_stats(len);
+        if(!text) {
+            WARN_LOG("no memory to dump the metrics");
+            continue;
+        }
+        for(size_t written = 0; written < len; ) {
+            ssize_t n = write(STDOUT_FILENO, text + written, len - written);
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0) {
+                break;
+            }
+            written += n;
+        }
+        free(text);
+    }
+    return NULL;
+}
+
 // add file descriptor to epoll
 extern void addfd(int epollfd, int fd, bool one_shot);
 // delete file descriptor from epoll
 extern void removefd(int epollfd, int fd);
 // modify file descriptor in epoll
 extern void modfd(int epollfd, int fd, int ev);
+// root directory of the website
+extern const char* doc_root;
 
+/*
+    Multi-reactor mode: every reactor thread owns
+        - its own listening socket, bound to the same port with SO_REUSEPORT, so the kernel
+          shards incoming connections across the reactors without a shared accept lock
+        - its own epoll object, holding its listening socket and the connections it accepted
+        - its slice of the 'users' table: the slots of the file descriptors it accepted.
+          File descriptors are unique in the process, so the slices never overlap.
+        - a timer wheel with the idle timers of its connections, ticked by a timerfd
+          registered in its epoll object
+    Parsing is still handed to the shared threadpool; the worker re-arms the connection on
+    the epoll object of the reactor that owns it (http_conn::m_epollfd).
+*/
+struct reactor {
+    int index;          // reactor number, 0 runs on the main thread
+    int listenfd;       // the listening socket of this reactor
+    int epollfd;        // the epoll object of this reactor, -1 with io_uring
+    int timerfd;        // fires every TICK_MS to drive the timer wheel
+    std::unique_ptr<timer_wheel> wheel;     // idle timers of the connections of this reactor
+    int cpu;            // the CPU the reactor is pinned to, -1 if it is not (-p)
+    pthread_t thread;   // the thread running the event loop
+};
 
-int main(int argc, char* argv[]) {
-    if(argc <= 1) {
-        printf("User Input should adhere to the following format: %s port_number\n", basename(argv[0]));
-        exit(-1);
+// pin the calling reactor thread to its CPU, if it has one
+static void pin_reactor(reactor* r) {
+    if(r->cpu >= 0 && !topology::pin_thread(r->cpu)) {
+        WARN_LOG("fail to pin reactor %d to CPU %d", r->index, r->cpu);
     }
+}
 
-    // Get the port number
-    int port = atoi(argv[1]);
-
-    // Process SIGPIPE signal
-    /*
-        When writing data to a socket, but the other end of the connection is closed unexpectedly, 
-        writing to the socket may generate a 'SIGPIPE'. By setting 'SIGPIPE' to 'SIG_IGN', we can 
-        handle the error gracefully rather than having the program terminate abruptly.
-
-        SIGPIE: A signal generated when a process tried to write to a pipe or socket that has been closes.
-                By default, when a process reeiveds a 'SIGPIPE' signal and does not handle it, the process is terminated.
-        
-        SIG_IGN: ignore
-    */
-    addsig(SIGPIPE, SIG_IGN);
-
-    // create and initialize threadpool 
-    // threadpool<http_conn>* pool = NULL;
-    std::unique_ptr<threadpool<http_conn>> pool;
-    try {
-        // pool = new threadpool<http_conn>;  --> change to smart pointer
-        pool = std::make_unique<threadpool<http_conn>>(); 
-    } catch (...) {
-        exit(-1);
+/*
+    Steer every new connection to the reactor pinned to the CPU that received it (-b): the listening
+    sockets of a SO_REUSEPORT group are indexed in the order they listened, the order of 'reactors'.
+    The program is attached to one socket and applies to the whole group.
+*/
+static bool attach_steering(const topology& topo, const std::vector<reactor>& reactors) {
+    std::vector<int> cpus;
+    for(const reactor& r : reactors) {
+        cpus.push_back(r.cpu);
     }
+    std::vector<struct sock_filter> program = topo.steering_program(cpus);
+    struct sock_fprog prog;
+    prog.len = (unsigned short)program.size();
+    prog.filter = program.data();
+    return setsockopt(reactors[0].listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
 
-    // create an array for 
-    // http_conn* users = new http_conn[MAX_FD];  --> change to smart pointer
-    auto users = std::make_unique<http_conn[]>(MAX_FD);
+// a file changed on disk, its materialized response and its gzip body are stale
+static void drop_cached_response(const char* path) {
+    http_conn::m_response_cache.invalidate(path);
+    http_conn::m_gzip_cache.invalidate(path);
+}
+
+static http_conn* users = NULL;             // connection table, indexed by file descriptor
+static pool_type* pool = NULL;              // the threadpool shared by all reactors
+static bool use_uring = false;              // run the io_uring event loop instead of the epoll one (-u)
 
-    // create the socket for listening
+// create a socket listening on 'port'
+// with 'reuse_port' set, several sockets can listen on the same port at the same time
+int create_listenfd(int port, bool reuse_port) {
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+    if(listenfd < 0) {
+        return -1;
+    }
 
     // set multiplexing
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(reuse_port && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0) {
+        close(listenfd);
+        return -1;
+    }
 
     // bind
     struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port);
-    bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    if(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(listenfd);
+        return -1;
+    }
 
-    // listen
-    listen(listenfd, 5);
+    // listen, with a backlog deep enough for bursts of connections (the kernel caps it at somaxconn)
+    if(listen(listenfd, SOMAXCONN) != 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+// the periodic work of a reactor, every TICK_MS
+static void tick(timer_wheel* wheel) {
+    // close the connections that have been idle for too long
+    wheel->tick(current_ms());
+    // free the cached responses no reader can see anymore
+    http_conn::m_response_cache.collect();
+    // the Date header of the responses, rendered again when the second changes
+    http_conn::m_headers.refresh(time(NULL));
+}
 
-    // create epoll object,
-    epoll_event events[MAX_EVENT_NUMBER];
-    int epollfd = epoll_create(5);
+// the event loop of one reactor
+void* reactor_loop(void* arg) {
+    reactor* r = (reactor*) arg;
+    pin_reactor(r);
+    int listenfd = r->listenfd;
+    int epollfd = r->epollfd;
+    int timerfd = r->timerfd;
+    timer_wheel* wheel = r->wheel.get();
 
-    // add the listening file descriptor to the epoll object
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
+    // create epoll event array
+    std::unique_ptr<epoll_event[]> events = std::make_unique<epoll_event[]>(MAX_EVENT_NUMBER);
 
     while(true) {   
         // the number of events
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        int num = epoll_wait(epollfd, events.get(), MAX_EVENT_NUMBER, -1);
 
         if(num < 0 &&  errno != EINTR) {
-            printf("epoll failure\n");
+            ERROR_LOG("epoll failure");
             break;
         }
 
@@ -114,25 +220,46 @@ int main(int argc, char* argv[]) {
                 struct sockaddr_in client_address;
                 socklen_t client_addrlen = sizeof(client_address);
                 int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlen);
+                if(connfd < 0) {
+                    continue;
+                }
                 
-                // current connections reach the upper bound
-                if(http_conn::m_user_count >= MAX_FD) {
-
-                    // need to give client a message saying the server is busy now
-                    close(connfd);
+                /*
+                    Current connections reach the upper bound: tell the client the server is busy.
+                    Every connection holds a descriptor below MAX_FD, so the table is full exactly
+                    when the kernel hands out one beyond it.
+                */
+                if(connfd >= MAX_FD) {
+                    http_conn::reject(connfd);
                     continue;
                 }
 
                 // initialize the new client's data, put into user array
-                users[connfd].init(connfd, client_address);
+                users[connfd].init(connfd, client_address, epollfd, wheel);
 
+            } else if(sockfd == timerfd) {
+                uint64_t expirations;
+                while(read(timerfd, &expirations, sizeof(expirations)) > 0) {
+                }
+                tick(wheel);
             } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
                 // 
                 users[sockfd].close_conn();
+            } else if(http_conn::m_owned) {
+                // ownership mode: the reactor serves the connection itself, whatever the edge
+                if(users[sockfd].serve()) {
+                    users[sockfd].refresh_timer();
+                } else {
+                    users[sockfd].close_conn();
+                }
             } else if(events[i].events & EPOLLIN) {
                 // read all the user data at once
                 if(users[sockfd].read()) {
-                    pool->append(users.get() + sockfd);
+                    users[sockfd].refresh_timer();
+                    // the queue is full: answer 503 at once rather than leave the client hanging
+                    if(!pool->append(users + sockfd)) {
+                        users[sockfd].shed();
+                    }
                 } else {
                     users[sockfd].close_conn();
                 }
@@ -140,13 +267,280 @@ int main(int argc, char* argv[]) {
                 // write all the user data at once
                 if( !users[sockfd].write() ) {   // if fail to write, close connection
                     users[sockfd].close_conn();
+                } else {
+                    users[sockfd].refresh_timer();
+                    // pipelined requests are waiting in the read buffer, no EPOLLIN will announce them
+                    if(users[sockfd].more_requests() && !pool->append(users + sockfd)) {
+                        users[sockfd].shed();
+                    }
                 }
             }
         }
     }
+    return r;
+}
+
+// the io_uring event loop of one reactor (-u)
+void* uring_reactor_loop(void* arg) {
+    reactor* r = (reactor*) arg;
+    pin_reactor(r);
+    try {
+        uring_reactor loop(r->listenfd, r->timerfd, r->wheel.get(), tick, users, MAX_FD);
+        loop.run();
+    } catch(...) {
+        ERROR_LOG("fail to start the io_uring loop of reactor %d", r->index);
+    }
+    return r;
+}
+
+
+int main(int argc, char* argv[]) {
+    // the number of reactors, each one runs its own epoll loop
+    int reactor_number = 1;
+    const char* access_log = NULL;
+    bool pin = false;               // place the threads on the CPUs and nodes of the machine (-p)
+    const char* nic = NULL;         // the network card to place the reactors near (-i)
+    bool steer = false;             // steer connections to the reactor of the receiving CPU (-b)
+    int io_threads = DEFAULT_IO_THREADS;    // threads reading files that are not in the page cache (-d), 0 for none
+    int gzip_threads = DEFAULT_GZIP_THREADS;    // threads compressing files for the gzip cache (-g), 0 never sends gzip
+
+    int opt;
+    while((opt = getopt(argc, argv, "r:sc:ua:pi:bod:g:z:")) != -1) {
+        switch(opt) {
+            case 'r':
+                reactor_number = atoi(optarg);
+                break;
+            case 's':
+                http_conn::m_use_sendfile = true;
+                break;
+            case 'c':
+                // memory budget of the response cache in MB, 0 disables it
+                http_conn::m_response_cache.set_budget((size_t)atoi(optarg) * 1024 * 1024);
+                break;
+            case 'u':
+                use_uring = true;
+                break;
+            case 'a':
+                // the access log, in the combined log format
+                access_log = optarg;
+                break;
+            case 'p':
+                pin = true;
+                break;
+            case 'i':
+                nic = optarg;
+                pin = true;
+                break;
+            case 'b':
+                steer = true;
+                pin = true;
+                break;
+            case 'o':
+                http_conn::m_owned = true;
+                break;
+            case 'd':
+                io_threads = atoi(optarg);
+                break;
+            case 'g':
+                gzip_threads = atoi(optarg);
+                break;
+            case 'z':
+                // memory budget of the gzip copies in MB, 0 only sends precompressed siblings
+                http_conn::m_gzip_cache.set_budget((size_t)atoi(optarg) * 1024 * 1024);
+                break;
+            default:
+                break;
+        }
+    }
+
+    if(optind >= argc || reactor_number <= 0 || io_threads < 0 || gzip_threads < 0) {
+        printf("User Input should adhere to the following format: %s port_number [-r reactor_number] [-s] [-c cache_mb] [-u] [-a access_log] [-p] [-i interface] [-b] [-o] [-d io_threads] [-g gzip_threads] [-z gzip_mb]\n", basename(argv[0]));
+        exit(-1);
+    }
+
+    // Get the port number
+    int port = atoi(argv[optind]);
+
+    // block SIGUSR1 before any thread starts, they all inherit the mask; stats_dumper() takes it
+    static sigset_t dump_signals;
+    sigemptyset(&dump_signals);
+    sigaddset(&dump_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &dump_signals, NULL);
+
+    if(access_log && !logger::get().open_access_log(access_log)) {
+        printf("fail to open the access log %s\n", access_log);
+        exit(-1);
+    }
+    // from here on the messages are written by the logging thread
+    if(!logger::get().start()) {
+        printf("fail to start the logging thread\n");
+        exit(-1);
+    }
+
+    // Process SIGPIPE signal
+    /*
+        When writing data to a socket, but the other end of the connection is closed unexpectedly, 
+        writing to the socket may generate a 'SIGPIPE'. By setting 'SIGPIPE' to 'SIG_IGN', we can 
+        handle the error gracefully rather than having the program terminate abruptly.
+
+        SIGPIE: A signal generated when a process tried to write to a pipe or socket that has been closes.
+                By default, when a process reeiveds a 'SIGPIPE' signal and does not handle it, the process is terminated.
+        
+        SIG_IGN: ignore
+    */
+    addsig(SIGPIPE, SIG_IGN);
+
+    pthread_t dumper;
+    if(pthread_create(&dumper, NULL, stats_dumper, &dump_signals) != 0 || pthread_detach(dumper) != 0) {
+        WARN_LOG("fail to start the thread dumping the metrics on SIGUSR1");
+    }
+
+    if(use_uring && !uring_reactor::supported()) {
+        WARN_LOG("io_uring is not available, using epoll");
+        use_uring = false;
+    }
+    if(use_uring && http_conn::m_owned) {
+        WARN_LOG("-o does not apply to io_uring, its reactors own their connections already");
+        http_conn::m_owned = false;
+    }
+    if(use_uring && http_conn::m_use_sendfile) {
+        WARN_LOG("-s does not apply to io_uring, files are sent from their mappings");
+        http_conn::m_use_sendfile = false;
+    }
+
+    /*
+        With -p every reactor and worker is pinned to a CPU of its own, the reactors near the network
+        card given with -i, and the pool gets one worker per CPU left over on every node instead of
+        the default number of floating threads.
+    */
+    topology topo;
+    topology::placement place;
+    if(pin) {
+        place = topo.plan(reactor_number, nic);
+        if(nic && topo.nic_cpus(nic).empty()) {
+            WARN_LOG("no CPU is local to %s, the reactors are spread over the nodes", nic);
+        }
+        INFO_LOG("%d CPUs on %d nodes, %zu workers", topo.cpu_count(), topo.node_count(), place.worker_cpus.size());
+    }
+
+    // create and initialize threadpool, the io_uring reactors and -o process the requests themselves
+    // threadpool<http_conn>* pool = NULL;
+    std::unique_ptr<pool_type> pool_owner;
+    if(!use_uring && !http_conn::m_owned) {
+        try {
+            // pool = new threadpool<http_conn>;  --> change to smart pointer
+            if(pin) {
+                pool_owner = std::make_unique<pool_type>((int)place.worker_cpus.size(), pool_type::DEFAULT_MAX_REQUEST, place.worker_cpus);
+            } else {
+                pool_owner = std::make_unique<pool_type>();
+            }
+        } catch (...) {
+            exit(-1);
+        }
+        pool = pool_owner.get();
+    }
 
-    close(epollfd);
-    close(listenfd);
+    /*
+        The I/O pool reads the files the reactors would otherwise wait for (see page_cache.h). Its
+        threads are not pinned, they spend their time blocked on the disk. The io_uring reactors
+        send from the mappings with their own submissions and do not use it.
+    */
+    std::unique_ptr<threadpool<http_conn::io_job>> io_pool_owner;
+    if(!use_uring && io_threads > 0) {
+        try {
+            io_pool_owner = std::make_unique<threadpool<http_conn::io_job>>(io_threads,
+                threadpool<http_conn::io_job>::DEFAULT_MAX_REQUEST, std::vector<int>(), "io");
+        } catch (...) {
+            exit(-1);
+        }
+        http_conn::m_io_pool = io_pool_owner.get();
+    }
+
+    /*
+        The gzip pool looks for the precompressed siblings of the text files and compresses the
+        files that have none, off the request path (see gzip_cache.h). Its threads are not pinned
+        either, the work is rare: once per version of a file.
+    */
+    std::unique_ptr<threadpool<gzip_cache::job>> gzip_pool_owner;
+    if(gzip_threads > 0) {
+        try {
+            gzip_pool_owner = std::make_unique<threadpool<gzip_cache::job>>(gzip_threads,
+                threadpool<gzip_cache::job>::DEFAULT_MAX_REQUEST, std::vector<int>(), "gzip");
+        } catch (...) {
+            exit(-1);
+        }
+        http_conn::m_gzip_cache.start(gzip_pool_owner.get());
+    }
+
+    // drop cached files and responses as soon as they change on disk
+    http_conn::m_file_cache.set_invalidate_hook(drop_cached_response);
+    if(!http_conn::m_file_cache.watch(doc_root)) {
+        WARN_LOG("fail to watch %s, cached files will not be refreshed", doc_root);
+    }
+
+    // create an array for 
+    // http_conn* users = new http_conn[MAX_FD];  --> change to smart pointer
+    auto users_owner = std::make_unique<http_conn[]>(MAX_FD);
+    users = users_owner.get();
+
+    // create the listening socket and the epoll object of every reactor
+    std::vector<reactor> reactors(reactor_number);
+    for(int i = 0; i < reactor_number; i++) {
+        reactors[i].index = i;
+        reactors[i].cpu = pin ? place.reactor_cpus[i] : -1;
+        reactors[i].listenfd = create_listenfd(port, reactor_number > 1);
+        if(reactors[i].listenfd < 0) {
+            printf("fail to listen on port %d\n", port);
+            exit(-1);
+        }
+
+        // create epoll object, and add the listening file descriptor to it
+        reactors[i].epollfd = -1;
+        if(!use_uring) {
+            reactors[i].epollfd = epoll_create(5);
+            addfd(reactors[i].epollfd, reactors[i].listenfd, false);
+        }
+
+        // the timer wheel and the timerfd ticking it
+        reactors[i].wheel = std::make_unique<timer_wheel>(TICK_MS, current_ms());
+        reactors[i].timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        struct itimerspec tick;
+        tick.it_interval.tv_sec = 0;
+        tick.it_interval.tv_nsec = TICK_MS * 1000000;
+        tick.it_value = tick.it_interval;
+        if(reactors[i].timerfd < 0 || timerfd_settime(reactors[i].timerfd, 0, &tick, NULL) != 0) {
+            printf("fail to create the timer of reactor %d\n", i);
+            exit(-1);
+        }
+        if(!use_uring) {
+            addfd(reactors[i].epollfd, reactors[i].timerfd, false);
+        }
+    }
+
+    if(steer && reactor_number > 1 && !attach_steering(topo, reactors)) {
+        WARN_LOG("fail to attach the steering program, the kernel spreads the connections");
+    }
+
+    // reactor 0 runs on the main thread, the others get a thread of their own
+    void* (*loop)(void*) = use_uring ? uring_reactor_loop : reactor_loop;
+    for(int i = 1; i < reactor_number; i++) {
+        if(pthread_create(&reactors[i].thread, NULL, loop, &reactors[i]) != 0) {
+            exit(-1);
+        }
+    }
+    loop(&reactors[0]);
+
+    for(int i = 1; i < reactor_number; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+
+    for(int i = 0; i < reactor_number; i++) {
+        close(reactors[i].timerfd);
+        if(reactors[i].epollfd != -1) {
+            close(reactors[i].epollfd);
+        }
+        close(reactors[i].listenfd);
+    }
     // delete [] users;
     // delete pool;
     
@@ -0,0 +1,214 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+thread_local metrics::shard* metrics::t_shard = NULL;
+
+// the exposition of each counter; the status codes are one family with a label
+static const struct {
+    const char* name;
+    const char* help;
+    const char* label;
+} counter_names[metrics::COUNTERS] = {
+    { "http_connections_accepted_total", "Connections accepted.", NULL },
+    { "http_connections_closed_total", "Connections closed.", NULL },
+    { "http_connections_rejected_total", "Connections answered 503 for lack of room in the connection table.", NULL },
+    { "http_requests_total", "Requests answered.", NULL },
+    { "http_requests_dropped_total", "Requests dropped because the client hung up while they were queued.", NULL },
+    { "http_received_bytes_total", "Bytes received.", NULL },
+    { "http_sent_bytes_total", "Bytes sent.", NULL },
+    { "http_response_cache_hits_total", "Lookups of the response cache that found the response.", NULL },
+    { "http_response_cache_misses_total", "Lookups of the response cache that did not.", NULL },
+    { "http_epoll_ctl_calls_total", "epoll_ctl() calls made to register, re-arm and remove descriptors.", NULL },
+    { "http_cold_reads_total", "Batches held back while the I/O pool read their files into the page cache.", NULL },
+    { "http_gzip_responses_total", "Responses sent with a gzip-encoded body.", NULL },
+    { "http_responses_total", "Responses by status code, 503 when shed by admission control.", "200" },
+    { "http_responses_total", NULL, "400" },
+    { "http_responses_total", NULL, "403" },
+    { "http_responses_total", NULL, "404" },
+    { "http_responses_total", NULL, "500" },
+    { "http_responses_total", NULL, "503" }
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} histogram_names[metrics::HISTOGRAMS] = {
+    { "http_first_byte_seconds", "From accept to the first byte of the first response written." },
+    { "http_queue_wait_seconds", "Time requests spent in the threadpool queue." },
+    { "http_parse_seconds", "Parsing a request and resolving its file." },
+    { "http_write_seconds", "Writing a batch of replies." },
+    { "http_cold_read_seconds", "From handing a batch to the I/O pool to getting it back, its files in the page cache." }
+};
+
+metrics::metrics() : m_shard_count(0) {
+    for(int i = 0; i < MAX_SHARDS; i++) {
+        m_shards[i].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+metrics::~metrics() {
+    int count = m_shard_count.load() < MAX_SHARDS ? m_shard_count.load() : MAX_SHARDS;
+    for(int i = 0; i < count; i++) {
+        delete m_shards[i].load();
+    }
+}
+
+metrics::shard* metrics::attach() {
+    int index = m_shard_count.fetch_add(1);
+    if(index >= MAX_SHARDS - 1) {
+        /*
+            The last shard is shared by every thread from there on. The first of them creates it;
+            the others may still find it NULL for a moment and wait.
+        */
+        shard* s = NULL;
+        if(index == MAX_SHARDS - 1) {
+            s = new shard();
+            s->shared = true;
+            m_shards[MAX_SHARDS - 1].store(s, std::memory_order_release);
+        }
+        while((s = m_shards[MAX_SHARDS - 1].load(std::memory_order_acquire)) == NULL) {
+            cpu_relax();
+        }
+        t_shard = s;
+        return s;
+    }
+    shard* s = new shard();
+    s->shared = false;
+    m_shards[index].store(s, std::memory_order_release);
+    t_shard = s;
+    return s;
+}
+
+void metrics::text::append(const char* format, ...) {
+    if(failed) {
+        return;
+    }
+    while(true) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(buf + len, size - len, format, args);
+        va_end(args);
+        if(n < 0) {
+            failed = true;
+            return;
+        }
+        if((size_t)n < size - len) {
+            len += n;
+            return;
+        }
+        char* larger = (char*)realloc(buf, size * 2);
+        if(!larger) {
+            failed = true;
+            return;
+        }
+        buf = larger;
+        size *= 2;
+    }
+}
+
+char* metrics::render(const char* extra, size_t& len) const {
+    uint64_t counters[COUNTERS] = { 0 };
+    uint64_t* buckets = (uint64_t*)calloc((size_t)HISTOGRAMS * BUCKETS, sizeof(uint64_t));
+    uint64_t sums[HISTOGRAMS] = { 0 };
+    text out = { (char*)malloc(16384), 0, 16384, false };
+    if(!buckets || !out.buf) {
+        free(buckets);
+        free(out.buf);
+        return NULL;
+    }
+
+    // add the shards up
+    for(int i = 0; i < MAX_SHARDS; i++) {
+        const shard* s = m_shards[i].load(std::memory_order_acquire);
+        if(!s) {
+            continue;
+        }
+        for(int c = 0; c < COUNTERS; c++) {
+            counters[c] += s->counters[c].load(std::memory_order_relaxed);
+        }
+        for(int h = 0; h < HISTOGRAMS; h++) {
+            const histogram_shard& hs = s->histograms[h];
+            for(int b = 0; b < BUCKETS; b++) {
+                buckets[h * BUCKETS + b] += hs.buckets[b].load(std::memory_order_relaxed);
+            }
+            sums[h] += hs.sum.load(std::memory_order_relaxed);
+        }
+    }
+
+    for(int c = 0; c < COUNTERS; c++) {
+        if(counter_names[c].help) {
+            out.append("# HELP %s %s\n# TYPE %s counter\n", counter_names[c].name, counter_names[c].help, counter_names[c].name);
+        }
+        if(counter_names[c].label) {
+            out.append("%s{code=\"%s\"} %llu\n", counter_names[c].name, counter_names[c].label, (unsigned long long)counters[c]);
+        } else {
+            out.append("%s %llu\n", counter_names[c].name, (unsigned long long)counters[c]);
+        }
+    }
+    // closed connections are counted after they were accepted, the difference cannot go below 0
+    uint64_t closed = counters[CONNECTIONS_CLOSED];
+    uint64_t accepted = counters[CONNECTIONS_ACCEPTED];
+    out.append("# HELP http_connections_open Connections open.\n# TYPE http_connections_open gauge\n"
+               "http_connections_open %llu\n", (unsigned long long)(accepted > closed ? accepted - closed : 0));
+
+    // from 1 us (2^10 ns) up
+    for(int h = 0; h < HISTOGRAMS; h++) {
+        render_histogram(out, histogram_names[h].name, histogram_names[h].help, "", buckets + h * BUCKETS,
+                         sums[h], true, 10);
+    }
+
+    if(extra) {
+        out.append("%s", extra);
+    }
+    free(buckets);
+    if(out.failed) {
+        free(out.buf);
+        return NULL;
+    }
+    len = out.len;
+    return out.buf;
+}
+
+/*
+    Every power of two is a bucket boundary of the histogram, so the cumulative counts are exact. The
+    last bucket of the histogram also holds the values beyond its range, it only goes into +Inf.
+*/
+void metrics::render_histogram(text& out, const char* name, const char* help, const char* labels,
+                               const uint64_t* buckets, uint64_t sum, bool seconds, int first_bits) {
+    const char* comma = labels[0] ? "," : "";
+    if(help) {
+        out.append("# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    }
+    uint64_t cumulative = 0;
+    int b = 0;
+    for(int bits = first_bits; bits < MAX_BITS; bits++) {
+        // the buckets below 2^bits end at index (bits - SUB_BITS + 1) * SUB_BUCKETS, or 2^bits below 2^SUB_BITS
+        int end = bits < SUB_BITS ? 1 << bits : (bits - SUB_BITS + 1) * SUB_BUCKETS;
+        for(; b < end && b < BUCKETS; b++) {
+            cumulative += buckets[b];
+        }
+        // plain numbers are integers (a queue depth): below 2^bits is up to 2^bits - 1, exactly
+        double bound = seconds ? (double)(1ULL << bits) / 1e9 : (double)((1ULL << bits) - 1);
+        out.append("%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, comma, bound, (unsigned long long)cumulative);
+    }
+    // the buckets themselves for the total: a count read a moment later could be lower
+    for(; b < BUCKETS; b++) {
+        cumulative += buckets[b];
+    }
+    out.append("%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, comma, (unsigned long long)cumulative);
+    char total[32];
+    if(seconds) {
+        snprintf(total, sizeof(total), "%.9f", sum / 1e9);
+    } else {
+        snprintf(total, sizeof(total), "%llu", (unsigned long long)sum);
+    }
+    if(labels[0]) {
+        out.append("%s_sum{%s} %s\n%s_count{%s} %llu\n", name, labels, total, name, labels,
+                   (unsigned long long)cumulative);
+    } else {
+        out.append("%s_sum %s\n%s_count %llu\n", name, total, name, (unsigned long long)cumulative);
+    }
+}
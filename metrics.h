@@ -0,0 +1,165 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#include "ring_queue.h"
+
+// current time of the monotonic clock in nanoseconds, read from the vDSO
+inline uint64_t current_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+    Counters and latency histograms of the server, served in the Prometheus text format (render()).
+
+    Every thread updates a shard of its own, on cache lines no other thread writes: an update is a
+    plain load and store, no locked instruction and no line bouncing between cores. The reader adds
+    the shards up without stopping anybody; it may see an update of one shard and not yet one made
+    just before on another, which a scrape does not care about. A thread gets its shard on its first
+    update, threads beyond MAX_SHARDS share one with atomic additions.
+
+    Histograms are log-linear (as in HdrHistogram): values below 2^SUB_BITS get a bucket each, above
+    that every power of two is split into 2^SUB_BITS buckets, so a value is known to within 1/16
+    from a nanosecond to 2^MAX_BITS ns (18 minutes); larger values go to the last bucket.
+
+    A process has one metrics object (http_conn::m_metrics).
+*/
+class metrics {
+public:
+    enum counter {
+        CONNECTIONS_ACCEPTED = 0,
+        CONNECTIONS_CLOSED,
+        CONNECTIONS_REJECTED,       // no room in the connection table, answered 503
+        REQUESTS,                   // requests answered, whatever the status
+        REQUESTS_DROPPED,           // the client hung up while the request was queued
+        BYTES_RECEIVED,
+        BYTES_SENT,
+        RESPONSE_CACHE_HITS,
+        RESPONSE_CACHE_MISSES,
+        EPOLL_CTL_CALLS,            // epoll_ctl() calls: registrations, re-arms and removals
+        COLD_READS,                 // batches whose files were read into the page cache by the I/O pool
+        GZIP_RESPONSES,             // responses with a gzip-encoded body, a sibling or a copy of the gzip cache
+        STATUS_200,
+        STATUS_400,
+        STATUS_403,
+        STATUS_404,
+        STATUS_500,
+        STATUS_503,
+        COUNTERS
+    };
+
+    enum histogram {
+        FIRST_BYTE = 0,             // from accept to the first byte of the first response written
+        QUEUE_WAIT,                 // time in the threadpool queue
+        PARSE,                      // parsing a request and resolving its file
+        WRITE,                      // writing a batch of replies, one write() call of the reactor
+        COLD_READ,                  // from handing a batch to the I/O pool to getting it back
+        HISTOGRAMS
+    };
+
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS = 40;
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+    static const int MAX_SHARDS = 256;
+
+    metrics();
+    ~metrics();
+
+    metrics(const metrics&) = delete;
+    metrics& operator=(const metrics&) = delete;
+
+    void add(counter c, uint64_t n = 1) {
+        shard& s = local();
+        bump(s.counters[c], n, s.shared);
+    }
+
+    // a duration in nanoseconds
+    void record(histogram h, uint64_t ns) {
+        shard& s = local();
+        histogram_shard& hs = s.histograms[h];
+        bump(hs.buckets[bucket(ns)], 1, s.shared);
+        bump(hs.sum, ns, s.shared);
+    }
+
+    /*
+        The Prometheus exposition of everything, followed by 'extra' (other components' metrics,
+        already in the text format, may be NULL). Returns a buffer from malloc() holding 'len' bytes,
+        NULL if memory is short.
+    */
+    char* render(const char* extra, size_t& len) const;
+
+    // a growing malloc() buffer the expositions are formatted into
+    struct text {
+        char* buf;
+        size_t len;
+        size_t size;
+        bool failed;
+
+        void append(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    };
+
+    /*
+        Append the exposition of histogram 'name' with the BUCKETS counts 'buckets' and their 'sum' to
+        'out'. 'labels' go into every line (e.g. site="file_cache", empty for none). Values are
+        nanoseconds exposed in seconds if 'seconds', else plain numbers; the exposed buckets are the
+        powers of two from 2^first_bits.
+    */
+    static void render_histogram(text& out, const char* name, const char* help, const char* labels,
+                                 const uint64_t* buckets, uint64_t sum, bool seconds, int first_bits);
+
+    // the bucket of 'value'
+    static int bucket(uint64_t value) {
+        if(value < (uint64_t)SUB_BUCKETS) {
+            return (int)value;
+        }
+        int magnitude = 63 - __builtin_clzll(value);
+        if(magnitude >= MAX_BITS) {
+            return BUCKETS - 1;
+        }
+        int shift = magnitude - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) - SUB_BUCKETS);
+    }
+
+private:
+    struct histogram_shard {
+        std::atomic<uint64_t> buckets[BUCKETS];
+        std::atomic<uint64_t> sum;          // nanoseconds
+    };
+
+    struct alignas(CACHE_LINE_SIZE) shard {
+        std::atomic<uint64_t> counters[COUNTERS];
+        histogram_shard histograms[HISTOGRAMS];
+        bool shared;                        // written by several threads, with atomic additions
+    };
+
+    // the only writer of a shard can add without a locked instruction
+    static void bump(std::atomic<uint64_t>& value, uint64_t n, bool shared) {
+        if(shared) {
+            value.fetch_add(n, std::memory_order_relaxed);
+        } else {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    }
+
+    shard& local() {
+        shard* s = t_shard;
+        if(__builtin_expect(s == NULL, 0)) {
+            s = attach();
+        }
+        return *s;
+    }
+    shard* attach();                        // the shard of a thread's first update
+
+    static thread_local shard* t_shard;     // the shard of the calling thread, NULL before its first update
+
+    std::atomic<shard*> m_shards[MAX_SHARDS];
+    std::atomic<int> m_shard_count;
+};
+
+#endif
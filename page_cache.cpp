@@ -0,0 +1,99 @@
+#include "page_cache.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+size_t page_cache::page_size() {
+    static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+bool page_cache::resident(const void* address, size_t len) {
+    if(len == 0) {
+        return true;
+    }
+    // mincore() wants a page-aligned start
+    size_t page = page_size();
+    uintptr_t start = (uintptr_t)address & ~(uintptr_t)(page - 1);
+    uintptr_t end = (uintptr_t)address + len;
+
+    // a vector entry per page, a few at a time: the first page missing ends the probe
+    unsigned char vec[256];
+    while(start < end) {
+        size_t pages = (end - start + page - 1) / page;
+        if(pages > sizeof(vec)) {
+            pages = sizeof(vec);
+        }
+        if(mincore((void*)start, pages * page, vec) != 0) {
+            // cannot tell, do as if the pages were there: the reactor is no worse off than without a probe
+            return true;
+        }
+        for(size_t i = 0; i < pages; i++) {
+            if(!(vec[i] & 1)) {
+                return false;
+            }
+        }
+        start += pages * page;
+    }
+    return true;
+}
+
+bool page_cache::resident(int fd, off_t offset, size_t len) {
+    if(len == 0) {
+        return true;
+    }
+    // mapping without touching reads nothing, it only gives mincore() something to look at
+    size_t page = page_size();
+    off_t aligned = offset & ~(off_t)(page - 1);
+    size_t length = len + (offset - aligned);
+    void* address = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, aligned);
+    if(address == MAP_FAILED) {
+        return true;
+    }
+    bool result = resident(address, length);
+    munmap(address, length);
+    return result;
+}
+
+void page_cache::load(int fd, off_t offset, size_t len) {
+    if(len == 0) {
+        return;
+    }
+    // one large request to the disk for the whole window
+    readahead(fd, offset, len);
+
+    // reading it all waits for what the readahead has not brought yet; the bytes are thrown away
+    static const size_t SCRATCH = 64 * 1024;
+    char scratch[SCRATCH];
+    while(len > 0) {
+        size_t chunk = len < SCRATCH ? len : SCRATCH;
+        ssize_t n = pread(fd, scratch, chunk, offset);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            // the end of a truncated file, or an error: the reactor's write will tell
+            return;
+        }
+        offset += n;
+        len -= n;
+    }
+}
+
+bool page_cache::read(int fd, off_t offset, char* buf, size_t len) {
+    while(len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
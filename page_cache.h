@@ -0,0 +1,51 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+    Page cache residency of file contents, for the I/O pool of http_conn (-d).
+
+    The reactors send file bodies straight from the page cache, with writev() of a mapping or with
+    sendfile(). A page that is not there blocks the reactor in a disk read, and every connection it
+    serves waits for the disk. So before a body goes out, resident() tells whether its next WINDOW
+    bytes are cached, without touching them (mincore() on a mapping; a file that is not mapped is
+    mapped for the probe only, which reads nothing). If they are not, load() brings them in on a
+    thread of the I/O pool: a readahead hint for the whole window, so the disk gets one large
+    sequential request instead of a fault per page, then pread() of the window into a scratch
+    buffer, which waits for the data. Not by touching a mapping: a page past the end of a file
+    truncated meanwhile raises SIGBUS, which would take the whole server down; pread() just
+    comes back short.
+
+    read() is that pread() loop for the code that needs the bytes themselves (the response cache,
+    the gzip cache): copying out of a file's mapping in userspace has the same SIGBUS exposure.
+
+    A window is the most one write of the reactor may need, a socket buffer takes far less; larger
+    bodies are loaded window by window as they go out, twice the window at a time, so the probes of
+    the writes that follow do not find the end of the last load missing.
+
+    Since Linux 5.2 mincore() only tells the truth about the pages of files the process owns or
+    could open for writing; for any other file it reports every page as resident. A server that
+    runs as a user that does not own the document root therefore never offloads anything, every
+    body is sent as if it were cached (which is how the server behaved before the I/O pool).
+*/
+class page_cache {
+public:
+    static const size_t WINDOW = 4 * 1024 * 1024;          // what resident() is asked about
+    static const size_t LOAD_WINDOW = 2 * WINDOW;          // what load() is asked for, so the next probes find it too
+
+    // whether the 'len' bytes at 'address', in a mapping of a file, are all in the page cache
+    static bool resident(const void* address, size_t len);
+    // whether bytes [offset, offset + len) of file 'fd' are all in the page cache
+    static bool resident(int fd, off_t offset, size_t len);
+    // bring bytes [offset, offset + len) of file 'fd' into the page cache, blocks until they are
+    static void load(int fd, off_t offset, size_t len);
+    // copy bytes [offset, offset + len) of file 'fd' to 'buf'; false if the file is shorter now or cannot be read
+    static bool read(int fd, off_t offset, char* buf, size_t len);
+
+private:
+    static size_t page_size();
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include "response_cache.h"
+#include <string.h>
+#include <sys/stat.h>
+#include "page_cache.h"
+
+// the shard of the calling thread, -1 until its first pin
+static thread_local int t_shard = -1;
+
+response_cache::response_cache(size_t budget) :
+m_epoch(2), m_next_shard(0), m_lock("response_cache"), m_budget(budget), m_bytes(0), m_oldest(NULL), m_newest(NULL) {
+    for(int i = 0; i < BUCKETS; i++) {
+        m_buckets[i].store(NULL, std::memory_order_relaxed);
+    }
+    for(int i = 0; i < SHARDS; i++) {
+        for(int j = 0; j < 3; j++) {
+            m_shards[i].active[j].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+response_cache::~response_cache() {
+    // the process is exiting, nobody is pinned anymore
+    invalidate(NULL);
+    for(response* r : m_retired) {
+        delete[] r->buffer;
+        delete[] r->path;
+        delete r;
+    }
+}
+
+uint64_t response_cache::hash_path(const char* path) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for(; *path; path++) {
+        h = (h ^ (unsigned char)*path) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+    Pin the current epoch. The epoch is read again after the pin is counted: if it moved meanwhile,
+    the writer may already have checked our slot, so retry in the new epoch.
+*/
+int response_cache::enter() {
+    if(t_shard < 0) {
+        t_shard = m_next_shard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    }
+    shard& s = m_shards[t_shard];
+    while(true) {
+        uint64_t epoch = m_epoch.load();
+        int slot = epoch % 3;
+        s.active[slot].fetch_add(1);
+        if(m_epoch.load() == epoch) {
+            return t_shard * 3 + slot;
+        }
+        s.active[slot].fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void response_cache::leave(int pin) {
+    if(pin >= 0) {
+        m_shards[pin / 3].active[pin % 3].fetch_sub(1, std::memory_order_release);
+    }
+}
+
+const response_cache::response* response_cache::lookup(const char* path) const {
+    uint64_t h = hash_path(path);
+    const response* r = m_buckets[h & (BUCKETS - 1)].load(std::memory_order_acquire);
+    for(; r; r = r->next.load(std::memory_order_acquire)) {
+        if(r->hash == h && strcmp(r->path, path) == 0) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+void response_cache::publish(const char* path, const char* head, size_t head_len, int body_fd, size_t body_len,
+                             const std::atomic<bool>* fresh) {
+    size_t size = head_len + body_len;
+    if(size > m_budget) {
+        return;
+    }
+
+    // build the response before taking the lock
+    response* r = new response;
+    r->hash = hash_path(path);
+    r->path = new char[strlen(path) + 1];
+    strcpy(r->path, path);
+    r->buffer = new char[size];
+    memcpy(r->buffer, head, head_len);
+    // a file truncated (or grown) since it was opened no longer matches the Content-Length of 'head'
+    struct stat st;
+    if(body_len > 0 && (!page_cache::read(body_fd, 0, r->buffer + head_len, body_len)
+                        || fstat(body_fd, &st) != 0 || (size_t)st.st_size != body_len)) {
+        delete[] r->buffer;
+        delete[] r->path;
+        delete r;
+        return;
+    }
+    r->head_len = head_len;
+    r->body_len = body_len;
+    r->older = r->newer = NULL;
+    r->retired = 0;
+
+    m_lock.lock();
+    // the file changed while we were building the response, or another worker published it meanwhile
+    if(!fresh->load() || lookup(path)) {
+        m_lock.unlock();
+        delete[] r->buffer;
+        delete[] r->path;
+        delete r;
+        return;
+    }
+
+    // make room, oldest first
+    reclaim();
+    while(m_bytes + size > m_budget && m_oldest) {
+        unlink(m_oldest);
+    }
+    if(m_bytes + size > m_budget) {
+        // retired responses still pinned by readers hold the budget
+        m_lock.unlock();
+        delete[] r->buffer;
+        delete[] r->path;
+        delete r;
+        return;
+    }
+
+    std::atomic<response*>& bucket = m_buckets[r->hash & (BUCKETS - 1)];
+    r->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // the release store publishes the fully built response to the readers
+    bucket.store(r, std::memory_order_release);
+
+    r->older = m_newest;
+    if(m_newest) {
+        m_newest->newer = r;
+    } else {
+        m_oldest = r;
+    }
+    m_newest = r;
+    m_bytes += size;
+    m_lock.unlock();
+}
+
+void response_cache::invalidate(const char* path) {
+    m_lock.lock();
+    if(!path) {
+        while(m_oldest) {
+            unlink(m_oldest);
+        }
+    } else {
+        response* r = (response*)lookup(path);
+        if(r) {
+            unlink(r);
+        }
+    }
+    try_advance();
+    reclaim();
+    m_lock.unlock();
+}
+
+void response_cache::collect() {
+    m_lock.lock();
+    try_advance();
+    reclaim();
+    m_lock.unlock();
+}
+
+// remove 'r' from its hash chain and the insertion list, readers may still hold it
+void response_cache::unlink(response* r) {
+    std::atomic<response*>* link = &m_buckets[r->hash & (BUCKETS - 1)];
+    while(link->load(std::memory_order_relaxed) != r) {
+        link = &link->load(std::memory_order_relaxed)->next;
+    }
+    link->store(r->next.load(std::memory_order_relaxed), std::memory_order_release);
+
+    if(r->older) {
+        r->older->newer = r->newer;
+    } else {
+        m_oldest = r->newer;
+    }
+    if(r->newer) {
+        r->newer->older = r->older;
+    } else {
+        m_newest = r->older;
+    }
+
+    r->retired = m_epoch.load();
+    m_retired.push_back(r);
+}
+
+// move from epoch e to e + 1 once no reader is pinned to e - 1
+void response_cache::try_advance() {
+    uint64_t epoch = m_epoch.load();
+    int slot = (epoch - 1) % 3;
+    for(int i = 0; i < SHARDS; i++) {
+        if(m_shards[i].active[slot].load() != 0) {
+            return;
+        }
+    }
+    m_epoch.store(epoch + 1);
+}
+
+// free the responses unlinked at least two epochs ago: nobody can still hold them
+void response_cache::reclaim() {
+    uint64_t epoch = m_epoch.load();
+    size_t kept = 0;
+    for(size_t i = 0; i < m_retired.size(); i++) {
+        response* r = m_retired[i];
+        if(r->retired + 2 <= epoch) {
+            m_bytes -= r->head_len + r->body_len;
+            delete[] r->buffer;
+            delete[] r->path;
+            delete r;
+        } else {
+            m_retired[kept++] = r;
+        }
+    }
+    m_retired.resize(kept);
+}
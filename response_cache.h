@@ -0,0 +1,95 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+#include "ring_queue.h"
+
+/*
+    Fully materialized responses of small, hot files: status line and headers followed by the body,
+    in one contiguous buffer. The Date and Connection headers, the only per-request parts, are not stored.
+
+    Readers never lock: they pin the current epoch with enter(), look the response up with lookup()
+    and keep using it (e.g. in an in-flight writev) until they call leave(), possibly from another
+    thread. Writers (publish, invalidate, collect) serialize on a mutex. A replaced or invalidated
+    response is unlinked at once but only freed two epochs later, and the epoch can only move on
+    once no reader is still pinned to the epoch before it. So a response stays valid as long as a
+    reader that could have seen it keeps its pin.
+
+    Pins are counted per shard (threads are spread over the shards), each shard on its own cache
+    line, so readers on different threads do not write to the same line.
+
+    Memory is bounded by 'budget' bytes, counting responses waiting to be freed; when a new response
+    does not fit, the oldest ones are evicted.
+*/
+class response_cache {
+public:
+    static const size_t DEFAULT_BUDGET = 32 * 1024 * 1024;
+    static const size_t MAX_OBJECT_SIZE = 64 * 1024;   // larger files are not materialized
+    static const int BUCKETS = 4096;                    // hash table size, a power of two
+    static const int SHARDS = 64;                       // reader pin counters
+
+    struct response {
+        uint64_t hash;
+        char* path;                         // the key, the resolved path of the file
+        char* buffer;                       // status line + headers, then the body
+        size_t head_len;                    // bytes of status line and headers
+        size_t body_len;                    // bytes of body
+        std::atomic<response*> next;        // hash chain
+        response* older;                    // insertion order, for eviction (writers only)
+        response* newer;
+        uint64_t retired;                   // the epoch it was unlinked in
+    };
+
+    explicit response_cache(size_t budget = DEFAULT_BUDGET);
+    ~response_cache();
+
+    // 0 disables the cache
+    void set_budget(size_t budget) { m_budget = budget; }
+    bool enabled() const { return m_budget > 0; }
+    // whether a file of 'size' bytes is worth materializing
+    bool cacheable(off_t size) const { return m_budget > 0 && size >= 0 && (size_t)size <= MAX_OBJECT_SIZE; }
+
+    // reader side, lock-free
+    int enter();                                        // pin the current epoch, returns the pin
+    void leave(int pin);                                // release a pin, from any thread
+    const response* lookup(const char* path) const;     // only valid while pinned
+
+    // writer side
+    // the body is read from file 'body_fd' with pread(), never copied out of a mapping of it: a file
+    // truncated meanwhile would raise SIGBUS there. A body shorter than 'body_len' now is not published.
+    // 'fresh' tells whether the source of the response is still current, it is checked with the
+    // writer lock held so that a concurrent invalidate() cannot be missed
+    void publish(const char* path, const char* head, size_t head_len, int body_fd, size_t body_len,
+                 const std::atomic<bool>* fresh);
+    void invalidate(const char* path);                  // NULL: every response
+    void collect();                                     // advance the epoch and free what is safe
+    // hits and misses are counted per thread by the connections (http_conn::m_metrics)
+
+private:
+    struct alignas(CACHE_LINE_SIZE) shard {
+        std::atomic<long> active[3];        // pinned readers per epoch (modulo 3)
+    };
+
+    static uint64_t hash_path(const char* path);
+    void unlink(response* r);               // unlink and retire, writer lock held
+    void try_advance();                     // writer lock held
+    void reclaim();                         // writer lock held
+
+    std::atomic<response*> m_buckets[BUCKETS];
+    std::atomic<uint64_t> m_epoch;
+    shard m_shards[SHARDS];
+    std::atomic<int> m_next_shard;          // hands out shards to threads
+
+    locker m_lock;                          // writers only
+    size_t m_budget;
+    size_t m_bytes;                         // live and retired responses
+    response* m_oldest;                     // insertion order list
+    response* m_newest;
+    std::vector<response*> m_retired;       // unlinked, waiting for their epoch to pass
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef RING_QUEUE_H
+#define RING_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+// size of a cache line, used to keep the producer and the consumer counters apart
+#define CACHE_LINE_SIZE 64
+
+// hint the CPU that we are in a spin-wait loop
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+    Bounded multi-producer multi-consumer lock-free ring queue (Dmitry Vyukov's algorithm).
+
+    Every cell carries a sequence number telling whose turn it is:
+        - sequence == pos       : the cell is free, the producer holding ticket 'pos' may fill it
+        - sequence == pos + 1   : the cell is full, the consumer holding ticket 'pos' may take it
+    A producer (consumer) claims a ticket with a CAS on m_enqueue_pos (m_dequeue_pos), fills (empties)
+    the cell and publishes it by advancing the sequence number. No locks, no allocation per item.
+
+    The ring has a power of two number of cells so a ticket maps to its cell with a mask, while
+    push() enforces the exact 'bound' requested by the caller.
+*/
+template<typename T>
+class ring_queue {
+public:
+    explicit ring_queue(size_t bound);
+
+    bool push(const T& item);   // false if 'bound' items are already queued
+    bool pop(T& item);          // false if the queue is empty
+    size_t size() const;        // the number of queued items, approximate under concurrency
+
+private:
+    struct cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    size_t m_bound;                        // max number of queued items
+    size_t m_mask;                         // number of cells - 1
+    std::unique_ptr<cell[]> m_cells;       // the ring
+
+    // producers and consumers each hammer their own counter, keep them on separate cache lines
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_enqueue_pos;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_dequeue_pos;
+    char m_pad[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+};
+
+template<typename T>
+ring_queue<T>::ring_queue(size_t bound) : m_bound(bound), m_enqueue_pos(0), m_dequeue_pos(0) {
+    if(bound == 0) {
+        throw std::exception();
+    }
+
+    size_t capacity = 1;
+    while(capacity < bound) {
+        capacity <<= 1;
+    }
+    m_mask = capacity - 1;
+    m_cells = std::make_unique<cell[]>(capacity);
+    for(size_t i = 0; i < capacity; i++) {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template<typename T>
+bool ring_queue<T>::push(const T& item) {
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    while(true) {
+        // keep the bound exact even though the ring may be larger
+        if(pos - m_dequeue_pos.load(std::memory_order_relaxed) >= m_bound) {
+            return false;
+        }
+
+        cell* c = &m_cells[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if(dif == 0) {
+            // the cell is free, try to claim the ticket
+            if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                c->data = item;
+                c->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if(dif < 0) {
+            // the consumer of the previous lap has not emptied the cell yet: the ring is full
+            return false;
+        } else {
+            // another producer took this ticket, retry with a fresh one
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template<typename T>
+bool ring_queue<T>::pop(T& item) {
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    while(true) {
+        cell* c = &m_cells[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(dif == 0) {
+            // the cell is full, try to claim the ticket
+            if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                item = c->data;
+                // hand the cell to the producer of the next lap
+                c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if(dif < 0) {
+            // the producer has not filled the cell yet: the ring is empty
+            return false;
+        } else {
+            // another consumer took this ticket, retry with a fresh one
+            pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template<typename T>
+size_t ring_queue<T>::size() const {
+    size_t head = m_dequeue_pos.load(std::memory_order_relaxed);
+    size_t tail = m_enqueue_pos.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+#endif
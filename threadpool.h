@@ -3,19 +3,119 @@
 
 #include <memory>
 #include <pthread.h>
-#include <list>
+#include <atomic>
 #include "locker.h"
+#include "ring_queue.h"
+#include "codel.h"
+#include "log.h"
+#include "topology.h"
+#ifdef LOCK_STATS
+#include "lock_stats.h"
+#endif
 #include <exception>
 #include <cstdio>
 #include <sys/epoll.h>
+#include <vector>
 
+/*
+    Queue policies of the threadpool. Both of them offer
+        bool push(T* request)                       : called by the reactors, false if the queue is full
+        bool pop(int worker, T*& request, bool steal) : called by worker 'worker', false if nothing to do
+*/
+
+// a single FIFO shared by all workers: a request goes to whichever worker is free
+template<typename T>
+class fifo_queue {
+public:
+    fifo_queue(int /*thread_number*/, int max_request) : m_queue(max_request) {}
+
+    bool push(T* request) {
+        return m_queue.push(request);
+    }
+
+    bool pop(int /*worker*/, T*& request, bool /*steal*/) {
+        return m_queue.pop(request);
+    }
+
+private:
+    ring_queue<T*> m_queue;
+};
+
+/*
+    One queue per worker, with connection-affine dispatch and work stealing.
+    A request is pushed to the worker that processed the previous request of the same connection
+    (T::last_worker()), so the connection state stays in that core's cache across keep-alive requests.
+    A worker serves its own queue first and steals from the others when it runs dry; whoever processes
+    a request becomes the connection's worker for the next one (T::set_last_worker()).
+*/
 template<typename T>
+class stealing_queue {
+public:
+    stealing_queue(int thread_number, int max_request) : m_next(0) {
+        // split the request bound between the workers
+        int bound = max_request / thread_number > 0 ? max_request / thread_number : 1;
+        for(int i = 0; i < thread_number; i++) {
+            m_queues.push_back(std::make_unique<ring_queue<T*>>(bound));
+        }
+    }
+
+    bool push(T* request) {
+        int n = m_queues.size();
+        int worker = request->last_worker();
+        if(worker < 0 || worker >= n) {
+            // a new connection, deal it out round-robin
+            worker = m_next.fetch_add(1, std::memory_order_relaxed) % n;
+        }
+
+        // fall back to the other workers if the preferred queue is full
+        for(int i = 0; i < n; i++) {
+            if(m_queues[(worker + i) % n]->push(request)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool pop(int worker, T*& request, bool steal) {
+        int n = m_queues.size();
+        bool got = m_queues[worker]->pop(request);
+        for(int i = 1; steal && !got && i < n; i++) {
+            got = m_queues[(worker + i) % n]->pop(request);
+        }
+        if(got && request) {
+            request->set_last_worker(worker);
+        }
+        return got;
+    }
+
+private:
+    std::vector<std::unique_ptr<ring_queue<T*>>> m_queues;  // one queue per worker
+    std::atomic<unsigned int> m_next;                       // round-robin cursor for new connections
+};
+
+/*
+    Besides process(), a request T offers what admission control needs:
+        void set_enqueue_time(uint64_t us), uint64_t enqueue_time() : when it was queued, in current_us()
+        bool hung_up()      : the client closed the connection
+        void drop()         : close it without an answer
+        void shed()         : answer 503 and close it
+    Requests are timestamped by append(); a worker drops the ones whose client gave up while they
+    waited, and sheds the ones that waited too long while the queue is overloaded (see codel.h).
+
+    Idle workers park on a Sem (futex_sem by default, which spins a little before it sleeps; sem is
+    the plain POSIX semaphore, bench/bench_wakeup.cpp compares the two).
+*/
+template<typename T, typename Queue = fifo_queue<T>, typename Sem = futex_sem>
 class threadpool {
 public:
-    static const int DEFAULT_THREAD_NUMBER = 8;
-    static const int DEFAULT_MAX_REQUEST = 10000;
+    static constexpr int DEFAULT_THREAD_NUMBER = 8;
+    static constexpr int DEFAULT_MAX_REQUEST = 10000;
+    static constexpr int SPIN_COUNT = 64;       // the number of polls of an empty queue before a worker parks
 
-    threadpool(int thread_number = DEFAULT_THREAD_NUMBER, int max_request = DEFAULT_MAX_REQUEST);
+    // with 'cpus', worker i is pinned to CPU cpus[i]; it must then hold thread_number CPUs.
+    // 'name' tells the pools apart in the lock_stats of an instrumented build
+    threadpool(int thread_number = DEFAULT_THREAD_NUMBER, int max_request = DEFAULT_MAX_REQUEST,
+               const std::vector<int>& cpus = std::vector<int>(), const char* name = "threadpool");
     ~threadpool();
     bool append(T* request);
 private:
@@ -24,11 +124,17 @@ private:
 
     int m_thread_number;                    // number of threads in the queue
     std::unique_ptr<pthread_t[]> m_threads; // an array of threads of size n_thread_number  
+    std::vector<int> m_cpus;                // the CPU of every worker, empty if they are not pinned
     int m_max_requests;                     // max number of requests in the queue
-    std::list<T*> m_workqueue;              // request queue
-    locker m_queuelocker;                   // mutex locker
-    sem m_queuestat;                        // semaphore status to determine if there is any request to handle
+    Queue m_workqueue;                      // request queue, lock-free
+    codel m_codel;                          // admission control on the time requests wait in the queue
+    std::atomic<int> m_next_index;          // hands out worker indices
+    std::atomic<int> m_idle;                // number of workers that announced they are about to park
+    Sem m_queuestat;                        // parked workers sleep on it, posted only when a worker is idle
     bool m_stop;                            // a stop flag 
+#ifdef LOCK_STATS
+    lock_stats::pool* m_stats;              // queue depth and worker busy/idle time
+#endif
 };
 
 /* 
@@ -36,12 +142,18 @@ private:
     [className]<[template parameter]>[member function name](function paremeter)
 */
 
-template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_request) : 
-m_thread_number(thread_number), m_max_requests(max_request), 
-m_stop(false), m_threads(NULL) {
+template<typename T, typename Queue, typename Sem>
+threadpool<T, Queue, Sem>::threadpool(int thread_number, int max_request, const std::vector<int>& cpus, const char* name) : 
+m_thread_number(thread_number), m_threads(NULL), m_cpus(cpus), m_max_requests(max_request), 
+m_workqueue(thread_number > 0 ? thread_number : 1, max_request > 0 ? max_request : 1),
+m_next_index(0), m_idle(0), m_queuestat(0, name), m_stop(false) {
+#ifdef LOCK_STATS
+    m_stats = lock_stats::get_pool(name, thread_number);
+#else
+    (void)name;
+#endif
 
-    if(thread_number <=0 || max_request <= 0) {
+    if(thread_number <=0 || max_request <= 0 || (!cpus.empty() && (int)cpus.size() != thread_number)) {
         throw std::exception();
     }
 
@@ -54,7 +166,7 @@ m_stop(false), m_threads(NULL) {
 
     // create "thread_number" number of threads, and detach them
     for(int i = 0; i < thread_number; i++) {
-        printf("create the %dth thread\n", i);
+        INFO_LOG("create the %dth thread", i);
         if( pthread_create(m_threads.get() + i, NULL, worker, this) != 0 ) {
             // delete[] m_threads;
             throw std::exception();
@@ -66,54 +178,109 @@ m_stop(false), m_threads(NULL) {
     }
 }
 
-template<typename T>
-threadpool<T>::~threadpool() {
+template<typename T, typename Queue, typename Sem>
+threadpool<T, Queue, Sem>::~threadpool() {
     // delete[] m_threads;
     m_stop = true;
 }
 
-template<typename T>
-bool threadpool<T>::append(T* request) {
-    m_queuelocker.lock();
-    if(m_workqueue.size() > m_max_requests) {
-        m_queuelocker.unlock();
+/*
+    Lost wake-ups are ruled out by ordering: the producer pushes and then reads m_idle, a worker
+    increments m_idle and then polls the queue once more before parking. A full fence sits between
+    the two steps on both sides, so at least one of them sees the other: either the worker finds the
+    request or the producer finds the idle worker and posts the semaphore.
+*/
+template<typename T, typename Queue, typename Sem>
+bool threadpool<T, Queue, Sem>::append(T* request) {
+    request->set_enqueue_time(current_us());
+    if(!m_workqueue.push(request)) {
         return false;
     }
+#ifdef LOCK_STATS
+    m_stats->pushed();
+#endif
 
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    // wake up a parked worker, if any. Running workers pick the request up without a syscall
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int idle = m_idle.load();
+    while(idle > 0) {
+        if(m_idle.compare_exchange_weak(idle, idle - 1)) {
+            m_queuestat.post();
+            break;
+        }
+    }
     return true;
 }
 
-template<typename T>
-void* threadpool<T>::worker(void* arg) {
+template<typename T, typename Queue, typename Sem>
+void* threadpool<T, Queue, Sem>::worker(void* arg) {
     threadpool* pool = (threadpool*) arg;
     pool->run();
     return pool;
 }
 
-template<typename T>
-void threadpool<T>::run()
+template<typename T, typename Queue, typename Sem>
+void threadpool<T, Queue, Sem>::run()
 {
-    while(!m_stop)    // ?????????????????????
+    int index = m_next_index++;     // the index of this worker
+    if(!m_cpus.empty() && !topology::pin_thread(m_cpus[index])) {
+        WARN_LOG("fail to pin worker %d to CPU %d", index, m_cpus[index]);
+    }
+#ifdef LOCK_STATS
+    uint64_t idle_since = current_ns();
+#endif
+
+    while(!m_stop)
     {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if(m_workqueue.empty())
-        {
-            m_queuelocker.unlock();
-            continue;
+        T* request = NULL;
+        bool got = false;
+
+        // poll the queue for a while before going to sleep,
+        // the first half of the time without stealing from the other workers
+        for(int i = 0; i < SPIN_COUNT && !got; i++) {
+            got = m_workqueue.pop(index, request, i >= SPIN_COUNT / 2);
+            if(!got) {
+                cpu_relax();
+            }
         }
 
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
+        if(!got) {
+            // announce that we are going to park, then look one last time
+            m_idle++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            got = m_workqueue.pop(index, request, true);
+            if(!got) {
+                m_queuestat.wait();
+                continue;
+            }
+
+            // no need to park anymore. If a producer already consumed our token, its post
+            // only causes one spurious wake-up later on
+            int idle = m_idle.load();
+            while(idle > 0 && !m_idle.compare_exchange_weak(idle, idle - 1)) {
+            }
+        }
 
         if(!request) {
             continue;
         }
+#ifdef LOCK_STATS
+        m_stats->popped();
+        // busy until the end of this iteration, whether the request is dropped, shed or processed
+        lock_stats::busy_scope busy(m_stats, index, idle_since);
+#endif
 
+        uint64_t now = current_us();
+        uint64_t sojourn = now - request->enqueue_time();
+        // a request that waited long enough for its client to give up: check before doing the work
+        if(sojourn > m_codel.target() && request->hung_up()) {
+            request->drop();
+            continue;
+        }
+        if(m_codel.shed(sojourn, now)) {
+            request->shed();
+            continue;
+        }
         request->process();
     }
 }
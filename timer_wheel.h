@@ -0,0 +1,165 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <time.h>
+
+// current time of the monotonic clock in milliseconds
+// the coarse clock is read from the vDSO without a syscall, its resolution (a few ms) is plenty for idle timeouts
+inline uint64_t current_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+    A timer embedded in the object it belongs to (e.g. http_conn), so arming a timer never allocates.
+    While armed, the timer is linked into one slot list of a timer_wheel.
+*/
+class wheel_timer {
+public:
+    wheel_timer() : expire(0), cb_func(NULL), user_data(NULL), prev(NULL), next(NULL) {}
+
+    bool pending() const { return next != NULL; }  // whether the timer is armed
+
+public:
+    uint64_t expire;                // expiration time, absolute, in milliseconds of current_ms()
+    void (*cb_func)(void*);         // called with 'user_data' when the timer expires
+    void* user_data;
+    wheel_timer* prev;              // neighbours in the slot list, NULL when not armed
+    wheel_timer* next;
+};
+
+/*
+    Hierarchical timing wheel (the cascading design of the classic Linux kernel timers).
+
+    Time advances in ticks of 'tick_ms' milliseconds. Level 0 has one slot per tick for the next
+    64 ticks; every slot of level 1 covers 64 ticks, of level 2 64*64 ticks, and so on. A timer is
+    put in the slot of the coarsest level that still resolves its expiration, and whenever level 0
+    wraps around, the next slot of level 1 is cascaded (its timers are redistributed to level 0),
+    and so on up the levels.
+
+    add_timer, del_timer and adjust_timer are O(1); tick() does O(1) work per elapsed tick plus the
+    work of the expired and cascaded timers. Timers more than 64^4 ticks away are clamped.
+    Not thread safe: a wheel belongs to one reactor.
+*/
+class timer_wheel {
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+
+    timer_wheel(uint64_t tick_ms, uint64_t now_ms) : m_tick_ms(tick_ms), m_current(now_ms / tick_ms) {
+        for(int level = 0; level < LEVELS; level++) {
+            for(int i = 0; i < SLOTS; i++) {
+                m_slots[level][i].prev = m_slots[level][i].next = &m_slots[level][i];
+            }
+        }
+    }
+
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    // arm 'timer', which must not be armed already
+    void add_timer(wheel_timer* timer) {
+        if(!timer) {
+            return;
+        }
+        uint64_t expire = timer->expire / m_tick_ms;
+        // an expiration in the past fires on the next tick
+        if(expire < m_current) {
+            expire = m_current;
+        }
+        uint64_t delta = expire - m_current;
+
+        wheel_timer* slot;
+        if(delta < (1ULL << SLOT_BITS)) {
+            slot = &m_slots[0][expire & SLOT_MASK];
+        } else if(delta < (1ULL << (2 * SLOT_BITS))) {
+            slot = &m_slots[1][(expire >> SLOT_BITS) & SLOT_MASK];
+        } else if(delta < (1ULL << (3 * SLOT_BITS))) {
+            slot = &m_slots[2][(expire >> (2 * SLOT_BITS)) & SLOT_MASK];
+        } else {
+            if(delta >= (1ULL << (4 * SLOT_BITS))) {
+                expire = m_current + (1ULL << (4 * SLOT_BITS)) - 1;
+            }
+            slot = &m_slots[3][(expire >> (3 * SLOT_BITS)) & SLOT_MASK];
+        }
+
+        // append to the slot list
+        timer->prev = slot->prev;
+        timer->next = slot;
+        slot->prev->next = timer;
+        slot->prev = timer;
+    }
+
+    // disarm 'timer', nothing happens if it is not armed
+    void del_timer(wheel_timer* timer) {
+        if(!timer || !timer->pending()) {
+            return;
+        }
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = NULL;
+    }
+
+    // re-arm 'timer' after its 'expire' changed
+    void adjust_timer(wheel_timer* timer) {
+        del_timer(timer);
+        add_timer(timer);
+    }
+
+    // run the timers that expired up to 'now_ms'
+    void tick(uint64_t now_ms) {
+        uint64_t target = now_ms / m_tick_ms;
+        while(m_current <= target) {
+            int index = m_current & SLOT_MASK;
+            // level 0 wrapped around: pull the next slot of the upper level down, and so on
+            for(int level = 1; index == 0 && level < LEVELS; level++) {
+                index = (m_current >> (level * SLOT_BITS)) & SLOT_MASK;
+                cascade(level, index);
+            }
+
+            // detach the expired list first, callbacks may add or delete other timers
+            wheel_timer* slot = &m_slots[0][m_current & SLOT_MASK];
+            m_current++;
+            if(slot->next == slot) {
+                continue;
+            }
+            wheel_timer expired;
+            expired.next = slot->next;
+            expired.prev = slot->prev;
+            expired.next->prev = &expired;
+            expired.prev->next = &expired;
+            slot->next = slot->prev = slot;
+
+            while(expired.next != &expired) {
+                wheel_timer* timer = expired.next;
+                del_timer(timer);
+                timer->cb_func(timer->user_data);
+            }
+        }
+    }
+
+private:
+    // move the timers of slot 'index' at 'level' to the lower levels
+    void cascade(int level, int index) {
+        wheel_timer* slot = &m_slots[level][index];
+        wheel_timer* timer = slot->next;
+        slot->next = slot->prev = slot;
+        while(timer != slot) {
+            wheel_timer* next = timer->next;
+            timer->prev = timer->next = NULL;
+            add_timer(timer);
+            timer = next;
+        }
+    }
+
+private:
+    uint64_t m_tick_ms;                     // length of a tick in milliseconds
+    uint64_t m_current;                     // the next tick to run
+    wheel_timer m_slots[LEVELS][SLOTS];     // slot lists, each slot is the head of a circular list
+};
+
+#endif
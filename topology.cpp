@@ -0,0 +1,218 @@
+#include "topology.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <algorithm>
+
+// the first line of a sysfs or procfs file, false if it cannot be read
+static bool read_line(const char* path, char* buf, size_t size) {
+    FILE* f = fopen(path, "r");
+    if(!f) {
+        return false;
+    }
+    bool ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+// the CPU list in file 'path', empty if it cannot be read
+static std::vector<int> read_cpulist(const char* path) {
+    char line[4096];
+    std::vector<int> cpus;
+    if(!read_line(path, line, sizeof(line)) || !topology::parse_cpulist(line, cpus)) {
+        cpus.clear();
+    }
+    return cpus;
+}
+
+static bool contains(const std::vector<int>& v, int x) {
+    return std::find(v.begin(), v.end(), x) != v.end();
+}
+
+bool topology::parse_cpulist(const char* text, std::vector<int>& cpus) {
+    const char* p = text;
+    while(*p && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if(*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if(end == p + 1 || last < first) {
+                return false;
+            }
+            p = end;
+        }
+        for(long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back((int)cpu);
+        }
+        if(*p == ',') {
+            p++;
+        } else if(*p && *p != '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+topology::topology() {
+    std::vector<int> online = read_cpulist("/sys/devices/system/cpu/online");
+    cpu_set_t allowed;
+    bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    for(int cpu : online) {
+        if(!have_mask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+            m_cpus.push_back(cpu);
+        }
+    }
+    if(m_cpus.empty()) {
+        // no sysfs: at least the CPU we run on
+        int cpu = sched_getcpu();
+        m_cpus.push_back(cpu < 0 ? 0 : cpu);
+    }
+
+    std::vector<int> nodes = read_cpulist("/sys/devices/system/node/online");
+    for(int node : nodes) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        std::vector<int> cpus;
+        for(int cpu : read_cpulist(path)) {
+            if(contains(m_cpus, cpu)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if(!cpus.empty()) {
+            m_node_cpus.push_back(cpus);
+        }
+    }
+    if(m_node_cpus.empty()) {
+        m_node_cpus.push_back(m_cpus);
+    }
+}
+
+int topology::node_of(int cpu) const {
+    for(size_t i = 0; i < m_node_cpus.size(); i++) {
+        if(contains(m_node_cpus[i], cpu)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+std::vector<int> topology::nic_cpus(const char* ifname) const {
+    std::vector<int> cpus;
+    char path[256];
+
+    // the CPUs the interrupts of the card are routed to: one per queue on a multiqueue card
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", ifname);
+    DIR* dir = opendir(path);
+    if(dir) {
+        struct dirent* d;
+        while((d = readdir(dir)) != NULL) {
+            if(d->d_name[0] < '0' || d->d_name[0] > '9') {
+                continue;
+            }
+            int number = atoi(d->d_name);
+            snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", number);
+            std::vector<int> irq = read_cpulist(path);
+            if(irq.empty()) {
+                snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", number);
+                irq = read_cpulist(path);
+            }
+            for(int cpu : irq) {
+                if(contains(m_cpus, cpu) && !contains(cpus, cpu)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        closedir(dir);
+    }
+
+    // then the rest of the card's node
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/local_cpulist", ifname);
+    for(int cpu : read_cpulist(path)) {
+        if(contains(m_cpus, cpu) && !contains(cpus, cpu)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+topology::placement topology::plan(int reactors, const char* ifname) const {
+    // the CPUs for the reactors, best first: near the card, then the nodes in turn
+    std::vector<int> order;
+    if(ifname) {
+        order = nic_cpus(ifname);
+    }
+    size_t longest = 0;
+    for(const std::vector<int>& cpus : m_node_cpus) {
+        longest = std::max(longest, cpus.size());
+    }
+    for(size_t i = 0; i < longest; i++) {
+        for(const std::vector<int>& cpus : m_node_cpus) {
+            if(i < cpus.size() && !contains(order, cpus[i])) {
+                order.push_back(cpus[i]);
+            }
+        }
+    }
+
+    placement p;
+    for(int i = 0; i < reactors; i++) {
+        p.reactor_cpus.push_back(order[i % order.size()]);
+    }
+
+    // one worker per CPU left over, at least one per node
+    for(const std::vector<int>& cpus : m_node_cpus) {
+        size_t before = p.worker_cpus.size();
+        for(int cpu : cpus) {
+            if(!contains(p.reactor_cpus, cpu)) {
+                p.worker_cpus.push_back(cpu);
+            }
+        }
+        if(p.worker_cpus.size() == before) {
+            p.worker_cpus.push_back(cpus.back());
+        }
+    }
+    return p;
+}
+
+std::vector<struct sock_filter> topology::steering_program(const std::vector<int>& reactor_cpus) const {
+    // a program holds at most BPF_MAXINSNS instructions: 2 per CPU, 3 for the rest
+    const size_t MAX_CPUS = (BPF_MAXINSNS - 3) / 2;
+    int reactors = (int)reactor_cpus.size();
+
+    std::vector<struct sock_filter> program;
+    program.push_back((struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (unsigned)(SKF_AD_OFF + SKF_AD_CPU)));
+    for(size_t i = 0; i < m_cpus.size() && i < MAX_CPUS; i++) {
+        int cpu = m_cpus[i];
+        int target = -1;
+        for(int r = 0; r < reactors && target < 0; r++) {
+            if(reactor_cpus[r] == cpu) {
+                target = r;
+            }
+        }
+        if(target < 0) {
+            // spread the CPUs of a node over the reactors of that node
+            int node = node_of(cpu);
+            std::vector<int> local;
+            for(int r = 0; r < reactors; r++) {
+                if(node_of(reactor_cpus[r]) == node) {
+                    local.push_back(r);
+                }
+            }
+            if(!local.empty()) {
+                target = local[i % local.size()];
+            }
+        }
+        if(target >= 0) {
+            program.push_back((struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned)cpu, 0, 1));
+            program.push_back((struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (unsigned)target));
+        }
+    }
+    program.push_back((struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned)reactors));
+    program.push_back((struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0));
+    return program;
+}
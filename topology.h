@@ -0,0 +1,94 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <vector>
+
+/*
+    The CPUs and NUMA nodes of the machine, read from sysfs, and the placement of the server's
+    threads on them (-p).
+
+    Only the CPUs the process may run on count (its affinity mask, e.g. under taskset or in a
+    container). Without NUMA support in the kernel, every CPU belongs to node 0.
+
+    plan() places
+        - the reactors first on the CPUs the interrupts of the network card are routed to, then on
+          the other CPUs of the card's node, then on the other nodes, so the kernel's receive
+          processing and the reactor accepting and reading the connection share a cache
+        - the workers on the CPUs of every node left over by the reactors, one per CPU; a node whose
+          every CPU runs a reactor still gets one worker, sharing a reactor's CPU
+    and steering_program() builds the SO_ATTACH_REUSEPORT_CBPF program that hands a new connection
+    to the reactor pinned to the CPU that received it (or one of the same node).
+
+    A pinned thread records its node: the memory it carves out of the per-node buffer pools
+    (http_conn::m_buffer_pools) is first touched, and so placed by the kernel, on that node.
+*/
+class topology {
+public:
+    static const int MAX_NODES = 16;    // nodes beyond are folded onto these, for the per-node pools
+
+    struct placement {
+        std::vector<int> reactor_cpus;  // the CPU of every reactor
+        std::vector<int> worker_cpus;   // the CPU of every worker, their number is the pool size
+    };
+
+    topology();
+
+    int cpu_count() const { return (int)m_cpus.size(); }
+    int node_count() const { return (int)m_node_cpus.size(); }
+    const std::vector<int>& cpus() const { return m_cpus; }
+    const std::vector<int>& node_cpus(int node) const { return m_node_cpus[node]; }
+    int node_of(int cpu) const;   // the index in node_cpus() of the node of 'cpu', -1 if unknown
+
+    /*
+        The CPUs of network interface 'ifname', best first: those its interrupts are routed to, then
+        the rest of its node. Empty if the interface is unknown or not backed by a device (lo, veth).
+    */
+    std::vector<int> nic_cpus(const char* ifname) const;
+
+    // 'reactors' reactors and their workers, near the network card 'ifname' if not NULL
+    placement plan(int reactors, const char* ifname) const;
+
+    /*
+        A classic BPF program for SO_ATTACH_REUSEPORT_CBPF: it returns, for the CPU processing the
+        SYN, the index of the reactor pinned to it, else a reactor of the same node, else the CPU
+        modulo the number of reactors. The index is the position of the listening socket in the
+        SO_REUSEPORT group, the order the reactors listened in.
+    */
+    std::vector<struct sock_filter> steering_program(const std::vector<int>& reactor_cpus) const;
+
+    // pin the calling thread to 'cpu' and remember its node, false on failure
+    static bool pin_thread(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            return false;
+        }
+        // the thread now runs on 'cpu', getcpu() tells its node
+        unsigned int running, node;
+        if(getcpu(&running, &node) == 0) {
+            thread_node() = node % MAX_NODES;
+        }
+        return true;
+    }
+
+    // the node of the calling thread if it was pinned, 0 otherwise
+    static int current_node() { return thread_node(); }
+
+    // parse a sysfs CPU list such as "0-3,8-11", false if it is malformed
+    static bool parse_cpulist(const char* text, std::vector<int>& cpus);
+
+private:
+    static int& thread_node() {
+        static thread_local int node = 0;
+        return node;
+    }
+
+    std::vector<int> m_cpus;                    // the CPUs available to the process
+    std::vector<std::vector<int>> m_node_cpus;  // the same, by node; nodes without any are left out
+};
+
+#endif
@@ -0,0 +1,190 @@
+#include "uring.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <exception>
+
+static int io_uring_setup(unsigned entries, io_uring_params* p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring::uring(unsigned entries, unsigned buffer_count, unsigned buffer_size)
+    : m_fd(-1), m_sq_ring(MAP_FAILED), m_sq_ring_size(0), m_sqes(NULL), m_sqes_size(0), m_sqe_tail(0),
+      m_cq_ring(MAP_FAILED), m_cq_ring_size(0), m_buf_ring(NULL), m_buf_ring_size(0), m_buf_mask(buffer_count - 1),
+      m_buf_tail(0), m_buffers(NULL), m_buffer_count(buffer_count), m_buffer_size(buffer_size) {
+    // the provided buffer ring must be a power of two, and buffer ids are 16 bits
+    if(buffer_count == 0 || (buffer_count & (buffer_count - 1)) || buffer_count > 32768) {
+        throw std::exception();
+    }
+
+    /*
+        Only this thread submits (SINGLE_ISSUER), and completions are only needed when it waits for
+        them (DEFER_TASKRUN): the kernel then runs the completion work in io_uring_enter instead of
+        interrupting the thread. Older kernels do not have these flags, retry without them.
+        The completion ring is larger than the submission ring, multishot operations post many
+        completions for one submission.
+    */
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4;
+    m_fd = io_uring_setup(entries, &p);
+    if(m_fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        m_fd = io_uring_setup(entries, &p);
+    }
+    if(m_fd < 0) {
+        throw std::exception();
+    }
+
+    // map the rings, in one mapping if the kernel allows it
+    m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap && m_cq_ring_size > m_sq_ring_size) {
+        m_sq_ring_size = m_cq_ring_size;
+    }
+    m_sq_ring = mmap(NULL, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sq_ring == MAP_FAILED) {
+        destroy();
+        throw std::exception();
+    }
+    if(single_mmap) {
+        m_cq_ring = m_sq_ring;
+    } else {
+        m_cq_ring = mmap(NULL, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if(m_cq_ring == MAP_FAILED) {
+            destroy();
+            throw std::exception();
+        }
+    }
+    m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        destroy();
+        throw std::exception();
+    }
+    m_sqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)m_sq_ring;
+    m_sq_head = (unsigned*)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    m_sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    m_sq_array = (unsigned*)(sq + p.sq_off.array);
+    m_sqe_tail = *m_sq_tail;
+    // entry i of the ring is always sqe i, the array never changes afterwards
+    for(unsigned i = 0; i < p.sq_entries; i++) {
+        m_sq_array[i] = i;
+    }
+
+    char* cq = (char*)m_cq_ring;
+    m_cq_head = (unsigned*)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    m_cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // the provided buffer ring and the buffers it hands out
+    m_buf_ring_size = buffer_count * sizeof(io_uring_buf);
+    void* buf_ring = mmap(NULL, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf_ring == MAP_FAILED) {
+        destroy();
+        throw std::exception();
+    }
+    m_buf_ring = (io_uring_buf_ring*)buf_ring;
+    // fault the pages in before the kernel pins them, it would not see our writes to a zero page
+    memset(m_buf_ring, 0, m_buf_ring_size);
+    m_buffers = (char*)mmap(NULL, (size_t)buffer_count * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m_buffers == MAP_FAILED) {
+        m_buffers = NULL;
+        destroy();
+        throw std::exception();
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)m_buf_ring;
+    reg.ring_entries = buffer_count;
+    reg.bgid = BUFFER_GROUP;
+    if(io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        destroy();
+        throw std::exception();
+    }
+    for(unsigned i = 0; i < buffer_count; i++) {
+        recycle(i);
+    }
+}
+
+uring::~uring() {
+    destroy();
+}
+
+void uring::destroy() {
+    if(m_buffers) {
+        munmap(m_buffers, (size_t)m_buffer_count * m_buffer_size);
+    }
+    if(m_buf_ring) {
+        munmap(m_buf_ring, m_buf_ring_size);
+    }
+    if(m_sqes) {
+        munmap(m_sqes, m_sqes_size);
+    }
+    if(m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring) {
+        munmap(m_cq_ring, m_cq_ring_size);
+    }
+    if(m_sq_ring != MAP_FAILED) {
+        munmap(m_sq_ring, m_sq_ring_size);
+    }
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+io_uring_sqe* uring::get_sqe() {
+    unsigned entries = m_sq_mask + 1;
+    if(m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= entries) {
+        // full: hand what we have to the kernel, it frees the entries as it consumes them
+        submit(0);
+        if(m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= entries) {
+            return NULL;
+        }
+    }
+    io_uring_sqe* sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqe_tail++;
+    return sqe;
+}
+
+int uring::submit(unsigned wait) {
+    unsigned to_submit = m_sqe_tail - *m_sq_tail;
+    __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = io_uring_enter(m_fd, to_submit, wait, IORING_ENTER_GETEVENTS);
+    } while(ret < 0 && errno == EINTR);
+    return ret;
+}
+
+void uring::recycle(unsigned id) {
+    /*
+        The entries start at the ring itself (the tail overlays a reserved field of the first one).
+        Not through m_buf_ring->bufs: in C++ the empty struct the uapi header puts before it has a
+        size, which moves the array by 8 bytes.
+    */
+    io_uring_buf* buf = (io_uring_buf*)m_buf_ring + (m_buf_tail & m_buf_mask);
+    buf->addr = (unsigned long)buffer(id);
+    buf->len = m_buffer_size;
+    buf->bid = id;
+    m_buf_tail++;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,86 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/*
+    A minimal io_uring, on the raw system calls (no liburing).
+
+    The submission and completion rings are shared with the kernel through mmap. get_sqe() hands
+    out the next free submission entry; the entries are only passed to the kernel by submit(), so
+    every operation prepared during one pass of the event loop goes in a single io_uring_enter,
+    which also waits for the next completions. Completions are read with peek() / advance().
+
+    A provided buffer ring (add_buffers) is a pool of receive buffers registered with the kernel:
+    a recv with IOSQE_BUFFER_SELECT takes a buffer from it when data arrives instead of having one
+    reserved per connection, and recycle() gives the buffer back once its data is consumed.
+
+    A ring is used by a single thread.
+*/
+class uring {
+public:
+    // throws std::exception if the kernel does not support io_uring or the features we use
+    uring(unsigned entries, unsigned buffer_count, unsigned buffer_size);
+    ~uring();
+
+    // the next free submission entry, zeroed; NULL only if the submission ring is full even after submitting
+    io_uring_sqe* get_sqe();
+    // pass the prepared entries to the kernel and wait for at least 'wait' completions
+    int submit(unsigned wait);
+
+    // the oldest completion not consumed yet, NULL if none
+    io_uring_cqe* peek() {
+        unsigned head = *m_cq_head;
+        if(head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        return &m_cqes[head & m_cq_mask];
+    }
+    // consume the completion returned by peek()
+    void advance() {
+        __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    // provided buffers: group BUFFER_GROUP of this ring
+    static const unsigned BUFFER_GROUP = 0;
+    char* buffer(unsigned id) const { return m_buffers + (size_t)id * m_buffer_size; }
+    unsigned buffer_size() const { return m_buffer_size; }
+    // give buffer 'id' back to the kernel
+    void recycle(unsigned id);
+
+private:
+    int m_fd;
+
+    // submission ring
+    void* m_sq_ring;
+    size_t m_sq_ring_size;
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned m_sq_mask;
+    unsigned* m_sq_array;
+    io_uring_sqe* m_sqes;
+    size_t m_sqes_size;
+    unsigned m_sqe_tail;            // entries handed out by get_sqe(), published by submit()
+
+    // completion ring
+    void* m_cq_ring;
+    size_t m_cq_ring_size;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+
+    // provided buffer ring
+    io_uring_buf_ring* m_buf_ring;
+    size_t m_buf_ring_size;
+    unsigned m_buf_mask;
+    unsigned short m_buf_tail;      // the entries given to the kernel so far, wraps around like the kernel's
+    char* m_buffers;
+    unsigned m_buffer_count;
+    unsigned m_buffer_size;
+
+    void destroy();
+};
+
+#endif
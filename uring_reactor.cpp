@@ -0,0 +1,412 @@
+#include "uring_reactor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <exception>
+#include "log.h"
+
+// what a completion is for: the operation in the top byte of user_data, then the generation and the fd
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_TIMER, OP_CANCEL };
+
+static inline uint64_t make_tag(int op, uint32_t generation, int fd) {
+    return ((uint64_t)op << 56) | ((uint64_t)(generation & 0xffffff) << 32) | (uint32_t)fd;
+}
+
+uring_reactor::uring_reactor(int listenfd, int timerfd, timer_wheel* wheel, void (*tick)(timer_wheel*),
+                             http_conn* users, int max_fd)
+    : m_listenfd(listenfd), m_timerfd(timerfd), m_wheel(wheel), m_tick(tick), m_users(users), m_max_fd(max_fd),
+      m_ring(NULL) {
+    // calloc: the pages of the fds we never see are never touched
+    m_conns = (connection*)calloc(max_fd, sizeof(connection));
+    if(!m_conns) {
+        throw std::exception();
+    }
+}
+
+uring_reactor::~uring_reactor() {
+    free(m_conns);
+}
+
+/*
+    A ring with a provided buffer ring only needs 5.19, multishot recv came with 6.0: an older
+    kernel takes the ring and then fails every recv with -EINVAL. So arm one multishot recv on a
+    socketpair, as arm_recv() does, and check it completes with data and stays armed.
+*/
+bool uring_reactor::supported() {
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        return false;
+    }
+    bool ok = false;
+    try {
+        uring probe(8, 1, BUFFER_SIZE);
+        io_uring_sqe* sqe = probe.get_sqe();
+        if(sqe && write(fds[1], "x", 1) == 1) {
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = fds[0];
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = uring::BUFFER_GROUP;
+            if(probe.submit(1) >= 0) {
+                io_uring_cqe* cqe = probe.peek();
+                ok = cqe && cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+            }
+        }
+    } catch(...) {
+        ok = false;
+    }
+    // the recv still armed goes away with the ring
+    close(fds[0]);
+    close(fds[1]);
+    return ok;
+}
+
+// a submission entry for operation 'op' on 'fd', tagged with the generation of the connection
+io_uring_sqe* uring_reactor::get_sqe(int op, int fd) {
+    io_uring_sqe* sqe = m_ring->get_sqe();
+    if(sqe) {
+        sqe->user_data = make_tag(op, fd >= 0 ? m_conns[fd].generation : 0, fd);
+    }
+    return sqe;
+}
+
+void uring_reactor::arm_accept() {
+    io_uring_sqe* sqe = get_sqe(OP_ACCEPT, -1);
+    if(!sqe) {
+        ERROR_LOG("io_uring: cannot queue accept");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uring_reactor::arm_timer() {
+    io_uring_sqe* sqe = get_sqe(OP_TIMER, -1);
+    if(!sqe) {
+        ERROR_LOG("io_uring: cannot queue the timer");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = m_timerfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void uring_reactor::arm_recv(int fd) {
+    io_uring_sqe* sqe = get_sqe(OP_RECV, fd);
+    if(!sqe) {
+        begin_close(fd);
+        return;
+    }
+    // no buffer of our own: the kernel picks one of the provided buffer ring when data arrives
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = uring::BUFFER_GROUP;
+    m_conns[fd].recv_armed = true;
+}
+
+// cancel the operation 'op' of the connection on 'fd', it completes with -ECANCELED
+void uring_reactor::cancel(int op, int fd) {
+    io_uring_sqe* sqe = get_sqe(OP_CANCEL, fd);
+    if(!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = make_tag(op, m_conns[fd].generation, fd);
+}
+
+// send the blocks of the batch not sent yet
+void uring_reactor::send(int fd) {
+    connection& c = m_conns[fd];
+    struct iovec* iov;
+    int count = m_users[fd].send_blocks(&iov);
+    io_uring_sqe* sqe = get_sqe(OP_SEND, fd);
+    if(!sqe) {
+        begin_close(fd);
+        return;
+    }
+    memset(&c.msg, 0, sizeof(c.msg));
+    c.msg.msg_iov = iov;
+    c.msg.msg_iovlen = count;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&c.msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    c.sending = true;
+}
+
+void uring_reactor::run() {
+    try {
+        m_ring = new uring(ENTRIES, BUFFER_COUNT, BUFFER_SIZE);
+    } catch(...) {
+        ERROR_LOG("io_uring: cannot create the ring");
+        return;
+    }
+    arm_accept();
+    arm_timer();
+
+    while(true) {
+        // submit everything prepared in the last round, wait for the next completion
+        if(m_ring->submit(1) < 0 && errno != EBUSY && errno != EAGAIN) {
+            ERROR_LOG("io_uring failure");
+            break;
+        }
+
+        io_uring_cqe* cqe;
+        while((cqe = m_ring->peek()) != NULL) {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            m_ring->advance();
+
+            int op = tag >> 56;
+            int fd = (int)(uint32_t)tag;
+            uint32_t generation = (tag >> 32) & 0xffffff;
+            if(op != OP_ACCEPT && op != OP_TIMER && generation != (m_conns[fd].generation & 0xffffff)) {
+                // cannot happen: the fd of a connection is only closed once its operations completed
+                continue;
+            }
+            switch(op) {
+                case OP_ACCEPT:
+                    on_accept(res, flags);
+                    break;
+                case OP_RECV:
+                    on_recv(fd, res, flags);
+                    break;
+                case OP_SEND:
+                    on_send(fd, res);
+                    break;
+                case OP_TIMER:
+                    on_timer(flags);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    delete m_ring;
+    m_ring = NULL;
+}
+
+void uring_reactor::on_accept(int res, unsigned flags) {
+    // the multishot accept stopped (an error, or the kernel ran short of something): queue a new one
+    if(!(flags & IORING_CQE_F_MORE)) {
+        arm_accept();
+    }
+    if(res < 0) {
+        return;
+    }
+    int connfd = res;
+    // current connections reach the upper bound: tell the client the server is busy
+    if(connfd >= m_max_fd) {
+        http_conn::reject(connfd);
+        return;
+    }
+    // a multishot accept cannot return the address of each client
+    struct sockaddr_in client_address;
+    socklen_t client_addrlen = sizeof(client_address);
+    if(getpeername(connfd, (struct sockaddr*)&client_address, &client_addrlen) != 0) {
+        memset(&client_address, 0, sizeof(client_address));
+    }
+
+    connection& c = m_conns[connfd];
+    c.generation++;
+    c.recv_armed = false;
+    c.sending = false;
+    c.closing = false;
+    c.throttled = false;
+    c.overflow_len = 0;
+    m_users[connfd].init(connfd, client_address, -1, m_wheel);
+    arm_recv(connfd);
+}
+
+void uring_reactor::on_recv(int fd, int res, unsigned flags) {
+    connection& c = m_conns[fd];
+    if(!(flags & IORING_CQE_F_MORE)) {
+        c.recv_armed = false;
+    }
+
+    if(res > 0) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(!c.closing) {
+            m_users[fd].refresh_timer();
+            deliver(fd, m_ring->buffer(id), res);
+        }
+        m_ring->recycle(id);
+    } else if(res == -ENOBUFS || res == -ECANCELED) {
+        /*
+            ENOBUFS: every provided buffer was in use, nothing was lost, they are recycled by now.
+            ECANCELED: we throttled the connection, or are closing it.
+        */
+    } else {
+        // 0: the client closed the connection, or the idle timer shut it down; < 0: an error
+        begin_close(fd);
+    }
+
+    if(c.closing) {
+        finish_close(fd);
+    } else if(!c.recv_armed && !c.throttled) {
+        arm_recv(fd);
+    }
+}
+
+void uring_reactor::on_send(int fd, int res) {
+    connection& c = m_conns[fd];
+    c.sending = false;
+    if(c.closing) {
+        finish_close(fd);
+        return;
+    }
+    if(res < 0) {
+        begin_close(fd);
+        return;
+    }
+    http_conn& user = m_users[fd];
+    user.refresh_timer();
+    if(!user.sent(res)) {
+        // a short send, the rest of the batch goes next
+        send(fd);
+        return;
+    }
+    if(!user.end_batch()) {
+        begin_close(fd);
+        return;
+    }
+    // requests may have arrived, or been left over by a batch cut short, while it was sent
+    process(fd);
+}
+
+void uring_reactor::on_timer(unsigned flags) {
+    uint64_t expirations;
+    while(read(m_timerfd, &expirations, sizeof(expirations)) > 0) {
+    }
+    m_tick(m_wheel);
+    if(!(flags & IORING_CQE_F_MORE)) {
+        arm_timer();
+    }
+}
+
+// bytes received on 'fd': into the read buffer, or held back if it has no room for them yet
+void uring_reactor::deliver(int fd, const char* data, int len) {
+    connection& c = m_conns[fd];
+    // bytes already held back come first
+    if(c.overflow_len == 0) {
+        int taken = m_users[fd].receive(data, len);
+        if(taken < 0) {
+            begin_close(fd);
+            return;
+        }
+        data += taken;
+        len -= taken;
+    }
+    if(len > 0) {
+        if(!hold_back(c, data, len)) {
+            begin_close(fd);
+            return;
+        }
+        /*
+            With epoll, the unread bytes stay in the socket and TCP slows the client down. The
+            multishot recv would keep delivering them: stop it until the held back bytes are used.
+        */
+        if(!c.throttled) {
+            c.throttled = true;
+            if(c.recv_armed) {
+                cancel(OP_RECV, fd);
+            }
+        }
+    }
+    if(!c.sending) {
+        process(fd);
+    }
+}
+
+bool uring_reactor::hold_back(connection& c, const char* data, int len) {
+    if(c.overflow_len + len > c.overflow_size) {
+        int size = c.overflow_size ? c.overflow_size : BUFFER_SIZE;
+        while(size < c.overflow_len + len) {
+            size *= 2;
+        }
+        char* overflow = (char*)realloc(c.overflow, size);
+        if(!overflow) {
+            return false;
+        }
+        c.overflow = overflow;
+        c.overflow_size = size;
+    }
+    memcpy(c.overflow + c.overflow_len, data, len);
+    c.overflow_len += len;
+    return true;
+}
+
+// answer the complete requests in the read buffer, feeding it the held back bytes as room is made
+void uring_reactor::process(int fd) {
+    connection& c = m_conns[fd];
+    http_conn& user = m_users[fd];
+    while(!c.closing) {
+        if(!user.process_requests()) {
+            begin_close(fd);
+            return;
+        }
+        if(user.has_replies()) {
+            send(fd);
+            return;
+        }
+        if(c.overflow_len == 0) {
+            break;
+        }
+        int taken = user.receive(c.overflow, c.overflow_len);
+        if(taken <= 0) {
+            // a single request larger than the largest read buffer
+            begin_close(fd);
+            return;
+        }
+        memmove(c.overflow, c.overflow + taken, c.overflow_len - taken);
+        c.overflow_len -= taken;
+    }
+    if(c.closing) {
+        return;
+    }
+    // everything held back is consumed, receive again
+    if(c.throttled && c.overflow_len == 0) {
+        c.throttled = false;
+        if(!c.recv_armed) {
+            arm_recv(fd);
+        }
+    }
+}
+
+// cancel what is in flight on 'fd', the connection is closed when the last of it completes
+void uring_reactor::begin_close(int fd) {
+    connection& c = m_conns[fd];
+    if(c.closing) {
+        return;
+    }
+    c.closing = true;
+    if(c.recv_armed) {
+        cancel(OP_RECV, fd);
+    }
+    if(c.sending) {
+        cancel(OP_SEND, fd);
+    }
+    finish_close(fd);
+}
+
+void uring_reactor::finish_close(int fd) {
+    connection& c = m_conns[fd];
+    if(!c.closing || c.recv_armed || c.sending) {
+        return;
+    }
+    free(c.overflow);
+    c.overflow = NULL;
+    c.overflow_len = 0;
+    c.overflow_size = 0;
+    // 'closing' stays set until the fd is accepted again, nothing is queued for it anymore
+    m_users[fd].close_conn();
+}
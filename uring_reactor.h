@@ -0,0 +1,88 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "uring.h"
+#include "http_conn.h"
+#include "timer_wheel.h"
+
+/*
+    The event loop of a reactor on io_uring, the alternative to the epoll loop of main.cpp (-u).
+
+    Instead of a readiness notification followed by a system call per accept, recv, writev and
+    epoll_ctl re-arm, the reactor keeps operations queued in its ring:
+        - one multishot accept on its listening socket, completing once per new connection
+        - one multishot recv per connection, filling buffers of the provided buffer ring as data
+          arrives; the bytes are copied into the read buffer of the connection and the provided
+          buffer is recycled at once
+        - one sendmsg per batch of replies, with the iovecs write() would have passed to writev
+        - a multishot poll on the timerfd, for the idle timers
+    Everything prepared while handling a round of completions is submitted with the single
+    io_uring_enter that waits for the next round.
+
+    Requests are parsed and answered on the reactor thread with http_conn::process_requests():
+    handing them to the threadpool would need a wakeup of the reactor per batch, the very system
+    call this loop is meant to save. Run several reactors (-r) to use several cores.
+    Files are sent from their mappings, sendfile mode (-s) does not apply.
+
+    A connection is closed once none of its operations is in flight, since they use its buffers.
+*/
+class uring_reactor {
+public:
+    static const unsigned ENTRIES = 4096;          // submission ring size
+    static const unsigned BUFFER_COUNT = 4096;     // provided receive buffers
+    static const unsigned BUFFER_SIZE = 2048;      // bytes per provided buffer
+
+    uring_reactor(int listenfd, int timerfd, timer_wheel* wheel, void (*tick)(timer_wheel*), http_conn* users, int max_fd);
+    ~uring_reactor();
+
+    // whether the kernel has io_uring and the operations the loop needs (multishot recv, 6.0)
+    static bool supported();
+
+    // the event loop, the ring is created on the calling thread
+    void run();
+
+private:
+    // the state of a connection on this ring, indexed by file descriptor
+    struct connection {
+        struct msghdr msg;      // the sendmsg in flight
+        uint32_t generation;    // tells the operations of a new connection from those of a closed one on the same fd
+        bool recv_armed;        // the multishot recv is queued
+        bool sending;           // a sendmsg is in flight
+        bool closing;           // close once no operation is in flight
+        bool throttled;         // the recv was cancelled until 'overflow' is consumed
+        char* overflow;         // received bytes the read buffer had no room for yet, in order
+        int overflow_len;
+        int overflow_size;
+    };
+
+    io_uring_sqe* get_sqe(int op, int fd);
+    void arm_accept();
+    void arm_timer();
+    void arm_recv(int fd);
+    void cancel(int op, int fd);
+    void send(int fd);
+
+    void on_accept(int res, unsigned flags);
+    void on_recv(int fd, int res, unsigned flags);
+    void on_send(int fd, int res);
+    void on_timer(unsigned flags);
+
+    void deliver(int fd, const char* data, int len);
+    bool hold_back(connection& c, const char* data, int len);
+    void process(int fd);
+    void begin_close(int fd);
+    void finish_close(int fd);
+
+    int m_listenfd;
+    int m_timerfd;
+    timer_wheel* m_wheel;
+    void (*m_tick)(timer_wheel*);   // runs the idle timers and the periodic work of the reactor
+    http_conn* m_users;
+    int m_max_fd;
+    connection* m_conns;            // m_max_fd entries, only those of our connections are ever touched
+    uring* m_ring;
+};
+
+#endif
@@ -0,0 +1,686 @@
+/*
+ * Keep-alive mode of webbench (-k): persistent HTTP/1.1 connections driven by
+ * epoll, instead of a process and a new connection per request.
+ *
+ * Each of the -T threads runs its own epoll loop over its share of the -c
+ * connections. A connection keeps -P requests in flight (pipelining, 1 by
+ * default): a new request is sent as soon as a response is complete, so the
+ * load is closed-loop like the forking mode, only without the connection setup
+ * of every request. Connections closed by the server are opened again.
+ *
+ * With -R the load is open-loop instead: requests are due on a fixed schedule,
+ * -R per second in all, evenly spaced or with Poisson arrivals (--poisson),
+ * whatever the server does. A due request goes out on a connection with room
+ * for it, or waits in a backlog until one has room. Its latency is counted
+ * from the time it was due, not from the time it could be sent: a slow server
+ * is not allowed to slow the clients down and hide its tail (the coordinated
+ * omission of closed-loop tools). Requests not answered within KA_DRAIN_US of
+ * the end count as failed.
+ *
+ * The latency of a request is counted from the time it was queued for sending
+ * (or due) to the end of its response, in an HDR histogram per thread: every
+ * power of two of microseconds is split in 128 buckets, so a value is known
+ * to within 1% from 1 us to 19 hours. The histograms are merged at the end
+ * for the percentiles, and written out whole with -J for later comparison.
+ */
+
+#include <pthread.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <math.h>
+
+#define KA_MAX_PIPELINE 64
+#define KA_HEAD_SIZE 2048
+#define KA_READ_SIZE 65536
+#define KA_MAX_BACKLOG (1 << 22)                    /* due requests waiting for a connection, per thread */
+#define KA_DRAIN_US 2000000ULL                      /* how long the answers are waited for after the end */
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+/* latencies in microseconds */
+struct histogram
+{
+ unsigned long long counts[HIST_BUCKETS];
+ unsigned long long total;
+ unsigned long long max;
+ unsigned long long sum;
+};
+
+static int hist_bucket(unsigned long long value)
+{
+ int magnitude, shift;
+
+ if(value < HIST_SUB_BUCKETS) return (int)value;
+ magnitude = 63 - __builtin_clzll(value);
+ if(magnitude >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+ shift = magnitude - HIST_SUB_BITS;
+ return (shift + 1) * HIST_SUB_BUCKETS + (int)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+/* the largest value that falls in 'bucket' */
+static unsigned long long hist_bucket_top(int bucket)
+{
+ int shift;
+
+ if(bucket < HIST_SUB_BUCKETS) return bucket;
+ shift = bucket / HIST_SUB_BUCKETS - 1;
+ return (((unsigned long long)(bucket % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *h, unsigned long long value)
+{
+ h->counts[hist_bucket(value)]++;
+ h->total++;
+ h->sum += value;
+ if(value > h->max) h->max = value;
+}
+
+static void hist_merge(struct histogram *to, const struct histogram *from)
+{
+ int i;
+
+ for(i = 0; i < HIST_BUCKETS; i++) to->counts[i] += from->counts[i];
+ to->total += from->total;
+ to->sum += from->sum;
+ if(from->max > to->max) to->max = from->max;
+}
+
+/* the value below which 'percentile' % of the recorded values are */
+static unsigned long long hist_percentile(const struct histogram *h, double percentile)
+{
+ unsigned long long rank, seen = 0;
+ unsigned long long top;
+ int i;
+
+ if(h->total == 0) return 0;
+ rank = (unsigned long long)(percentile / 100.0 * h->total + 0.5);
+ if(rank == 0) rank = 1;
+ for(i = 0; i < HIST_BUCKETS; i++)
+ {
+  seen += h->counts[i];
+  if(seen >= rank)
+  {
+   top = hist_bucket_top(i);
+   return top < h->max ? top : h->max;
+  }
+ }
+ return h->max;
+}
+
+static unsigned long long now_us(void)
+{
+ struct timespec ts;
+
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+ return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct ka_conn
+{
+ int fd;
+ int connecting;
+ int inflight;                                      /* requests sent or queued, not answered yet */
+ unsigned long long sent_at[KA_MAX_PIPELINE];       /* queue times of those, oldest at 'first' */
+ int first;
+ int unsent;                                        /* bytes of queued requests not written yet */
+ long written;                                      /* bytes written in all, for the offset into the request */
+ char head[KA_HEAD_SIZE + 1];                       /* the header of the response being read */
+ int head_len;
+ long body_left;                                    /* -1 while the header is read */
+ int status;
+ int closing;                                       /* the server closes after this response */
+ int polling_out;                                   /* EPOLLOUT is in the interest set */
+ int ready;                                         /* open loop: in the list of connections with room */
+};
+
+struct ka_thread
+{
+ pthread_t thread;
+ int connections;
+ /* results */
+ long speed;
+ long failed;
+ long errors;                                       /* responses with a status of 400 or more */
+ long long bytes;
+ struct histogram latency;
+ /* open loop */
+ struct ka_conn **ready;                            /* connected, fewer than 'pipeline' requests in flight */
+ int ready_count;
+ unsigned long long *backlog;                       /* due times of the requests waiting for a connection */
+ size_t backlog_head, backlog_len, backlog_cap;
+ double next_due;
+ unsigned int seed;
+};
+
+static struct sockaddr_in ka_server;
+static char *ka_requests;                           /* the request 'pipeline' times in a row */
+static int ka_request_len;
+static int pipeline = 1;
+static int threads = 1;
+static int keepalive = 0;
+static double rate = 0;                             /* requests per second of the open loop, 0 for closed loop */
+static int poisson = 0;
+static const char *json_path = NULL;
+static const char *ka_url;
+static unsigned long long ka_start, ka_deadline;
+static int ka_pwait2 = 1;                           /* epoll_pwait2() works, for waits shorter than 1 ms */
+
+static int ka_open(struct ka_conn *c, int epfd)
+{
+ struct epoll_event ev;
+ int one = 1;
+
+ c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+ if(c->fd < 0) return -1;
+ setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+ if(connect(c->fd, (struct sockaddr *)&ka_server, sizeof(ka_server)) < 0 && errno != EINPROGRESS)
+ {
+  close(c->fd);
+  return -1;
+ }
+ c->connecting = 1;
+ c->inflight = 0;
+ c->first = 0;
+ c->unsent = 0;
+ c->written = 0;
+ c->head_len = 0;
+ c->body_left = -1;
+ c->closing = 0;
+ c->polling_out = 1;
+ ev.events = EPOLLIN | EPOLLOUT;
+ ev.data.ptr = c;
+ epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+ return 0;
+}
+
+/* queue requests until 'pipeline' are in flight */
+static void ka_queue(struct ka_conn *c)
+{
+ unsigned long long now = now_us();
+
+ while(c->inflight < pipeline)
+ {
+  c->sent_at[(c->first + c->inflight) % KA_MAX_PIPELINE] = now;
+  c->inflight++;
+  c->unsent += ka_request_len;
+ }
+}
+
+/* write what is queued; -1 if the connection failed */
+static int ka_flush(struct ka_conn *c, int epfd)
+{
+ struct epoll_event ev;
+ int n;
+
+ while(c->unsent > 0)
+ {
+  n = send(c->fd, ka_requests + c->written % ka_request_len, c->unsent, MSG_NOSIGNAL);
+  if(n < 0)
+  {
+   if(errno == EAGAIN) break;
+   return -1;
+  }
+  c->unsent -= n;
+  c->written += n;
+ }
+ /* wait for room only while something is left to write */
+ if(c->polling_out != (c->unsent > 0))
+ {
+  c->polling_out = c->unsent > 0;
+  ev.events = c->polling_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+ }
+ return 0;
+}
+
+/* the value of the header 'name' (with its colon) in 'head', NULL if absent */
+static const char *ka_header(const char *head, const char *name)
+{
+ size_t len = strlen(name);
+ const char *p;
+
+ for(p = strstr(head, "\r\n"); p != NULL; p = strstr(p + 2, "\r\n"))
+  if(strncasecmp(p + 2, name, len) == 0)
+   return p + 2 + len + strspn(p + 2 + len, " \t");
+ return NULL;
+}
+
+/*
+ * The header is complete: its status, length and whether the server closes.
+ * Answers to HEAD, 1xx, 204 and 304 have no body whatever Content-Length says.
+ */
+static void ka_parse_head(struct ka_conn *c)
+{
+ const char *p;
+
+ c->status = c->head_len > 12 ? atoi(c->head + 9) : 0;
+ p = ka_header(c->head, "Content-Length:");
+ if(method == METHOD_HEAD || (c->status >= 100 && c->status < 200) || c->status == 204 || c->status == 304)
+  c->body_left = 0;
+ else
+  c->body_left = p ? atol(p) : 0;
+ /* HTTP/1.0 closes unless it says otherwise */
+ p = ka_header(c->head, "Connection:");
+ if(strncmp(c->head, "HTTP/1.0", 8) == 0)
+  c->closing = p == NULL || strncasecmp(p, "keep-alive", 10) != 0;
+ else
+  c->closing = p != NULL && strncasecmp(p, "close", 5) == 0;
+}
+
+/*
+ * Account for 'len' bytes received: complete responses are counted and make
+ * room for new requests. 1 once a response after which the server closes is
+ * complete, -1 on a malformed response.
+ */
+static int ka_receive(struct ka_conn *c, struct ka_thread *t, const char *data, int len)
+{
+ char *end;
+ int take, start;
+
+ while(len > 0)
+ {
+  if(c->body_left < 0)
+  {
+   /* more of the header; the terminator may straddle the previous bytes */
+   take = len < KA_HEAD_SIZE - c->head_len ? len : KA_HEAD_SIZE - c->head_len;
+   if(take == 0) return -1;
+   memcpy(c->head + c->head_len, data, take);
+   start = c->head_len > 3 ? c->head_len - 3 : 0;
+   c->head_len += take;
+   c->head[c->head_len] = '\0';
+   end = strstr(c->head + start, "\r\n\r\n");
+   if(!end)
+   {
+    data += take;
+    len -= take;
+    continue;
+   }
+   /* the bytes after the header go to the body */
+   take -= c->head_len - (int)(end + 4 - c->head);
+   c->head_len = end + 4 - c->head;
+   c->head[c->head_len] = '\0';
+   ka_parse_head(c);
+   data += take;
+   len -= take;
+  }
+  take = len < c->body_left ? len : (int)c->body_left;
+  c->body_left -= take;
+  data += take;
+  len -= take;
+  if(c->body_left > 0) break;
+
+  /* an interim response (100 Continue), the final one follows */
+  if(c->status >= 100 && c->status < 200)
+  {
+   c->head_len = 0;
+   c->body_left = -1;
+   continue;
+  }
+  /* a whole response */
+  if(c->inflight == 0) return -1;
+  hist_record(&t->latency, now_us() - c->sent_at[c->first]);
+  c->first = (c->first + 1) % KA_MAX_PIPELINE;
+  c->inflight--;
+  t->speed++;
+  if(c->status >= 400) t->errors++;
+  c->head_len = 0;
+  c->body_left = -1;
+  if(c->closing) return 1;
+ }
+ return 0;
+}
+
+static void ka_close(struct ka_conn *c, struct ka_thread *t)
+{
+ /* what was in flight is lost */
+ t->failed += c->inflight;
+ close(c->fd);
+ c->fd = -1;
+}
+
+/* open loop: 'c' has room for another request */
+static void ka_ready(struct ka_thread *t, struct ka_conn *c)
+{
+ if(!c->ready && !c->connecting && c->fd >= 0 && c->inflight < pipeline)
+ {
+  c->ready = 1;
+  t->ready[t->ready_count++] = c;
+ }
+}
+
+static void ka_unready(struct ka_thread *t, struct ka_conn *c)
+{
+ int i;
+
+ if(!c->ready) return;
+ for(i = 0; t->ready[i] != c; i++);
+ t->ready[i] = t->ready[--t->ready_count];
+ c->ready = 0;
+}
+
+static void ka_reopen(struct ka_thread *t, struct ka_conn *c, int epfd)
+{
+ if(t->ready) ka_unready(t, c);
+ ka_close(c, t);
+ if(ka_open(c, epfd) < 0) c->fd = -1;
+}
+
+/* open loop: the time between two requests of this thread */
+static double ka_interval(struct ka_thread *t)
+{
+ double mean = threads * 1e6 / rate;
+
+ if(!poisson) return mean;
+ return -log(1.0 - rand_r(&t->seed) / (RAND_MAX + 1.0)) * mean;
+}
+
+/* open loop: a request due at 'due' waits for a connection */
+static void ka_schedule(struct ka_thread *t, unsigned long long due)
+{
+ unsigned long long *larger;
+ size_t i;
+
+ if(t->backlog_len == t->backlog_cap)
+ {
+  if(t->backlog_cap >= KA_MAX_BACKLOG || !(larger = malloc(2 * t->backlog_cap * sizeof(*larger))))
+  {
+   t->failed++;
+   return;
+  }
+  for(i = 0; i < t->backlog_len; i++) larger[i] = t->backlog[(t->backlog_head + i) % t->backlog_cap];
+  free(t->backlog);
+  t->backlog = larger;
+  t->backlog_head = 0;
+  t->backlog_cap *= 2;
+ }
+ t->backlog[(t->backlog_head + t->backlog_len) % t->backlog_cap] = due;
+ t->backlog_len++;
+}
+
+/* open loop: send the due requests on the connections with room */
+static void ka_dispatch(struct ka_thread *t, int epfd)
+{
+ struct ka_conn *c;
+
+ while(t->backlog_len > 0 && t->ready_count > 0)
+ {
+  c = t->ready[t->ready_count - 1];
+  c->sent_at[(c->first + c->inflight) % KA_MAX_PIPELINE] = t->backlog[t->backlog_head];
+  t->backlog_head = (t->backlog_head + 1) % t->backlog_cap;
+  t->backlog_len--;
+  c->inflight++;
+  c->unsent += ka_request_len;
+  if(c->inflight == pipeline) ka_unready(t, c);
+  if(ka_flush(c, epfd) < 0) ka_reopen(t, c, epfd);
+ }
+}
+
+/* wait up to 'timeout' microseconds, finer than epoll_wait() where the kernel allows */
+static int ka_wait(int epfd, struct epoll_event *events, int max, unsigned long long timeout)
+{
+ struct timespec ts;
+ int n;
+
+ if(ka_pwait2)
+ {
+  ts.tv_sec = timeout / 1000000;
+  ts.tv_nsec = timeout % 1000000 * 1000;
+  n = epoll_pwait2(epfd, events, max, &ts, NULL);
+  if(n >= 0 || errno != ENOSYS) return n;
+  ka_pwait2 = 0;
+ }
+ return epoll_wait(epfd, events, max, (int)((timeout + 999) / 1000));
+}
+
+/* open loop: requests due and not answered yet */
+static long ka_outstanding(struct ka_thread *t, struct ka_conn *conns)
+{
+ long n = t->backlog_len;
+ int i;
+
+ for(i = 0; i < t->connections; i++)
+  if(conns[i].fd >= 0) n += conns[i].inflight;
+ return n;
+}
+
+static void *ka_thread_loop(void *arg)
+{
+ struct ka_thread *t = (struct ka_thread *)arg;
+ struct ka_conn *conns;
+ struct epoll_event *events;
+ char *buf;
+ int epfd, i, n, err;
+ socklen_t errlen;
+ unsigned long long now, timeout;
+
+ conns = calloc(t->connections, sizeof(struct ka_conn));
+ events = calloc(t->connections, sizeof(struct epoll_event));
+ buf = malloc(KA_READ_SIZE);
+ epfd = epoll_create1(0);
+ if(rate > 0)
+ {
+  t->ready = calloc(t->connections, sizeof(struct ka_conn *));
+  t->backlog_cap = 1024;
+  t->backlog = malloc(t->backlog_cap * sizeof(*t->backlog));
+  t->next_due = ka_start;
+  t->seed = (unsigned int)(ka_start + (unsigned long long)(size_t)t);
+ }
+ if(!conns || !events || !buf || epfd < 0 || (rate > 0 && (!t->ready || !t->backlog)))
+ {
+  fprintf(stderr, "keep-alive thread: out of memory\n");
+  return NULL;
+ }
+ for(i = 0; i < t->connections; i++)
+  if(ka_open(&conns[i], epfd) < 0)
+  {
+   conns[i].fd = -1;
+   t->failed++;
+  }
+
+ while(1)
+ {
+  now = now_us();
+  timeout = 100000;
+  if(now >= ka_deadline)
+  {
+   /* the open loop waits for the answers to what is due */
+   if(rate == 0 || now >= ka_deadline + KA_DRAIN_US || ka_outstanding(t, conns) == 0) break;
+   timeout = 10000;
+  }
+  else if(rate > 0)
+  {
+   while(t->next_due <= now)
+   {
+    ka_schedule(t, (unsigned long long)t->next_due);
+    t->next_due += ka_interval(t);
+   }
+   ka_dispatch(t, epfd);
+   timeout = (unsigned long long)t->next_due - now;
+  }
+
+  n = ka_wait(epfd, events, t->connections, timeout);
+  for(i = 0; i < n; i++)
+  {
+   struct ka_conn *c = (struct ka_conn *)events[i].data.ptr;
+   int got;
+
+   if(c->connecting)
+   {
+    err = 0;
+    errlen = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+    if(err != 0)
+    {
+     t->failed++;
+     ka_reopen(t, c, epfd);
+     continue;
+    }
+    c->connecting = 0;
+    if(rate > 0) ka_ready(t, c);
+    else ka_queue(c);
+   }
+   if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+   {
+    got = recv(c->fd, buf, KA_READ_SIZE, 0);
+    if(got > 0) t->bytes += got;
+    if(!(got < 0 && errno == EAGAIN) && (got <= 0 || ka_receive(c, t, buf, got) != 0))
+    {
+     /* closed by the server: open another connection */
+     ka_reopen(t, c, epfd);
+     continue;
+    }
+    if(rate > 0) ka_ready(t, c);
+    else ka_queue(c);
+   }
+   if(ka_flush(c, epfd) < 0) ka_reopen(t, c, epfd);
+  }
+  if(rate > 0) ka_dispatch(t, epfd);
+ }
+
+ /* closed loop: the requests still in flight at the end are not counted either way; open loop: they timed out */
+ if(rate > 0) t->failed += ka_outstanding(t, conns);
+ for(i = 0; i < t->connections; i++)
+  if(conns[i].fd >= 0) close(conns[i].fd);
+ close(epfd);
+ free(t->backlog);
+ free(t->ready);
+ free(buf);
+ free(events);
+ free(conns);
+ return NULL;
+}
+
+#define KA_PERCENTILES 6
+static const double ka_percentiles[KA_PERCENTILES] = { 50, 90, 99, 99.9, 99.99, 99.999 };
+
+/*
+ * The results as JSON, to 'path' or to the standard output for "-": the
+ * settings, the counts, the percentiles and the whole histogram (the upper
+ * bound of every bucket that is not empty, in microseconds, and its count).
+ */
+static int ka_write_json(const char *path, const struct histogram *h, long speed, long failed, long errors, long long bytes)
+{
+ FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+ const char *sep = "";
+ int i;
+
+ if(f == NULL) return -1;
+ fprintf(f, "{\n  \"url\": \"%s\",\n  \"mode\": \"%s\",\n", ka_url, rate > 0 ? "open" : "closed");
+ if(rate > 0) fprintf(f, "  \"rate\": %.0f,\n  \"arrivals\": \"%s\",\n", rate, poisson ? "poisson" : "uniform");
+ fprintf(f, "  \"seconds\": %d,\n  \"connections\": %d,\n  \"threads\": %d,\n  \"pipeline\": %d,\n",
+         benchtime, clients, threads, pipeline);
+ fprintf(f, "  \"requests\": { \"succeeded\": %ld, \"failed\": %ld, \"errors\": %ld },\n", speed, failed, errors);
+ fprintf(f, "  \"throughput\": %.1f,\n  \"bytes_per_sec\": %lld,\n", speed / (double)benchtime, bytes / benchtime);
+ fprintf(f, "  \"latency_us\": {\n    \"mean\": %.1f,\n", h->total ? h->sum / (double)h->total : 0.0);
+ for(i = 0; i < KA_PERCENTILES; i++)
+  fprintf(f, "    \"p%g\": %llu,\n", ka_percentiles[i], hist_percentile(h, ka_percentiles[i]));
+ fprintf(f, "    \"max\": %llu\n  },\n  \"histogram_us\": [", h->max);
+ for(i = 0; i < HIST_BUCKETS; i++)
+  if(h->counts[i])
+  {
+   fprintf(f, "%s[%llu, %llu]", sep, hist_bucket_top(i), h->counts[i]);
+   sep = ", ";
+  }
+ fprintf(f, "]\n}\n");
+ if(f != stdout) return fclose(f) == 0 ? 0 : -1;
+ return fflush(f) == 0 ? 0 : -1;
+}
+
+/* the keep-alive benchmark, same return codes as bench() */
+static int bench_keepalive(void)
+{
+ struct ka_thread *ts;
+ struct histogram *total;
+ struct hostent *hp;
+ struct rlimit rl;
+ const char *name = proxyhost == NULL ? host : proxyhost;
+ long speed = 0, failed = 0, errors = 0;
+ long long bytes = 0;
+ int i, s;
+
+ /* check avaibility of target server */
+ s = Socket(name, proxyport);
+ if(s < 0)
+ {
+  fprintf(stderr, "\nConnect to server failed. Aborting benchmark.\n");
+  return 1;
+ }
+ close(s);
+
+ memset(&ka_server, 0, sizeof(ka_server));
+ ka_server.sin_family = AF_INET;
+ ka_server.sin_port = htons(proxyport);
+ if(inet_aton(name, &ka_server.sin_addr) == 0)
+ {
+  hp = gethostbyname(name);
+  if(hp == NULL) return 1;
+  memcpy(&ka_server.sin_addr, hp->h_addr, hp->h_length);
+ }
+
+ /* room for every connection */
+ if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+ {
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+ }
+
+ ka_request_len = strlen(request);
+ ka_requests = malloc((size_t)ka_request_len * (pipeline + 1));
+ ts = calloc(threads, sizeof(struct ka_thread));
+ total = calloc(1, sizeof(struct histogram));
+ if(!ka_requests || !ts || !total) return 3;
+ for(i = 0; i <= pipeline; i++) memcpy(ka_requests + i * ka_request_len, request, ka_request_len);
+
+ ka_start = now_us();
+ ka_deadline = ka_start + (unsigned long long)benchtime * 1000000;
+ for(i = 0; i < threads; i++)
+ {
+  ts[i].connections = clients / threads + (i < clients % threads);
+  if(ts[i].connections == 0) continue;
+  if(pthread_create(&ts[i].thread, NULL, ka_thread_loop, &ts[i]) != 0)
+  {
+   perror("pthread_create failed.");
+   return 3;
+  }
+ }
+ for(i = 0; i < threads; i++)
+ {
+  if(ts[i].connections == 0) continue;
+  pthread_join(ts[i].thread, NULL);
+  speed += ts[i].speed;
+  failed += ts[i].failed;
+  errors += ts[i].errors;
+  bytes += ts[i].bytes;
+  hist_merge(total, &ts[i].latency);
+ }
+
+ printf("\nSpeed=%d pages/min, %lld bytes/sec.\nRequests: %ld susceed, %ld failed, %ld error responses.\n",
+        (int)((speed + failed) / (benchtime / 60.0f)),
+        bytes / benchtime,
+        speed,
+        failed,
+        errors);
+ if(rate > 0)
+  printf("Rate: %.0f requests/sec due (%s), %.0f answered/sec.\n", rate, poisson ? "poisson" : "uniform",
+         speed / (double)benchtime);
+ if(total->total > 0)
+ {
+  printf("Latency (ms):");
+  for(i = 0; i < KA_PERCENTILES; i++)
+   printf(" p%g %.3f", ka_percentiles[i], hist_percentile(total, ka_percentiles[i]) / 1000.0);
+  printf(" max %.3f\n", total->max / 1000.0);
+ }
+ if(json_path && ka_write_json(json_path, total, speed, failed, errors, bytes) < 0)
+  perror("writing the JSON results failed.");
+ free(total);
+ free(ts);
+ free(ka_requests);
+ return 0;
+}
@@ -49,6 +49,14 @@ int mypipe[2];
 char host[MAXHOSTNAMELEN];
 #define REQUEST_SIZE 2048
 char request[REQUEST_SIZE];
+/* -H: header lines added to the request, within the room the URL leaves */
+#define MAX_HEADERS 16
+#define MAX_HEADERS_SIZE 400
+char *extra_headers[MAX_HEADERS];
+int extra_header_count=0;
+int extra_headers_size=0;
+
+#include "keepalive.c"
 
 static const struct option long_options[]=
 {
@@ -66,6 +74,13 @@ static const struct option long_options[]=
  {"version",no_argument,NULL,'V'},
  {"proxy",required_argument,NULL,'p'},
  {"clients",required_argument,NULL,'c'},
+ {"keepalive",no_argument,NULL,'k'},
+ {"threads",required_argument,NULL,'T'},
+ {"pipeline",required_argument,NULL,'P'},
+ {"rate",required_argument,NULL,'R'},
+ {"poisson",no_argument,&poisson,1},
+ {"json",required_argument,NULL,'J'},
+ {"header",required_argument,NULL,'H'},
  {NULL,0,NULL,0}
 };
 
@@ -95,6 +110,16 @@ static void usage(void)
 	"  --head                   Use HEAD request method.\n"
 	"  --options                Use OPTIONS request method.\n"
 	"  --trace                  Use TRACE request method.\n"
+	"  -k|--keepalive           Keep-alive mode: persistent HTTP/1.1 connections\n"
+	"                           on epoll threads, with latency percentiles.\n"
+	"  -T|--threads <n>         Threads of the keep-alive mode. Default one.\n"
+	"  -P|--pipeline <n>        Requests in flight per connection. Default one.\n"
+	"  -R|--rate <n>            Open loop: <n> requests/sec on a fixed schedule,\n"
+	"                           latency from the time they were due. Implies -k.\n"
+	"  --poisson                Poisson arrivals for -R instead of even spacing.\n"
+	"  -J|--json <file>         Write the results of -k as JSON, - for stdout.\n"
+	"  -H|--header <line>       Add a header line to the request, e.g.\n"
+	"                           \"Accept-Encoding: gzip\". May be repeated.\n"
 	"  -?|-h|--help             This information.\n"
 	"  -V|--version             Display program version.\n"
 	);
@@ -111,7 +136,7 @@ int main(int argc, char *argv[])
           return 2;
  } 
 
- while((opt=getopt_long(argc,argv,"912Vfrt:p:c:?h",long_options,&options_index))!=EOF )
+ while((opt=getopt_long(argc,argv,"912Vfrt:p:c:?hkT:P:R:J:H:",long_options,&options_index))!=EOF )
  {
   switch(opt)
   {
@@ -147,6 +172,26 @@ int main(int argc, char *argv[])
    case 'h':
    case '?': usage();return 2;break;
    case 'c': clients=atoi(optarg);break;
+   case 'k': keepalive=1;break;
+   case 'T': threads=atoi(optarg);break;
+   case 'P': pipeline=atoi(optarg);break;
+   case 'R': rate=atof(optarg);keepalive=1;
+	     if(rate<=0)
+	     {
+		     fprintf(stderr,"Error in option --rate %s: not a positive rate.\n",optarg);
+		     return 2;
+	     }
+	     break;
+   case 'J': json_path=optarg;break;
+   case 'H':
+	     extra_headers_size+=strlen(optarg)+2;
+	     if(extra_header_count==MAX_HEADERS || extra_headers_size>MAX_HEADERS_SIZE)
+	     {
+		     fprintf(stderr,"Error in option --header %s: at most %d headers of %d bytes in all.\n",optarg,MAX_HEADERS,MAX_HEADERS_SIZE);
+		     return 2;
+	     }
+	     extra_headers[extra_header_count++]=optarg;
+	     break;
   }
  }
  
@@ -158,6 +203,20 @@ int main(int argc, char *argv[])
 
  if(clients==0) clients=1;
  if(benchtime==0) benchtime=60;
+ if(threads<=0) threads=1;
+ if(pipeline<=0) pipeline=1;
+ if(pipeline>KA_MAX_PIPELINE)
+ {
+	 fprintf(stderr,"webbench: at most %d requests in flight per connection.\n",KA_MAX_PIPELINE);
+	 return 2;
+ }
+ if(keepalive && http10<2) http10=2;
+ if(json_path && !keepalive)
+ {
+	 fprintf(stderr,"webbench: -J needs -k or -R.\n");
+	 return 2;
+ }
+ ka_url=argv[optind];
  /* Copyright */
  fprintf(stderr,"Webbench - Simple Web Benchmark "PROGRAM_VERSION"\n"
 	 "Copyright (c) Radim Kolar 1997-2004, GPL Open Source Software.\n"
@@ -192,8 +251,10 @@ int main(int argc, char *argv[])
  if(force) printf(", early socket close");
  if(proxyhost!=NULL) printf(", via proxy server %s:%d",proxyhost,proxyport);
  if(force_reload) printf(", forcing reload");
+ if(keepalive) printf(", keep-alive on %d thread%s, %d in flight per connection",threads,threads>1?"s":"",pipeline);
+ if(rate>0) printf(", open loop at %.0f requests/sec",rate);
  printf(".\n");
- return bench();
+ return keepalive ? bench_keepalive() : bench();
 }
 
 void build_request(const char *url)
@@ -283,8 +344,14 @@ void build_request(const char *url)
   {
 	  strcat(request,"Pragma: no-cache\r\n");
   }
+  if(http10>0)
+	  for(i=0;i<extra_header_count;i++)
+	  {
+		  strcat(request,extra_headers[i]);
+		  strcat(request,"\r\n");
+	  }
   if(http10>1)
-	  strcat(request,"Connection: close\r\n");
+	  strcat(request,keepalive?"Connection: keep-alive\r\n":"Connection: close\r\n");
   /* add empty line at end */
   if(http10>0) strcat(request,"\r\n"); 
   // printf("Req=%s\n",request);